@@ -3,6 +3,8 @@
 MESON_TARGET="$1"
 CARGO_TOML="$2"
 DLL_OUTPUT_PATH="$3"
+VERBOSE_LOGGING="$4"
+TRACING="$5"
 
 if [[ "$MESON_TARGET" == "x86" ]]; then
   TARGET=i686-pc-windows-gnu
@@ -17,6 +19,14 @@ ROOT=$(dirname "$(realpath "$CARGO_TOML")")/..
 OUTPUT_DIR=$(dirname "$(realpath "$DLL_OUTPUT_PATH")")
 CARGO_TARGET_DIR=${OUTPUT_DIR}/target
 
-cargo build --manifest-path=$CARGO_TOML --target-dir "$CARGO_TARGET_DIR" --release --target $TARGET
+CARGO_FLAGS=()
+if [[ "$VERBOSE_LOGGING" == "true" ]]; then
+  CARGO_FLAGS+=(--no-default-features)
+fi
+if [[ "$TRACING" == "true" ]]; then
+  CARGO_FLAGS+=(--features tracing)
+fi
+
+cargo build --manifest-path=$CARGO_TOML --target-dir "$CARGO_TARGET_DIR" --release --target $TARGET "${CARGO_FLAGS[@]}"
 strip ${CARGO_TARGET_DIR}/${TARGET}/release/dhc.dll -o "${OUTPUT_DIR}/dhc.dll"
 strip ${CARGO_TARGET_DIR}/${TARGET}/release/dhc.exe -o "${OUTPUT_DIR}/dhc.exe"
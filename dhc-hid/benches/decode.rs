@@ -0,0 +1,9 @@
+//! Per-report cost of decoding input reports through a report plan and through each native parser.
+
+fn main() {
+  let iterations = 10_000_000;
+  let report = ("report plan", dhc_hid::report::benchmark(iterations));
+  for (name, nanos) in std::iter::once(report).chain(dhc_hid::native::benchmark(iterations)) {
+    println!("{:<24} {:>6.1} ns per report", format!("{}:", name), nanos);
+  }
+}
@@ -0,0 +1,9 @@
+//! The parts of dhc's input handling that don't depend on Windows: the input types that cross the
+//! C API, decoding of HID reports through report plans and native parsers, and the negotiation that
+//! switches controllers into their full reports. Keeping these apart lets them be tested and
+//! benchmarked anywhere, with `cargo test` and `cargo bench`.
+
+pub mod native;
+pub mod negotiate;
+pub mod report;
+pub mod types;
@@ -0,0 +1,507 @@
+//! Fixed-offset parsers for controllers whose report layouts we know ahead of time.
+//!
+//! These skip hid.dll (and the report plan) entirely, and also understand reports that aren't in
+//! the device's report descriptor, like the extended Bluetooth reports of Sony controllers.
+//! Nothing in here depends on Windows.
+
+use crate::negotiate::Negotiation;
+use crate::types::{DeviceInputs, Hat};
+
+const VID_SONY: u16 = 0x054c;
+const VID_NINTENDO: u16 = 0x057e;
+
+#[derive(Clone, Copy, Debug)]
+enum LayoutKind {
+  /// Sticks, hat and face buttons, shoulder buttons, PS/touchpad, then analog triggers.
+  DualShock4,
+
+  /// Sticks, analog triggers, a counter, hat and face buttons, shoulder buttons, then PS/touchpad.
+  DualSense,
+
+  /// Right buttons, shared buttons, left buttons, then 12-bit packed sticks.
+  SwitchPro,
+}
+
+impl LayoutKind {
+  /// Bits that the parser looks at, starting at the layout's offset.
+  fn mask(self) -> &'static [u8] {
+    match self {
+      LayoutKind::DualShock4 => &[0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x03, 0xff, 0xff],
+      LayoutKind::DualSense => &[0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0x03],
+      LayoutKind::SwitchPro => &[0xff, 0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff],
+    }
+  }
+}
+
+/// Range of a raw stick axis: where it rests, and how far it travels either way from there.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct AxisCalibration {
+  pub center: u16,
+  pub below: u16,
+  pub above: u16,
+}
+
+impl AxisCalibration {
+  fn apply(&self, raw: u16) -> f32 {
+    let offset = f32::from(raw) - f32::from(self.center);
+    let range = if offset < 0.0 { self.below } else { self.above };
+    (0.5 + 0.5 * offset / f32::from(range.max(1))).max(0.0).min(1.0)
+  }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct StickCalibration {
+  pub x: AxisCalibration,
+  pub y: AxisCalibration,
+}
+
+/// Corrections that a particular controller needs, read from it while negotiating. Sticks without
+/// a calibration are scaled over the whole range of their raw values.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Calibration {
+  pub left_stick: Option<StickCalibration>,
+  pub right_stick: Option<StickCalibration>,
+}
+
+/// A report that we know how to parse.
+#[derive(Clone, Copy, Debug)]
+pub struct NativeLayout {
+  pub report_id: u8,
+
+  /// Minimum length of the report, including the report ID. Layouts that share a report ID are
+  /// told apart by this, so they're listed from longest to shortest.
+  pub min_len: usize,
+
+  /// Offset of the first byte that the parser looks at.
+  offset: usize,
+
+  kind: LayoutKind,
+}
+
+impl NativeLayout {
+  const fn new(report_id: u8, min_len: usize, offset: usize, kind: LayoutKind) -> NativeLayout {
+    NativeLayout {
+      report_id,
+      min_len,
+      offset,
+      kind,
+    }
+  }
+
+  fn matches(&self, data: &[u8]) -> bool {
+    data.len() >= self.min_len && data[0] == self.report_id
+  }
+
+  /// Bitmask over the report of every bit that the parser looks at, including the report ID.
+  pub fn relevance_mask(&self) -> Vec<u8> {
+    let mut mask = vec![0u8; self.min_len];
+    mask[0] = 0xff;
+    let kind_mask = self.kind.mask();
+    mask[self.offset..self.offset + kind_mask.len()].copy_from_slice(kind_mask);
+    mask
+  }
+
+  fn parse(&self, data: &[u8], calibration: &Calibration) -> DeviceInputs {
+    let data = &data[self.offset..];
+    match self.kind {
+      LayoutKind::DualShock4 => parse_sony(&data[0..4], data[4], data[5], data[6], data[7], data[8]),
+      LayoutKind::DualSense => parse_sony(&data[0..4], data[7], data[8], data[9], data[4], data[5]),
+      LayoutKind::SwitchPro => parse_switch_pro(data, calibration),
+    }
+  }
+}
+
+fn byte_axis(value: u8) -> f32 {
+  f32::from(value) / 255.0
+}
+
+fn hat_from_nibble(value: u8) -> Hat {
+  match value & 0x0f {
+    0 => Hat::North,
+    1 => Hat::NorthEast,
+    2 => Hat::East,
+    3 => Hat::SouthEast,
+    4 => Hat::South,
+    5 => Hat::SouthWest,
+    6 => Hat::West,
+    7 => Hat::NorthWest,
+    _ => Hat::Neutral,
+  }
+}
+
+/// Sony controllers share everything but the position of the bytes.
+fn parse_sony(sticks: &[u8], hat_face: u8, shoulders: u8, system: u8, l2: u8, r2: u8) -> DeviceInputs {
+  let mut result = DeviceInputs::default();
+  result.axis_left_stick_x.set_value(byte_axis(sticks[0]));
+  result.axis_left_stick_y.set_value(byte_axis(sticks[1]));
+  result.axis_right_stick_x.set_value(byte_axis(sticks[2]));
+  result.axis_right_stick_y.set_value(byte_axis(sticks[3]));
+  result.axis_left_trigger.set_value(byte_axis(l2));
+  result.axis_right_trigger.set_value(byte_axis(r2));
+
+  result.hat_dpad = hat_from_nibble(hat_face);
+  result.button_west.set_value(hat_face & 0x10 != 0);
+  result.button_south.set_value(hat_face & 0x20 != 0);
+  result.button_east.set_value(hat_face & 0x40 != 0);
+  result.button_north.set_value(hat_face & 0x80 != 0);
+
+  result.button_l1.set_value(shoulders & 0x01 != 0);
+  result.button_r1.set_value(shoulders & 0x02 != 0);
+  result.button_l2.set_value(shoulders & 0x04 != 0);
+  result.button_r2.set_value(shoulders & 0x08 != 0);
+  result.button_select.set_value(shoulders & 0x10 != 0);
+  result.button_start.set_value(shoulders & 0x20 != 0);
+  result.button_l3.set_value(shoulders & 0x40 != 0);
+  result.button_r3.set_value(shoulders & 0x80 != 0);
+
+  result.button_home.set_value(system & 0x01 != 0);
+  result.button_trackpad.set_value(system & 0x02 != 0);
+  result
+}
+
+/// Buttons are mapped by position, so B (bottom) is south and A (right) is east.
+fn parse_switch_pro(data: &[u8], calibration: &Calibration) -> DeviceInputs {
+  let (right, shared, left) = (data[0], data[1], data[2]);
+
+  let mut result = DeviceInputs::default();
+  result.button_west.set_value(right & 0x01 != 0);
+  result.button_north.set_value(right & 0x02 != 0);
+  result.button_south.set_value(right & 0x04 != 0);
+  result.button_east.set_value(right & 0x08 != 0);
+  result.button_r1.set_value(right & 0x40 != 0);
+  result.button_r2.set_value(right & 0x80 != 0);
+
+  result.button_select.set_value(shared & 0x01 != 0);
+  result.button_start.set_value(shared & 0x02 != 0);
+  result.button_r3.set_value(shared & 0x04 != 0);
+  result.button_l3.set_value(shared & 0x08 != 0);
+  result.button_home.set_value(shared & 0x10 != 0);
+  result.button_trackpad.set_value(shared & 0x20 != 0);
+
+  result.button_l1.set_value(left & 0x40 != 0);
+  result.button_l2.set_value(left & 0x80 != 0);
+
+  let (down, up) = (left & 0x01 != 0, left & 0x02 != 0);
+  let (east, west) = (left & 0x04 != 0, left & 0x08 != 0);
+  result.hat_dpad = match (up && !down, down && !up, east && !west, west && !east) {
+    (true, _, true, _) => Hat::NorthEast,
+    (true, _, _, true) => Hat::NorthWest,
+    (true, _, _, _) => Hat::North,
+    (_, true, true, _) => Hat::SouthEast,
+    (_, true, _, true) => Hat::SouthWest,
+    (_, true, _, _) => Hat::South,
+    (_, _, true, _) => Hat::East,
+    (_, _, _, true) => Hat::West,
+    _ => Hat::Neutral,
+  };
+
+  // The triggers are digital.
+  let trigger = |pressed: bool| if pressed { 1.0 } else { 0.0 };
+  result.axis_left_trigger.set_value(trigger(result.button_l2.get()));
+  result.axis_right_trigger.set_value(trigger(result.button_r2.get()));
+
+  // Sticks are packed as pairs of 12-bit values, with Y pointing up.
+  let stick = |bytes: &[u8], calibration: Option<&StickCalibration>| {
+    let x = u16::from(bytes[0]) | (u16::from(bytes[1] & 0x0f) << 8);
+    let y = u16::from(bytes[1] >> 4) | (u16::from(bytes[2]) << 4);
+    let (x, y) = match calibration {
+      Some(calibration) => (calibration.x.apply(x), calibration.y.apply(y)),
+      None => (f32::from(x) / 4095.0, f32::from(y) / 4095.0),
+    };
+    (x, 1.0 - y)
+  };
+  let (lx, ly) = stick(&data[3..6], calibration.left_stick.as_ref());
+  let (rx, ry) = stick(&data[6..9], calibration.right_stick.as_ref());
+  result.axis_left_stick_x.set_value(lx);
+  result.axis_left_stick_y.set_value(ly);
+  result.axis_right_stick_x.set_value(rx);
+  result.axis_right_stick_y.set_value(ry);
+  result
+}
+
+/// A controller with known report layouts.
+#[derive(Debug)]
+pub struct NativeDevice {
+  pub name: &'static str,
+  vendor_id: u16,
+  product_ids: &'static [u16],
+  layouts: &'static [NativeLayout],
+
+  /// How to switch the device over to the reports that we want, if it needs it.
+  pub negotiation: Option<Negotiation>,
+}
+
+static DEVICES: &[NativeDevice] = &[
+  NativeDevice {
+    name: "DualShock 4",
+    vendor_id: VID_SONY,
+    product_ids: &[0x05c4, 0x09cc, 0x0ba0],
+    layouts: &[
+      // USB, and the simple Bluetooth report that the controller starts out sending.
+      NativeLayout::new(0x01, 10, 1, LayoutKind::DualShock4),
+      // Full Bluetooth report.
+      NativeLayout::new(0x11, 12, 3, LayoutKind::DualShock4),
+    ],
+    negotiation: Some(Negotiation::DualShock4),
+  },
+  NativeDevice {
+    name: "DualSense",
+    vendor_id: VID_SONY,
+    product_ids: &[0x0ce6, 0x0df2],
+    layouts: &[
+      // USB.
+      NativeLayout::new(0x01, 64, 1, LayoutKind::DualSense),
+      // Simple Bluetooth report, which is laid out like the DualShock 4's.
+      NativeLayout::new(0x01, 10, 1, LayoutKind::DualShock4),
+      // Full Bluetooth report.
+      NativeLayout::new(0x31, 12, 2, LayoutKind::DualSense),
+    ],
+    negotiation: Some(Negotiation::DualSense),
+  },
+  NativeDevice {
+    name: "Switch Pro Controller",
+    vendor_id: VID_NINTENDO,
+    product_ids: &[0x2009],
+    layouts: &[
+      // Full report, over both USB and Bluetooth.
+      NativeLayout::new(0x30, 12, 3, LayoutKind::SwitchPro),
+    ],
+    negotiation: Some(Negotiation::SwitchPro),
+  },
+];
+
+/// Find the native parser for a device, if there is one.
+pub fn lookup(vendor_id: u16, product_id: u16) -> Option<&'static NativeDevice> {
+  DEVICES
+    .iter()
+    .find(|device| device.vendor_id == vendor_id && device.product_ids.contains(&product_id))
+}
+
+impl NativeDevice {
+  pub fn layouts(&self) -> &'static [NativeLayout] {
+    self.layouts
+  }
+
+  /// Parse a report, or return None if it isn't one that we know about.
+  pub fn parse(&self, data: &[u8], calibration: &Calibration) -> Option<DeviceInputs> {
+    self
+      .layouts
+      .iter()
+      .find(|layout| layout.matches(data))
+      .map(|layout| layout.parse(data, calibration))
+  }
+}
+
+/// DualShock 4 over USB: left stick up and to the right, cross, R1 and dpad east held, right
+/// trigger half pressed.
+const DS4_USB_REPORT: [u8; 64] = [
+  0x01, 0xd2, 0x1c, 0x7e, 0x81, 0x22, 0x02, 0x6c, 0x00, 0x80, 0x1f, 0x2a, 0xfb, 0x02, 0x00, 0xf8,
+  0xff, 0x07, 0x00, 0xc4, 0x1f, 0x3c, 0x04, 0x6e, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1b, 0x00,
+  0x00, 0x01, 0x80, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+  0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00,
+];
+
+/// DualShock 4 over Bluetooth, before negotiation: the same as USB, cut short.
+#[cfg(test)]
+const DS4_BT_SIMPLE_REPORT: [u8; 10] = [0x01, 0x80, 0x7f, 0x80, 0x80, 0x18, 0x00, 0x01, 0x00, 0x00];
+
+/// DualShock 4 over Bluetooth, after negotiation: right stick down and to the left, triangle, L2
+/// and options held, dpad neutral.
+const DS4_BT_FULL_REPORT: [u8; 78] = [
+  0x11, 0xc0, 0x00, 0x7f, 0x80, 0x05, 0xf9, 0x88, 0x24, 0xa4, 0xff, 0x00, 0x5b, 0x11, 0x06, 0x00,
+  0x02, 0x00, 0xfd, 0xff, 0x1f, 0x00, 0x48, 0x20, 0x9e, 0xfc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x1b, 0x00, 0x00, 0x01, 0x80, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+  0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5d, 0x8a, 0x31, 0x07,
+];
+
+/// DualSense over USB: left trigger fully pressed, square, L1 and the PS button held, dpad
+/// south-west.
+const DUALSENSE_USB_REPORT: [u8; 64] = [
+  0x01, 0x7f, 0x7e, 0x80, 0x81, 0xff, 0x00, 0x3a, 0x15, 0x01, 0x01, 0x00, 0x8c, 0x21, 0x5f, 0x33,
+  0x02, 0x00, 0xfd, 0xff, 0x04, 0x00, 0x13, 0x02, 0x2c, 0x1f, 0xa2, 0x06, 0x9b, 0xf2, 0x4e, 0x00,
+  0x10, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x09, 0x09, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x4f, 0x1b, 0x2f, 0x00, 0x29, 0x08, 0x00, 0x14, 0x2e, 0xbb, 0x5c, 0x1e, 0x3d, 0xa1, 0x8c,
+];
+
+/// DualSense over Bluetooth, after negotiation: left stick fully left, circle, R3 and the
+/// touchpad button held.
+const DUALSENSE_BT_REPORT: [u8; 78] = [
+  0x31, 0x42, 0x00, 0x80, 0x80, 0x7f, 0x00, 0x00, 0x1c, 0x48, 0x80, 0x02, 0x00, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0xfd, 0xff, 0x04, 0x00, 0x13, 0x02, 0x2c, 0x1f, 0xa2, 0x06, 0x9b, 0xf2, 0x4e, 0x00,
+  0x10, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x09, 0x09, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x4f, 0x1b, 0x2f, 0x00, 0x29, 0x08, 0x00, 0x14, 0x2e, 0xbb, 0x5c, 0x1e, 0x3d, 0xa1, 0x8c,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x91, 0x0c, 0x77,
+];
+
+/// Switch Pro Controller in full report mode: left stick fully right and down, right stick
+/// centered, B, R, ZL, minus and dpad up and right held.
+const SWITCH_PRO_REPORT: [u8; 49] = [
+  0x30, 0x5e, 0x91, 0x44, 0x01, 0x86, 0xff, 0x0f, 0x00, 0x00, 0x08, 0x80, 0x0c, 0xf4, 0xff, 0x2a,
+  0x00, 0x3b, 0x10, 0x12, 0x00, 0x0c, 0x00, 0xf5, 0xff, 0x2a, 0x00, 0x3a, 0x10, 0x13, 0x00, 0x0d,
+  0x00, 0xf4, 0xff, 0x2b, 0x00, 0x3b, 0x10, 0x12, 0x00, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00,
+];
+
+/// Time each native parser, in nanoseconds per report.
+pub fn benchmark(iterations: u32) -> Vec<(&'static str, f64)> {
+  let cases: [(&'static str, u16, u16, &[u8]); 5] = [
+    ("DualShock 4 USB", VID_SONY, 0x09cc, &DS4_USB_REPORT),
+    ("DualShock 4 Bluetooth", VID_SONY, 0x09cc, &DS4_BT_FULL_REPORT),
+    ("DualSense USB", VID_SONY, 0x0ce6, &DUALSENSE_USB_REPORT),
+    ("DualSense Bluetooth", VID_SONY, 0x0ce6, &DUALSENSE_BT_REPORT),
+    ("Switch Pro", VID_NINTENDO, 0x2009, &SWITCH_PRO_REPORT),
+  ];
+
+  cases
+    .iter()
+    .map(|&(name, vendor_id, product_id, report)| {
+      let device = lookup(vendor_id, product_id).expect("benchmarked device isn't registered");
+      let start = std::time::Instant::now();
+      for _ in 0..iterations {
+        std::hint::black_box(device.parse(std::hint::black_box(report), &Calibration::default()));
+      }
+      (name, start.elapsed().as_nanos() as f64 / f64::from(iterations.max(1)))
+    })
+    .collect()
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  fn parse(vendor_id: u16, product_id: u16, report: &[u8]) -> Option<DeviceInputs> {
+    lookup(vendor_id, product_id).unwrap().parse(report, &Calibration::default())
+  }
+
+  #[test]
+  fn lookup_unknown() {
+    assert!(lookup(VID_SONY, 0x0268).is_none());
+    assert!(lookup(0x045e, 0x02ea).is_none());
+  }
+
+  #[test]
+  fn ds4_usb() {
+    let inputs = parse(VID_SONY, 0x09cc, &DS4_USB_REPORT).unwrap();
+    assert_eq!(inputs.axis_left_stick_x.get(), 0xd2 as f32 / 255.0);
+    assert_eq!(inputs.axis_left_stick_y.get(), 0x1c as f32 / 255.0);
+    assert_eq!(inputs.axis_right_stick_x.get(), 0x7e as f32 / 255.0);
+    assert_eq!(inputs.axis_right_stick_y.get(), 0x81 as f32 / 255.0);
+    assert_eq!(inputs.axis_left_trigger.get(), 0.0);
+    assert_eq!(inputs.axis_right_trigger.get(), 0x80 as f32 / 255.0);
+    assert_eq!(inputs.hat_dpad, Hat::East);
+    assert!(inputs.button_south.get());
+    assert!(inputs.button_r1.get());
+    assert!(!inputs.button_home.get());
+    assert!(!inputs.button_trackpad.get());
+  }
+
+  #[test]
+  fn ds4_bluetooth_simple() {
+    let inputs = parse(VID_SONY, 0x09cc, &DS4_BT_SIMPLE_REPORT).unwrap();
+    assert_eq!(inputs.hat_dpad, Hat::Neutral);
+    assert!(inputs.button_west.get());
+    assert!(inputs.button_home.get());
+  }
+
+  #[test]
+  fn ds4_bluetooth_full() {
+    let inputs = parse(VID_SONY, 0x09cc, &DS4_BT_FULL_REPORT).unwrap();
+    assert_eq!(inputs.axis_left_stick_x.get(), 0x7f as f32 / 255.0);
+    assert_eq!(inputs.axis_right_stick_x.get(), 0x05 as f32 / 255.0);
+    assert_eq!(inputs.axis_right_stick_y.get(), 0xf9 as f32 / 255.0);
+    assert_eq!(inputs.axis_left_trigger.get(), 1.0);
+    assert_eq!(inputs.hat_dpad, Hat::Neutral);
+    assert!(inputs.button_north.get());
+    assert!(inputs.button_l2.get());
+    assert!(inputs.button_start.get());
+    assert!(!inputs.button_south.get());
+  }
+
+  #[test]
+  fn dualsense_usb() {
+    let inputs = parse(VID_SONY, 0x0ce6, &DUALSENSE_USB_REPORT).unwrap();
+    assert_eq!(inputs.axis_left_trigger.get(), 1.0);
+    assert_eq!(inputs.axis_right_trigger.get(), 0.0);
+    assert_eq!(inputs.hat_dpad, Hat::SouthWest);
+    assert!(inputs.button_west.get());
+    assert!(inputs.button_l1.get());
+    assert!(inputs.button_home.get());
+    assert!(!inputs.button_east.get());
+  }
+
+  #[test]
+  fn dualsense_bluetooth() {
+    let inputs = parse(VID_SONY, 0x0ce6, &DUALSENSE_BT_REPORT).unwrap();
+    assert_eq!(inputs.axis_left_stick_x.get(), 0.0);
+    assert_eq!(inputs.axis_left_stick_y.get(), 0x80 as f32 / 255.0);
+    assert_eq!(inputs.hat_dpad, Hat::Neutral);
+    assert!(inputs.button_east.get());
+    assert!(inputs.button_r3.get());
+    assert!(inputs.button_trackpad.get());
+    assert!(!inputs.button_home.get());
+  }
+
+  #[test]
+  fn switch_pro() {
+    let inputs = parse(VID_NINTENDO, 0x2009, &SWITCH_PRO_REPORT).unwrap();
+    assert_eq!(inputs.axis_left_stick_x.get(), 1.0);
+    assert_eq!(inputs.axis_left_stick_y.get(), 1.0);
+    assert_eq!(inputs.axis_right_stick_x.get(), 2048.0 / 4095.0);
+    assert_eq!(inputs.axis_right_stick_y.get(), 1.0 - 2048.0 / 4095.0);
+    assert_eq!(inputs.axis_left_trigger.get(), 1.0);
+    assert_eq!(inputs.axis_right_trigger.get(), 0.0);
+    assert_eq!(inputs.hat_dpad, Hat::NorthEast);
+    assert!(inputs.button_south.get());
+    assert!(inputs.button_r1.get());
+    assert!(inputs.button_l2.get());
+    assert!(inputs.button_select.get());
+    assert!(!inputs.button_east.get());
+  }
+
+  #[test]
+  fn switch_pro_calibrated() {
+    let axis = |center, below, above| AxisCalibration { center, below, above };
+    let calibration = Calibration {
+      left_stick: Some(StickCalibration {
+        x: axis(2000, 1500, 1500),
+        y: axis(2100, 1600, 1400),
+      }),
+      right_stick: Some(StickCalibration {
+        x: axis(2048, 1024, 1024),
+        y: axis(1948, 1000, 1000),
+      }),
+    };
+    let device = lookup(VID_NINTENDO, 0x2009).unwrap();
+    let inputs = device.parse(&SWITCH_PRO_REPORT, &calibration).unwrap();
+
+    // The left stick is pushed past the edges of its calibrated range, and gets clamped.
+    assert_eq!(inputs.axis_left_stick_x.get(), 1.0);
+    assert_eq!(inputs.axis_left_stick_y.get(), 1.0);
+
+    // The right stick rests at 2048 on both axes, which is off center for Y.
+    assert_eq!(inputs.axis_right_stick_x.get(), 0.5);
+    assert_eq!(inputs.axis_right_stick_y.get(), 1.0 - (0.5 + 0.5 * 100.0 / 1000.0));
+  }
+
+  #[test]
+  fn unknown_reports() {
+    // The Switch Pro Controller's simple report isn't one that we parse.
+    let simple = [0x3f, 0x00, 0x00, 0x08, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80];
+    assert!(parse(VID_NINTENDO, 0x2009, &simple).is_none());
+
+    // Neither is a report that's too short for its layout.
+    assert!(parse(VID_SONY, 0x09cc, &DS4_USB_REPORT[..9]).is_none());
+    assert!(parse(VID_NINTENDO, 0x2009, &SWITCH_PRO_REPORT[..11]).is_none());
+    assert!(parse(VID_SONY, 0x09cc, &[]).is_none());
+  }
+
+  #[test]
+  fn relevance_masks() {
+    let layouts = lookup(VID_NINTENDO, 0x2009).unwrap().layouts();
+    assert_eq!(
+      layouts[0].relevance_mask(),
+      vec![0xff, 0x00, 0x00, 0xff, 0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff]
+    );
+  }
+}
@@ -0,0 +1,664 @@
+//! Switching controllers into their full report mode.
+//!
+//! Over Bluetooth, Sony controllers start out sending a reduced report at a low rate, and only
+//! switch over to their full report once somebody reads one of their calibration feature reports.
+//! The Switch Pro Controller starts out sending its simple report over Bluetooth, and nothing at
+//! all over USB until it's been handshaken with; either way, it needs to be told to send its full
+//! report. Nothing in here depends on Windows: the device is reached through `HidTransport`.
+//!
+//! Once a controller is sending its full reports, `read_calibration` picks up whatever its native
+//! parser needs to know about that particular controller.
+
+use std::io;
+use std::time::{Duration, Instant};
+
+use crate::native::{AxisCalibration, Calibration, StickCalibration};
+
+/// How to get a controller to send its full reports.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Negotiation {
+  DualShock4,
+  DualSense,
+  SwitchPro,
+}
+
+/// Whatever we talk to a HID device through.
+pub trait HidTransport {
+  /// Size of the device's input reports, including the report ID.
+  fn input_report_len(&self) -> usize;
+
+  /// Read a feature report. The report ID goes in `buf[0]`.
+  fn get_feature(&mut self, buf: &mut [u8]) -> io::Result<()>;
+
+  /// Write an output report, starting with its report ID.
+  fn set_output_report(&mut self, data: &[u8]) -> io::Result<()>;
+
+  /// Wait up to `timeout` for the next input report, and return its length, or 0 on timeout.
+  fn read_input_report(&mut self, buf: &mut [u8], timeout: Duration) -> io::Result<usize>;
+}
+
+const DS4_CALIBRATION_REPORT: u8 = 0x02;
+const DS4_CALIBRATION_REPORT_LEN: usize = 37;
+
+const DUALSENSE_CALIBRATION_REPORT: u8 = 0x05;
+const DUALSENSE_CALIBRATION_REPORT_LEN: usize = 41;
+
+const DS4_BT_OUTPUT_REPORT: u8 = 0x11;
+const DS4_BT_OUTPUT_REPORT_LEN: usize = 78;
+
+/// Flags in the second byte of the DualShock 4's Bluetooth output report: the report is meant for
+/// the HID layer, and it has a checksum. The low six bits are the report interval.
+const DS4_BT_FLAG_HID: u8 = 0x80;
+const DS4_BT_FLAG_CRC: u8 = 0x40;
+
+/// Longest report interval that the DualShock 4 accepts, in milliseconds.
+const DS4_BT_MAX_POLL_INTERVAL_MS: u8 = 62;
+
+const DUALSENSE_BT_OUTPUT_REPORT: u8 = 0x31;
+const DUALSENSE_BT_OUTPUT_REPORT_LEN: usize = 78;
+
+/// Tag in the third byte of the DualSense's Bluetooth output report that marks it as a HID report.
+const DUALSENSE_BT_OUTPUT_TAG: u8 = 0x10;
+
+/// Bluetooth HIDP header for output reports, which is included in the report's checksum.
+const BT_HIDP_OUTPUT_HEADER: u8 = 0xa2;
+
+/// Interval between input reports to ask for over Bluetooth, in milliseconds.
+const BT_POLL_INTERVAL_MS: u8 = 1;
+
+/// Output reports of the Switch Pro Controller are padded to these lengths, including the ID.
+const SWITCH_USB_OUTPUT_REPORT_LEN: usize = 64;
+const SWITCH_BT_OUTPUT_REPORT_LEN: usize = 49;
+
+/// Commands to the Switch Pro Controller's USB bridge, sent in output report 0x80 and answered
+/// in input report 0x81.
+const SWITCH_USB_COMMAND_REPORT: u8 = 0x80;
+const SWITCH_USB_REPLY_REPORT: u8 = 0x81;
+const SWITCH_USB_HANDSHAKE: u8 = 0x02;
+const SWITCH_USB_BAUD_RATE_3M: u8 = 0x03;
+
+/// Stop the USB bridge from timing out, and hand reports through as HID. This one isn't answered.
+const SWITCH_USB_NO_TIMEOUT: u8 = 0x04;
+
+/// Subcommands go in output report 0x01, along with rumble data, and are answered in input report
+/// 0x21, which echoes the subcommand's ID.
+const SWITCH_SUBCOMMAND_REPORT: u8 = 0x01;
+const SWITCH_SUBCOMMAND_REPLY_REPORT: u8 = 0x21;
+const SWITCH_SUBCOMMAND_REPLY_ID_OFFSET: usize = 14;
+const SWITCH_SUBCOMMAND_SET_INPUT_REPORT_MODE: u8 = 0x03;
+const SWITCH_INPUT_REPORT_MODE_FULL: u8 = 0x30;
+
+/// Reads from SPI flash take a little-endian address and a length, and are answered with the same
+/// address and length, followed by the data.
+const SWITCH_SUBCOMMAND_SPI_READ: u8 = 0x10;
+const SWITCH_SPI_REPLY_OFFSET: usize = 15;
+const SWITCH_SPI_DATA_OFFSET: usize = 20;
+
+/// Stick calibration in SPI flash. The factory calibration is always there, and user calibration
+/// overrides it for each stick that starts with the magic number.
+const SWITCH_SPI_FACTORY_STICKS: u32 = 0x603d;
+const SWITCH_SPI_USER_STICKS: u32 = 0x8010;
+const SWITCH_SPI_USER_MAGIC: [u8; 2] = [0xb2, 0xa1];
+const SWITCH_STICK_CALIBRATION_LEN: usize = 9;
+const SWITCH_SPI_USER_STICK_LEN: usize = SWITCH_SPI_USER_MAGIC.len() + SWITCH_STICK_CALIBRATION_LEN;
+
+/// Rumble data that leaves both motors alone.
+const SWITCH_NEUTRAL_RUMBLE: [u8; 8] = [0x00, 0x01, 0x40, 0x40, 0x00, 0x01, 0x40, 0x40];
+
+/// How long to wait for the Switch Pro Controller to answer a command.
+const SWITCH_REPLY_TIMEOUT: Duration = Duration::from_millis(500);
+
+/// USB reports are at most 64 bytes, so anything bigger has to be coming over Bluetooth.
+pub fn is_bluetooth<T: HidTransport + ?Sized>(transport: &T) -> bool {
+  transport.input_report_len() > 64
+}
+
+/// Switch a controller over to its full reports. Returns whether anything needed to be done.
+pub fn negotiate<T: HidTransport + ?Sized>(negotiation: Negotiation, transport: &mut T) -> io::Result<bool> {
+  let bluetooth = is_bluetooth(transport);
+  match negotiation {
+    // Sony controllers send their full reports over USB from the start.
+    Negotiation::DualShock4 | Negotiation::DualSense if !bluetooth => return Ok(false),
+
+    Negotiation::DualShock4 => {
+      let mut calibration = [0u8; DS4_CALIBRATION_REPORT_LEN];
+      calibration[0] = DS4_CALIBRATION_REPORT;
+      transport.get_feature(&mut calibration)?;
+      transport.set_output_report(&ds4_poll_interval_report(BT_POLL_INTERVAL_MS))?;
+    }
+
+    Negotiation::DualSense => {
+      let mut calibration = [0u8; DUALSENSE_CALIBRATION_REPORT_LEN];
+      calibration[0] = DUALSENSE_CALIBRATION_REPORT;
+      transport.get_feature(&mut calibration)?;
+      transport.set_output_report(&dualsense_output_report())?;
+    }
+
+    Negotiation::SwitchPro => {
+      if !bluetooth {
+        for &command in &[SWITCH_USB_HANDSHAKE, SWITCH_USB_BAUD_RATE_3M, SWITCH_USB_HANDSHAKE] {
+          transport.set_output_report(&switch_usb_command(command))?;
+          wait_for_reply(transport, SWITCH_USB_REPLY_REPORT, 1, command)?;
+        }
+        transport.set_output_report(&switch_usb_command(SWITCH_USB_NO_TIMEOUT))?;
+      }
+
+      let subcommand = switch_subcommand(
+        switch_output_report_len(bluetooth),
+        0,
+        SWITCH_SUBCOMMAND_SET_INPUT_REPORT_MODE,
+        &[SWITCH_INPUT_REPORT_MODE_FULL],
+      );
+      transport.set_output_report(&subcommand)?;
+      wait_for_reply(
+        transport,
+        SWITCH_SUBCOMMAND_REPLY_REPORT,
+        SWITCH_SUBCOMMAND_REPLY_ID_OFFSET,
+        SWITCH_SUBCOMMAND_SET_INPUT_REPORT_MODE,
+      )?;
+    }
+  }
+
+  Ok(true)
+}
+
+/// Read what the native parser needs to know about a controller that has been negotiated with.
+pub fn read_calibration<T: HidTransport + ?Sized>(
+  negotiation: Negotiation,
+  transport: &mut T,
+) -> io::Result<Calibration> {
+  match negotiation {
+    // Sony controllers report their sticks as centered bytes.
+    Negotiation::DualShock4 | Negotiation::DualSense => Ok(Calibration::default()),
+
+    Negotiation::SwitchPro => {
+      let report_len = switch_output_report_len(is_bluetooth(transport));
+      let user_len = 2 * SWITCH_SPI_USER_STICK_LEN;
+      let user = switch_spi_read(transport, report_len, 1, SWITCH_SPI_USER_STICKS, user_len)?;
+      let user_stick = |data: &[u8]| {
+        let (magic, calibration) = data.split_at(SWITCH_SPI_USER_MAGIC.len());
+        if magic == SWITCH_SPI_USER_MAGIC {
+          Some(calibration.to_vec())
+        } else {
+          None
+        }
+      };
+      let (user_left, user_right) = user.split_at(SWITCH_SPI_USER_STICK_LEN);
+      let (user_left, user_right) = (user_stick(user_left), user_stick(user_right));
+
+      let (left, right) = match (user_left, user_right) {
+        (Some(left), Some(right)) => (left, right),
+        (user_left, user_right) => {
+          let len = 2 * SWITCH_STICK_CALIBRATION_LEN;
+          let factory = switch_spi_read(transport, report_len, 2, SWITCH_SPI_FACTORY_STICKS, len)?;
+          let (factory_left, factory_right) = factory.split_at(SWITCH_STICK_CALIBRATION_LEN);
+          (
+            user_left.unwrap_or_else(|| factory_left.to_vec()),
+            user_right.unwrap_or_else(|| factory_right.to_vec()),
+          )
+        }
+      };
+
+      Ok(Calibration {
+        left_stick: switch_stick_calibration(&left, false),
+        right_stick: switch_stick_calibration(&right, true),
+      })
+    }
+  }
+}
+
+fn switch_output_report_len(bluetooth: bool) -> usize {
+  if bluetooth {
+    SWITCH_BT_OUTPUT_REPORT_LEN
+  } else {
+    SWITCH_USB_OUTPUT_REPORT_LEN
+  }
+}
+
+/// Read `len` bytes of the Switch Pro Controller's SPI flash, starting at `address`.
+fn switch_spi_read<T: HidTransport + ?Sized>(
+  transport: &mut T,
+  report_len: usize,
+  counter: u8,
+  address: u32,
+  len: usize,
+) -> io::Result<Vec<u8>> {
+  let mut args = address.to_le_bytes().to_vec();
+  args.push(len as u8);
+  transport.set_output_report(&switch_subcommand(report_len, counter, SWITCH_SUBCOMMAND_SPI_READ, &args))?;
+  let reply = wait_for_reply(
+    transport,
+    SWITCH_SUBCOMMAND_REPLY_REPORT,
+    SWITCH_SUBCOMMAND_REPLY_ID_OFFSET,
+    SWITCH_SUBCOMMAND_SPI_READ,
+  )?;
+
+  let data_end = SWITCH_SPI_DATA_OFFSET + len;
+  if reply.len() < data_end || reply[SWITCH_SPI_REPLY_OFFSET..SWITCH_SPI_DATA_OFFSET] != args[..] {
+    return Err(io::Error::new(
+      io::ErrorKind::InvalidData,
+      format!("bad reply to SPI read of {} bytes at {:#06x}", len, address),
+    ));
+  }
+  Ok(reply[SWITCH_SPI_DATA_OFFSET..data_end].to_vec())
+}
+
+/// Unpack a stick's calibration from SPI flash: six 12-bit values, which are the distance above
+/// center, the center and the distance below center for the left stick, and the center, the
+/// distance below and the distance above for the right stick, X before Y each time. Flash that was
+/// never written reads back as all ones, and leaves the stick uncalibrated.
+fn switch_stick_calibration(data: &[u8], right: bool) -> Option<StickCalibration> {
+  let value = |i: usize| {
+    let bytes = &data[i / 2 * 3..];
+    if i % 2 == 0 {
+      u16::from(bytes[0]) | (u16::from(bytes[1] & 0x0f) << 8)
+    } else {
+      u16::from(bytes[1] >> 4) | (u16::from(bytes[2]) << 4)
+    }
+  };
+  let values: Vec<u16> = (0..6).map(value).collect();
+  if values.iter().all(|&value| value == 0xfff) || values.contains(&0) {
+    return None;
+  }
+
+  let (center, below, above) = if right { (0, 2, 4) } else { (2, 4, 0) };
+  let axis = |i: usize| AxisCalibration {
+    center: values[center + i],
+    below: values[below + i],
+    above: values[above + i],
+  };
+  Some(StickCalibration { x: axis(0), y: axis(1) })
+}
+
+/// Read input reports until one with `report_id` has `value` at `offset`, skipping the regular
+/// input reports that the device keeps sending in the meantime, and return it.
+fn wait_for_reply<T: HidTransport + ?Sized>(
+  transport: &mut T,
+  report_id: u8,
+  offset: usize,
+  value: u8,
+) -> io::Result<Vec<u8>> {
+  let deadline = Instant::now() + SWITCH_REPLY_TIMEOUT;
+  let mut buf = vec![0u8; transport.input_report_len()];
+  loop {
+    let now = Instant::now();
+    if now >= deadline {
+      return Err(io::Error::new(
+        io::ErrorKind::TimedOut,
+        format!("no reply to command {:#04x} in report {:#04x}", value, report_id),
+      ));
+    }
+
+    let len = transport.read_input_report(&mut buf, deadline - now)?;
+    if len > offset && buf[0] == report_id && buf[offset] == value {
+      buf.truncate(len);
+      return Ok(buf);
+    }
+  }
+}
+
+/// Output report with a command for the Switch Pro Controller's USB bridge.
+fn switch_usb_command(command: u8) -> Vec<u8> {
+  let mut report = vec![0u8; SWITCH_USB_OUTPUT_REPORT_LEN];
+  report[0] = SWITCH_USB_COMMAND_REPORT;
+  report[1] = command;
+  report
+}
+
+/// Output report with a subcommand for the Switch Pro Controller, padded to `report_len`.
+fn switch_subcommand(report_len: usize, counter: u8, subcommand: u8, args: &[u8]) -> Vec<u8> {
+  let mut report = vec![0u8; report_len];
+  report[0] = SWITCH_SUBCOMMAND_REPORT;
+  report[1] = counter & 0x0f;
+  report[2..10].copy_from_slice(&SWITCH_NEUTRAL_RUMBLE);
+  report[10] = subcommand;
+  report[11..11 + args.len()].copy_from_slice(args);
+  report
+}
+
+/// Bluetooth output report that sets the DualShock 4's report interval, without touching its
+/// rumble or lightbar.
+fn ds4_poll_interval_report(interval_ms: u8) -> [u8; DS4_BT_OUTPUT_REPORT_LEN] {
+  let mut report = [0u8; DS4_BT_OUTPUT_REPORT_LEN];
+  report[0] = DS4_BT_OUTPUT_REPORT;
+  report[1] = DS4_BT_FLAG_HID | DS4_BT_FLAG_CRC | interval_ms.min(DS4_BT_MAX_POLL_INTERVAL_MS);
+  bt_output_checksum(&mut report);
+  report
+}
+
+/// Bluetooth output report that confirms the DualSense's switch to full reports, without touching
+/// its rumble, lights or triggers.
+///
+/// Unlike the DualShock 4, the DualSense has no report interval field: once it gets a HID output
+/// report, it sends its full reports at the fastest rate that the link allows.
+fn dualsense_output_report() -> [u8; DUALSENSE_BT_OUTPUT_REPORT_LEN] {
+  let mut report = [0u8; DUALSENSE_BT_OUTPUT_REPORT_LEN];
+  report[0] = DUALSENSE_BT_OUTPUT_REPORT;
+  report[2] = DUALSENSE_BT_OUTPUT_TAG;
+  bt_output_checksum(&mut report);
+  report
+}
+
+/// Fill in the checksum in the last four bytes of a Bluetooth output report.
+fn bt_output_checksum(report: &mut [u8]) {
+  // The checksum covers the HIDP header, which isn't part of the report that we hand to Windows.
+  let payload_len = report.len() - 4;
+  let crc = crc32(crc32_update(!0, &[BT_HIDP_OUTPUT_HEADER]), &report[..payload_len]);
+  report[payload_len..].copy_from_slice(&crc.to_le_bytes());
+}
+
+fn crc32_update(mut crc: u32, data: &[u8]) -> u32 {
+  for &byte in data {
+    crc ^= u32::from(byte);
+    for _ in 0..8 {
+      let mask = (!(crc & 1)).wrapping_add(1);
+      crc = (crc >> 1) ^ (0xedb8_8320 & mask);
+    }
+  }
+  crc
+}
+
+/// Finish a CRC-32 whose intermediate state is `crc` over `data`.
+fn crc32(crc: u32, data: &[u8]) -> u32 {
+  !crc32_update(crc, data)
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  /// What a scripted device expects to be asked, in order.
+  #[derive(Debug, PartialEq)]
+  enum Call {
+    /// Expect a feature report read with this ID and buffer length.
+    GetFeature(u8, usize),
+
+    /// Expect exactly these bytes to be written as an output report.
+    SetOutputReport(Vec<u8>),
+
+    /// Expect an input report to be read, and hand it these bytes.
+    InputReport(Vec<u8>),
+
+    /// Expect an input report to be read, and let it time out.
+    Timeout,
+  }
+
+  /// Stand-in for a HID device that checks everything sent to it against a script.
+  struct ScriptedTransport {
+    input_report_len: usize,
+    script: Vec<Call>,
+  }
+
+  impl ScriptedTransport {
+    fn new(input_report_len: usize, mut script: Vec<Call>) -> ScriptedTransport {
+      script.reverse();
+      ScriptedTransport {
+        input_report_len,
+        script,
+      }
+    }
+
+    fn finish(self) {
+      assert!(self.script.is_empty(), "calls left over: {:?}", self.script);
+    }
+  }
+
+  impl HidTransport for ScriptedTransport {
+    fn input_report_len(&self) -> usize {
+      self.input_report_len
+    }
+
+    fn get_feature(&mut self, buf: &mut [u8]) -> io::Result<()> {
+      assert_eq!(self.script.pop(), Some(Call::GetFeature(buf[0], buf.len())));
+      Ok(())
+    }
+
+    fn set_output_report(&mut self, data: &[u8]) -> io::Result<()> {
+      assert_eq!(self.script.pop(), Some(Call::SetOutputReport(data.to_vec())));
+      Ok(())
+    }
+
+    fn read_input_report(&mut self, buf: &mut [u8], timeout: Duration) -> io::Result<usize> {
+      assert_eq!(buf.len(), self.input_report_len);
+      match self.script.pop() {
+        Some(Call::InputReport(report)) => {
+          buf[..report.len()].copy_from_slice(&report);
+          Ok(report.len())
+        }
+        Some(Call::Timeout) => {
+          std::thread::sleep(timeout);
+          Ok(0)
+        }
+        call => panic!("expected an input report read, got {:?}", call),
+      }
+    }
+  }
+
+  fn report(prefix: &[u8], crc: [u8; 4]) -> Vec<u8> {
+    let mut report = prefix.to_vec();
+    report.resize(78 - 4, 0);
+    report.extend_from_slice(&crc);
+    report
+  }
+
+  #[test]
+  fn ds4_bluetooth() {
+    let mut transport = ScriptedTransport::new(
+      547,
+      vec![
+        Call::GetFeature(0x02, 37),
+        Call::SetOutputReport(report(&[0x11, 0xc1], [0x6b, 0x77, 0xd8, 0xcd])),
+      ],
+    );
+    assert!(negotiate(Negotiation::DualShock4, &mut transport).unwrap());
+    transport.finish();
+  }
+
+  #[test]
+  fn ds4_poll_interval_is_clamped() {
+    assert_eq!(ds4_poll_interval_report(62).to_vec(), report(&[0x11, 0xfe], [0x0d, 0x0d, 0xcd, 0x30]));
+    assert_eq!(ds4_poll_interval_report(255).to_vec(), ds4_poll_interval_report(62).to_vec());
+  }
+
+  #[test]
+  fn dualsense_bluetooth() {
+    let mut transport = ScriptedTransport::new(
+      78,
+      vec![
+        Call::GetFeature(0x05, 41),
+        Call::SetOutputReport(report(&[0x31, 0x00, 0x10], [0xb5, 0x01, 0x15, 0x23])),
+      ],
+    );
+    assert!(negotiate(Negotiation::DualSense, &mut transport).unwrap());
+    transport.finish();
+  }
+
+  fn padded(prefix: &[u8], len: usize) -> Vec<u8> {
+    let mut report = prefix.to_vec();
+    report.resize(len, 0);
+    report
+  }
+
+  /// Reply to a subcommand, echoing its ID at offset 14.
+  fn subcommand_reply(subcommand: u8) -> Vec<u8> {
+    let mut report = padded(&[0x21], 49);
+    report[13] = 0x80;
+    report[14] = subcommand;
+    report
+  }
+
+  const SET_FULL_REPORT_MODE: [u8; 12] = [0x01, 0x00, 0x00, 0x01, 0x40, 0x40, 0x00, 0x01, 0x40, 0x40, 0x03, 0x30];
+
+  #[test]
+  fn switch_pro_bluetooth() {
+    let mut transport = ScriptedTransport::new(
+      362,
+      vec![
+        Call::SetOutputReport(padded(&SET_FULL_REPORT_MODE, 49)),
+        // Simple reports keep coming until the controller gets around to answering.
+        Call::InputReport(padded(&[0x3f, 0x00, 0x00, 0x08], 12)),
+        Call::InputReport(subcommand_reply(0x03)),
+      ],
+    );
+    assert!(negotiate(Negotiation::SwitchPro, &mut transport).unwrap());
+    transport.finish();
+  }
+
+  #[test]
+  fn switch_pro_usb() {
+    let mut transport = ScriptedTransport::new(
+      64,
+      vec![
+        Call::SetOutputReport(padded(&[0x80, 0x02], 64)),
+        Call::InputReport(padded(&[0x81, 0x02], 64)),
+        Call::SetOutputReport(padded(&[0x80, 0x03], 64)),
+        Call::InputReport(padded(&[0x81, 0x03], 64)),
+        Call::SetOutputReport(padded(&[0x80, 0x02], 64)),
+        Call::InputReport(padded(&[0x81, 0x02], 64)),
+        Call::SetOutputReport(padded(&[0x80, 0x04], 64)),
+        Call::SetOutputReport(padded(&SET_FULL_REPORT_MODE, 64)),
+        // A reply to some other subcommand doesn't count.
+        Call::InputReport(subcommand_reply(0x02)),
+        Call::InputReport(subcommand_reply(0x03)),
+      ],
+    );
+    assert!(negotiate(Negotiation::SwitchPro, &mut transport).unwrap());
+    transport.finish();
+  }
+
+  /// Output report asking for `len` bytes of SPI flash at `address`.
+  fn spi_read(counter: u8, address: u16, len: u8) -> Vec<u8> {
+    let mut report = padded(&SET_FULL_REPORT_MODE[..10], 49);
+    report[1] = counter;
+    report[10..16].copy_from_slice(&[0x10, address as u8, (address >> 8) as u8, 0x00, 0x00, len]);
+    report
+  }
+
+  /// Reply to an SPI flash read.
+  fn spi_reply(address: u16, data: &[u8]) -> Vec<u8> {
+    let mut report = subcommand_reply(0x10);
+    report[13] = 0x90;
+    report[15..20].copy_from_slice(&[address as u8, (address >> 8) as u8, 0x00, 0x00, data.len() as u8]);
+    report[20..20 + data.len()].copy_from_slice(data);
+    report
+  }
+
+  /// Pack pairs of 12-bit values the way that SPI flash stores them.
+  fn pack(values: &[u16]) -> Vec<u8> {
+    values
+      .chunks(2)
+      .flat_map(|pair| {
+        let (x, y) = (pair[0], pair[1]);
+        vec![x as u8, ((x >> 8) as u8 & 0x0f) | ((y as u8 & 0x0f) << 4), (y >> 4) as u8]
+      })
+      .collect()
+  }
+
+  fn axis(center: u16, below: u16, above: u16) -> AxisCalibration {
+    AxisCalibration { center, below, above }
+  }
+
+  #[test]
+  fn switch_pro_factory_calibration() {
+    let mut factory = pack(&[1500, 1400, 2000, 2100, 1500, 1600]);
+    factory.extend(pack(&[2048, 1948, 1024, 1000, 1024, 1000]));
+    let mut transport = ScriptedTransport::new(
+      362,
+      vec![
+        Call::SetOutputReport(spi_read(1, 0x8010, 22)),
+        Call::InputReport(spi_reply(0x8010, &[0xff; 22])),
+        Call::SetOutputReport(spi_read(2, 0x603d, 18)),
+        // Full reports keep coming in between.
+        Call::InputReport(padded(&[0x30], 49)),
+        Call::InputReport(spi_reply(0x603d, &factory)),
+      ],
+    );
+    let calibration = read_calibration(Negotiation::SwitchPro, &mut transport).unwrap();
+    transport.finish();
+
+    let left = calibration.left_stick.unwrap();
+    assert_eq!(left.x, axis(2000, 1500, 1500));
+    assert_eq!(left.y, axis(2100, 1600, 1400));
+    let right = calibration.right_stick.unwrap();
+    assert_eq!(right.x, axis(2048, 1024, 1024));
+    assert_eq!(right.y, axis(1948, 1000, 1000));
+  }
+
+  #[test]
+  fn switch_pro_user_calibration() {
+    let mut user = vec![0xb2, 0xa1];
+    user.extend(pack(&[1200, 1200, 1900, 1900, 1300, 1300]));
+    user.extend(&[0xff; 11]);
+    let mut factory = vec![0xff; 9];
+    factory.extend(pack(&[2048, 2048, 1024, 1024, 1024, 1024]));
+    let mut transport = ScriptedTransport::new(
+      64,
+      vec![
+        Call::SetOutputReport(padded(&spi_read(1, 0x8010, 22), 64)),
+        Call::InputReport(spi_reply(0x8010, &user)),
+        Call::SetOutputReport(padded(&spi_read(2, 0x603d, 18), 64)),
+        Call::InputReport(spi_reply(0x603d, &factory)),
+      ],
+    );
+    let calibration = read_calibration(Negotiation::SwitchPro, &mut transport).unwrap();
+    transport.finish();
+
+    // The user calibrated the left stick only, and the factory never calibrated it.
+    let left = calibration.left_stick.unwrap();
+    assert_eq!(left.x, axis(1900, 1300, 1200));
+    let right = calibration.right_stick.unwrap();
+    assert_eq!(right.x, axis(2048, 1024, 1024));
+  }
+
+  #[test]
+  fn switch_pro_uncalibrated() {
+    let mut transport = ScriptedTransport::new(
+      362,
+      vec![
+        Call::SetOutputReport(spi_read(1, 0x8010, 22)),
+        Call::InputReport(spi_reply(0x8010, &[0xff; 22])),
+        Call::SetOutputReport(spi_read(2, 0x603d, 18)),
+        Call::InputReport(spi_reply(0x603d, &[0xff; 18])),
+      ],
+    );
+    assert_eq!(
+      read_calibration(Negotiation::SwitchPro, &mut transport).unwrap(),
+      Calibration::default()
+    );
+    transport.finish();
+  }
+
+  #[test]
+  fn switch_pro_bad_spi_reply() {
+    let mut transport = ScriptedTransport::new(
+      362,
+      vec![
+        Call::SetOutputReport(spi_read(1, 0x8010, 22)),
+        Call::InputReport(spi_reply(0x6000, &[0xff; 22])),
+      ],
+    );
+    let err = read_calibration(Negotiation::SwitchPro, &mut transport).unwrap_err();
+    assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+    transport.finish();
+  }
+
+  #[test]
+  fn switch_pro_timeout() {
+    let mut transport = ScriptedTransport::new(
+      64,
+      vec![Call::SetOutputReport(padded(&[0x80, 0x02], 64)), Call::Timeout],
+    );
+    let err = negotiate(Negotiation::SwitchPro, &mut transport).unwrap_err();
+    assert_eq!(err.kind(), io::ErrorKind::TimedOut);
+    transport.finish();
+  }
+
+  #[test]
+  fn usb_is_left_alone() {
+    for &negotiation in &[Negotiation::DualShock4, Negotiation::DualSense] {
+      let mut transport = ScriptedTransport::new(64, vec![]);
+      assert!(!negotiate(negotiation, &mut transport).unwrap());
+      transport.finish();
+    }
+  }
+}
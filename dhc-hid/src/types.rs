@@ -0,0 +1,516 @@
+use std::fmt;
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct Axis(f32);
+
+impl Axis {
+  pub fn get(self) -> f32 {
+    self.0
+  }
+
+  pub fn set_value(&mut self, value: f32) {
+    if value < 0.0 || value > 1.0 {
+      panic!("invalid axis value: {}", value);
+    }
+
+    self.0 = value;
+  }
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub enum AxisType {
+  LeftStickX,
+  LeftStickY,
+  RightStickX,
+  RightStickY,
+  LeftTrigger,
+  RightTrigger,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Button(bool);
+
+impl Button {
+  pub fn get(self) -> bool {
+    self.0
+  }
+
+  pub fn set_value(&mut self, value: bool) {
+    self.0 = value;
+  }
+
+  pub fn set(&mut self) {
+    self.set_value(true);
+  }
+
+  pub fn reset(&mut self) {
+    self.set_value(false);
+  }
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub enum ButtonType {
+  Start,
+  Select,
+  Home,
+  North,
+  East,
+  South,
+  West,
+  L1,
+  L2,
+  L3,
+  R1,
+  R2,
+  R3,
+  Trackpad,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Hat {
+  Neutral,
+  North,
+  NorthEast,
+  East,
+  SouthEast,
+  South,
+  SouthWest,
+  West,
+  NorthWest,
+}
+
+impl Default for Hat {
+  fn default() -> Hat {
+    Hat::Neutral
+  }
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub enum HatType {
+  DPad,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum InputObjectType {
+  Axis,
+  Button,
+  Hat,
+}
+
+/// A change to a single object of a device, recorded by the input thread for buffered input.
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct InputEvent {
+  pub object_type: InputObjectType,
+
+  /// The AxisType, ButtonType, or HatType of the object, depending on `object_type`.
+  pub object_index: u32,
+
+  /// The new value of the object. Only the field corresponding to `object_type` is meaningful.
+  pub axis: Axis,
+  pub button: Button,
+  pub hat: Hat,
+
+  /// Milliseconds since system start at which the report was received, from the same clock as
+  /// the rest of dhc's timestamps, so that it lines up with GetTickCount.
+  pub timestamp: u32,
+
+  /// Sequence number, increasing with every event recorded for a device.
+  pub sequence: u32,
+}
+
+impl InputEvent {
+  fn new(object_type: InputObjectType, object_index: u32) -> InputEvent {
+    InputEvent {
+      object_type,
+      object_index,
+      axis: Axis(0.5),
+      button: Button::default(),
+      hat: Hat::default(),
+      timestamp: 0,
+      sequence: 0,
+    }
+  }
+
+  fn axis(axis_type: AxisType, value: Axis) -> InputEvent {
+    let mut event = InputEvent::new(InputObjectType::Axis, axis_type as u32);
+    event.axis = value;
+    event
+  }
+
+  fn button(button_type: ButtonType, value: Button) -> InputEvent {
+    let mut event = InputEvent::new(InputObjectType::Button, button_type as u32);
+    event.button = value;
+    event
+  }
+
+  fn hat(hat_type: HatType, value: Hat) -> InputEvent {
+    let mut event = InputEvent::new(InputObjectType::Hat, hat_type as u32);
+    event.hat = value;
+    event
+  }
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct DeviceInputs {
+  pub axis_left_stick_x: Axis,
+  pub axis_left_stick_y: Axis,
+
+  pub axis_right_stick_x: Axis,
+  pub axis_right_stick_y: Axis,
+
+  pub axis_left_trigger: Axis,
+  pub axis_right_trigger: Axis,
+
+  pub hat_dpad: Hat,
+
+  /// Start/Options
+  pub button_start: Button,
+
+  /// Back/Share
+  pub button_select: Button,
+
+  /// Xbox/PS
+  pub button_home: Button,
+
+  /// Y/△
+  pub button_north: Button,
+
+  /// B/○
+  pub button_east: Button,
+
+  /// A/✖
+  pub button_south: Button,
+
+  /// X/□
+  pub button_west: Button,
+
+  pub button_l1: Button,
+  pub button_l2: Button,
+  pub button_l3: Button,
+
+  pub button_r1: Button,
+  pub button_r2: Button,
+  pub button_r3: Button,
+
+  pub button_trackpad: Button,
+}
+
+impl Default for DeviceInputs {
+  fn default() -> DeviceInputs {
+    DeviceInputs {
+      axis_left_stick_x: Axis(0.5),
+      axis_left_stick_y: Axis(0.5),
+
+      axis_right_stick_x: Axis(0.5),
+      axis_right_stick_y: Axis(0.5),
+
+      axis_left_trigger: Axis(0.5),
+      axis_right_trigger: Axis(0.5),
+
+      hat_dpad: Hat::default(),
+      button_start: Button::default(),
+      button_select: Button::default(),
+      button_home: Button::default(),
+
+      button_north: Button::default(),
+      button_east: Button::default(),
+      button_south: Button::default(),
+      button_west: Button::default(),
+
+      button_l1: Button::default(),
+      button_l2: Button::default(),
+      button_l3: Button::default(),
+
+      button_r1: Button::default(),
+      button_r2: Button::default(),
+      button_r3: Button::default(),
+
+      button_trackpad: Button::default(),
+    }
+  }
+}
+
+impl fmt::Display for DeviceInputs {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    let mut buttons = Vec::new();
+    if self.button_north.get() {
+      buttons.push("△");
+    }
+    if self.button_east.get() {
+      buttons.push("○");
+    }
+    if self.button_south.get() {
+      buttons.push("✖");
+    }
+    if self.button_west.get() {
+      buttons.push("□");
+    }
+    if self.button_start.get() {
+      buttons.push("Start");
+    }
+    if self.button_select.get() {
+      buttons.push("Select");
+    }
+
+    if self.button_l1.get() {
+      buttons.push("L1");
+    }
+    if self.button_l2.get() {
+      buttons.push("L2");
+    }
+    if self.button_l3.get() {
+      buttons.push("L3");
+    }
+    if self.button_r1.get() {
+      buttons.push("R1");
+    }
+    if self.button_r2.get() {
+      buttons.push("R2");
+    }
+    if self.button_r3.get() {
+      buttons.push("R3");
+    }
+
+    if self.button_home.get() {
+      buttons.push("Home");
+    }
+    if self.button_trackpad.get() {
+      buttons.push("Trackpad");
+    }
+
+    write!(f, "{:?}", buttons)
+  }
+}
+
+impl DeviceInputs {
+  pub fn reset_buttons(&mut self) {
+    self.button_start.reset();
+    self.button_select.reset();
+    self.button_home.reset();
+    self.button_north.reset();
+    self.button_east.reset();
+    self.button_south.reset();
+    self.button_west.reset();
+    self.button_l1.reset();
+    self.button_l2.reset();
+    self.button_l3.reset();
+    self.button_r1.reset();
+    self.button_r2.reset();
+    self.button_r3.reset();
+    self.button_trackpad.reset();
+  }
+
+  pub fn get_axis(&self, axis_type: AxisType) -> Axis {
+    match axis_type {
+      AxisType::LeftStickX => self.axis_left_stick_x,
+      AxisType::LeftStickY => self.axis_left_stick_y,
+      AxisType::RightStickX => self.axis_right_stick_x,
+      AxisType::RightStickY => self.axis_right_stick_y,
+      AxisType::LeftTrigger => self.axis_left_trigger,
+      AxisType::RightTrigger => self.axis_right_trigger,
+    }
+  }
+
+  pub fn get_button(&self, button_type: ButtonType) -> Button {
+    match button_type {
+      ButtonType::Start => self.button_start,
+      ButtonType::Select => self.button_select,
+      ButtonType::Home => self.button_home,
+      ButtonType::North => self.button_north,
+      ButtonType::East => self.button_east,
+      ButtonType::South => self.button_south,
+      ButtonType::West => self.button_west,
+      ButtonType::L1 => self.button_l1,
+      ButtonType::L2 => self.button_l2,
+      ButtonType::L3 => self.button_l3,
+      ButtonType::R1 => self.button_r1,
+      ButtonType::R2 => self.button_r2,
+      ButtonType::R3 => self.button_r3,
+      ButtonType::Trackpad => self.button_trackpad,
+    }
+  }
+
+  pub fn get_hat(&self, hat_type: HatType) -> Hat {
+    match hat_type {
+      HatType::DPad => self.hat_dpad,
+    }
+  }
+
+  pub fn axis_mut(&mut self, axis_type: AxisType) -> &mut Axis {
+    match axis_type {
+      AxisType::LeftStickX => &mut self.axis_left_stick_x,
+      AxisType::LeftStickY => &mut self.axis_left_stick_y,
+      AxisType::RightStickX => &mut self.axis_right_stick_x,
+      AxisType::RightStickY => &mut self.axis_right_stick_y,
+      AxisType::LeftTrigger => &mut self.axis_left_trigger,
+      AxisType::RightTrigger => &mut self.axis_right_trigger,
+    }
+  }
+
+  pub fn button_mut(&mut self, button_type: ButtonType) -> &mut Button {
+    match button_type {
+      ButtonType::Start => &mut self.button_start,
+      ButtonType::Select => &mut self.button_select,
+      ButtonType::Home => &mut self.button_home,
+      ButtonType::North => &mut self.button_north,
+      ButtonType::East => &mut self.button_east,
+      ButtonType::South => &mut self.button_south,
+      ButtonType::West => &mut self.button_west,
+      ButtonType::L1 => &mut self.button_l1,
+      ButtonType::L2 => &mut self.button_l2,
+      ButtonType::L3 => &mut self.button_l3,
+      ButtonType::R1 => &mut self.button_r1,
+      ButtonType::R2 => &mut self.button_r2,
+      ButtonType::R3 => &mut self.button_r3,
+      ButtonType::Trackpad => &mut self.button_trackpad,
+    }
+  }
+
+  /// Call `f` with an (unstamped) InputEvent for every object whose value differs from `prev`.
+  pub fn diff<F: FnMut(InputEvent)>(&self, prev: &DeviceInputs, mut f: F) {
+    const AXES: [AxisType; 6] = [
+      AxisType::LeftStickX,
+      AxisType::LeftStickY,
+      AxisType::RightStickX,
+      AxisType::RightStickY,
+      AxisType::LeftTrigger,
+      AxisType::RightTrigger,
+    ];
+
+    const BUTTONS: [ButtonType; 14] = [
+      ButtonType::Start,
+      ButtonType::Select,
+      ButtonType::Home,
+      ButtonType::North,
+      ButtonType::East,
+      ButtonType::South,
+      ButtonType::West,
+      ButtonType::L1,
+      ButtonType::L2,
+      ButtonType::L3,
+      ButtonType::R1,
+      ButtonType::R2,
+      ButtonType::R3,
+      ButtonType::Trackpad,
+    ];
+
+    for &axis_type in &AXES {
+      let value = self.get_axis(axis_type);
+      if value.get() != prev.get_axis(axis_type).get() {
+        f(InputEvent::axis(axis_type, value));
+      }
+    }
+
+    for &button_type in &BUTTONS {
+      let value = self.get_button(button_type);
+      if value.get() != prev.get_button(button_type).get() {
+        f(InputEvent::button(button_type, value));
+      }
+    }
+
+    if self.hat_dpad != prev.hat_dpad {
+      f(InputEvent::hat(HatType::DPad, self.hat_dpad));
+    }
+  }
+
+  /// Render the inputs the way XInputGetState reports them.
+  pub fn to_xinput(&self) -> XInputGamepad {
+    const DPAD_UP: u16 = 0x0001;
+    const DPAD_DOWN: u16 = 0x0002;
+    const DPAD_LEFT: u16 = 0x0004;
+    const DPAD_RIGHT: u16 = 0x0008;
+    const START: u16 = 0x0010;
+    const BACK: u16 = 0x0020;
+    const LEFT_THUMB: u16 = 0x0040;
+    const RIGHT_THUMB: u16 = 0x0080;
+    const LEFT_SHOULDER: u16 = 0x0100;
+    const RIGHT_SHOULDER: u16 = 0x0200;
+    const A: u16 = 0x1000;
+    const B: u16 = 0x2000;
+    const X: u16 = 0x4000;
+    const Y: u16 = 0x8000;
+
+    let mut buttons = match self.hat_dpad {
+      Hat::Neutral => 0,
+      Hat::North => DPAD_UP,
+      Hat::NorthEast => DPAD_UP | DPAD_RIGHT,
+      Hat::East => DPAD_RIGHT,
+      Hat::SouthEast => DPAD_DOWN | DPAD_RIGHT,
+      Hat::South => DPAD_DOWN,
+      Hat::SouthWest => DPAD_DOWN | DPAD_LEFT,
+      Hat::West => DPAD_LEFT,
+      Hat::NorthWest => DPAD_UP | DPAD_LEFT,
+    };
+
+    for &(button, value) in &[
+      (self.button_start, START),
+      (self.button_select, BACK),
+      (self.button_l3, LEFT_THUMB),
+      (self.button_r3, RIGHT_THUMB),
+      (self.button_l1, LEFT_SHOULDER),
+      (self.button_r1, RIGHT_SHOULDER),
+      (self.button_south, A),
+      (self.button_east, B),
+      (self.button_west, X),
+      (self.button_north, Y),
+    ] {
+      if button.get() {
+        buttons |= value;
+      }
+    }
+
+    let trigger = |axis: Axis| (f64::from(axis.get()) * 255.0) as u8;
+    let thumb = |value: f64| value.max(-32768.0).min(32767.0) as i16;
+
+    XInputGamepad {
+      buttons,
+      left_trigger: trigger(self.axis_left_trigger),
+      right_trigger: trigger(self.axis_right_trigger),
+      thumb_lx: thumb(65536.0 * f64::from(self.axis_left_stick_x.get()) - 32768.0),
+      thumb_ly: thumb(32768.0 - 65536.0 * f64::from(self.axis_left_stick_y.get())),
+      thumb_rx: thumb(65536.0 * f64::from(self.axis_right_stick_x.get()) - 32768.0),
+      thumb_ry: thumb(32768.0 - 65536.0 * f64::from(self.axis_right_stick_y.get())),
+    }
+  }
+}
+
+/// Layout-compatible with XINPUT_GAMEPAD.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct XInputGamepad {
+  pub buttons: u16,
+  pub left_trigger: u8,
+  pub right_trigger: u8,
+  pub thumb_lx: i16,
+  pub thumb_ly: i16,
+  pub thumb_rx: i16,
+  pub thumb_ry: i16,
+}
+
+impl Default for XInputGamepad {
+  fn default() -> XInputGamepad {
+    DeviceInputs::default().to_xinput()
+  }
+}
+
+/// Layout-compatible with XINPUT_STATE.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct XInputState {
+  /// Incremented whenever `gamepad` changes.
+  pub packet_number: u32,
+  pub gamepad: XInputGamepad,
+}
+
+// Both must match the sizes of the XInput structures that they stand in for.
+const _: () = assert!(std::mem::size_of::<XInputGamepad>() == 2 + 1 + 1 + 4 * 2);
+const _: () = assert!(std::mem::size_of::<XInputState>() == 4 + std::mem::size_of::<XInputGamepad>());
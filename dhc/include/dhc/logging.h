@@ -1,6 +1,11 @@
 #pragma once
 
-#include <sstream>
+#include <stdint.h>
+
+#include <atomic>
+#include <ostream>
+#include <streambuf>
+#include <utility>
 
 #include "dhc/dhc.h"
 
@@ -17,7 +22,14 @@
 #define ERROR LogLevel::Error
 #define FATAL LogLevel::Fatal
 
-#define LOG(level) if (dhc_log_is_enabled(level)) LogMessage(level)
+// VERBOSE logging is compiled out unless it's asked for, since it's all over the hot paths.
+#ifdef DHC_VERBOSE_LOGGING
+#define DHC_LOG_COMPILED(level) true
+#else
+#define DHC_LOG_COMPILED(level) ((level) != LogLevel::Trace)
+#endif
+
+#define LOG(level) if (DHC_LOG_COMPILED(level) && dhc_log_level_enabled(level)) LogMessage(level)
 #define UNIMPLEMENTED(level) LOG(level) << "unimplemented function: " << __PRETTY_FUNCTION__
 #define CHECK(predicate)                                                                    \
   if (!(predicate))                                                                         \
@@ -26,21 +38,88 @@
 #define CHECK_GT(x, y) CHECK((x) > (y)) << " (" #x " == " << (x) << ", " #y << " == " << (y) << ")"
 #define CHECK_GE(x, y) CHECK((x) >= (y)) << " (" #x " == " << (x) << ", " #y << " == " << (y) << ")"
 
+// Lowest level that's logged, kept up to date by dhc. Nothing is logged until dhc's logger is up.
+inline std::atomic<int32_t> dhc_log_min_level{static_cast<int32_t>(LogLevel::Fatal) + 1};
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t));
+inline std::atomic<bool> dhc_log_min_level_registered{false};
+
+// Initialize dhc, and have it keep dhc_log_min_level up to date from the first call on. The DLLs
+// call this from their entry points instead of dhc_init. Never call it from DllMain.
+inline void dhc_init_dll() {
+  dhc_init();
+  if (!dhc_log_min_level_registered.load(std::memory_order_acquire) &&
+      !dhc_log_min_level_registered.exchange(true)) {
+    dhc_log_register_level(reinterpret_cast<int32_t*>(&dhc_log_min_level));
+  }
+}
+
+// Stop dhc from updating dhc_log_min_level, before the DLL that it lives in gets unloaded.
+inline void dhc_log_unregister() {
+  if (dhc_log_min_level_registered.exchange(false)) {
+    dhc_log_unregister_level(reinterpret_cast<int32_t*>(&dhc_log_min_level));
+  }
+}
+
+// Checked at every LOG site, so this has to stay cheap: no calls into dhc, just a relaxed load.
+inline bool dhc_log_level_enabled(LogLevel level) {
+  return level == LogLevel::Fatal ||
+         static_cast<int32_t>(level) >= dhc_log_min_level.load(std::memory_order_relaxed);
+}
+
 struct LogMessage {
-  explicit LogMessage(LogLevel level) : level_(level) {}
+  explicit LogMessage(LogLevel level) : level_(level), stream_(&buf_) {}
 
   ~LogMessage() {
-    std::string message = ss_.str();
-    dhc_log(level_, reinterpret_cast<const uint8_t*>(message.data()), message.size());
+    dhc_log(level_, reinterpret_cast<const uint8_t*>(buf_.data()), buf_.size());
   }
 
   template<typename T>
   LogMessage& operator<<(T&& rhs) {
-    ss_ << std::forward<T>(rhs);
+    stream_ << std::forward<T>(rhs);
     return *this;
   }
 
  private:
+  // Formats into a fixed buffer on the stack, silently truncating messages that don't fit.
+  struct FixedBuf : public std::streambuf {
+    FixedBuf() { setp(buffer_, buffer_ + sizeof(buffer_)); }
+
+    const char* data() const { return pbase(); }
+
+    // Length of the message, not counting a UTF-8 sequence that truncation cut in half.
+    size_t size() const {
+      size_t size = pptr() - pbase();
+      if (!truncated_) {
+        return size;
+      }
+
+      size_t lead = size;
+      while (lead > 0 && (static_cast<unsigned char>(buffer_[lead - 1]) & 0xC0) == 0x80) {
+        --lead;
+      }
+      if (lead == 0) {
+        return size;
+      }
+      --lead;
+
+      unsigned char c = static_cast<unsigned char>(buffer_[lead]);
+      size_t expected = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+      return size - lead < expected ? lead : size;
+    }
+
+   protected:
+    int_type overflow(int_type) override {
+      truncated_ = true;
+      return traits_type::eof();
+    }
+
+   private:
+    char buffer_[1024];
+    bool truncated_ = false;
+  };
+
   LogLevel level_;
-  std::stringstream ss_;
+  FixedBuf buf_;
+  std::ostream stream_;
 };
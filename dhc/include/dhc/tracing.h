@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dhc/dhc.h"
+
+// Spans are compiled out unless tracing is asked for, since they sit on the game's hot paths.
+#ifdef DHC_TRACING
+
+#define DHC_TRACE_CONCAT_INNER(x, y) x##y
+#define DHC_TRACE_CONCAT(x, y) DHC_TRACE_CONCAT_INNER(x, y)
+
+// Time the rest of the enclosing scope. The name has to be a string literal.
+#define DHC_TRACE_SPAN(name) TraceSpan DHC_TRACE_CONCAT(dhc_trace_span_, __LINE__)(name)
+
+struct TraceSpan {
+  explicit TraceSpan(const char* name) : name_(name), start_(dhc_trace_now()) {}
+  ~TraceSpan() { dhc_trace_span(name_, start_); }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_;
+  uint64_t start_;
+};
+
+// Export spans from a call that the game made, never from DllMain or a destructor, which can run
+// under the loader lock.
+#define DHC_TRACE_EXPORT() dhc_trace_export()
+
+#else
+
+#define DHC_TRACE_SPAN(name) \
+  do {                       \
+  } while (0)
+#define DHC_TRACE_EXPORT() \
+  do {                     \
+  } while (0)
+
+#endif
@@ -0,0 +1,406 @@
+//! Logging off the calling thread.
+//!
+//! Formatting a log line and writing it to the console and to dhc.log can take a long time,
+//! especially when the console is being scrolled, and most of the interesting log lines come from
+//! the input thread. AsyncDrain copies each record into a fixed-size entry in a bounded lock-free
+//! queue instead, and a low priority thread formats and writes them in batches. When the queue is
+//! full, records are dropped and counted rather than making the caller wait, and the writer says
+//! how many were lost once it catches up.
+//!
+//! Nobody ever waits for the writer, which runs at a lower priority than the input threads that do
+//! most of the logging. Errors only wake it up early. Whatever is still queued when the process is
+//! going away (after a panic, or when the DLLs are unloaded) gets written by `AsyncFlusher::flush`,
+//! on the calling thread.
+
+use std::cell::UnsafeCell;
+use std::fmt;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread::JoinHandle;
+use std::time::Duration;
+
+use parking_lot::Mutex;
+
+use slog::{BorrowedKV, Drain, Level, OwnedKVList, Record, RecordLocation, RecordStatic};
+
+use winapi::um::processthreadsapi::{GetCurrentThread, SetThreadPriority};
+use winapi::um::winbase::THREAD_PRIORITY_BELOW_NORMAL;
+
+use crate::logger;
+
+/// How long the writer sleeps between batches, if nobody wakes it up.
+const WRITE_INTERVAL: Duration = Duration::from_millis(20);
+
+
+/// Length of message that's stored without allocating.
+const INLINE_MESSAGE_LEN: usize = 200;
+
+/// Formatted log message, which lives inline unless it's long.
+struct Message {
+  len: usize,
+  inline: [u8; INLINE_MESSAGE_LEN],
+  heap: Option<String>,
+}
+
+impl Message {
+  fn new(args: &fmt::Arguments) -> Message {
+    let mut message = Message {
+      len: 0,
+      inline: [0; INLINE_MESSAGE_LEN],
+      heap: None,
+    };
+    let _ = fmt::write(&mut message, *args);
+    message
+  }
+
+  fn as_str(&self) -> &str {
+    match self.heap {
+      Some(ref string) => string,
+      None => unsafe { std::str::from_utf8_unchecked(&self.inline[..self.len]) },
+    }
+  }
+}
+
+impl fmt::Write for Message {
+  fn write_str(&mut self, s: &str) -> fmt::Result {
+    if let Some(ref mut string) = self.heap {
+      string.push_str(s);
+    } else if self.len + s.len() <= INLINE_MESSAGE_LEN {
+      self.inline[self.len..self.len + s.len()].copy_from_slice(s.as_bytes());
+      self.len += s.len();
+    } else {
+      let mut string = String::with_capacity(self.len + s.len());
+      string.push_str(self.as_str());
+      string.push_str(s);
+      self.heap = Some(string);
+    }
+    Ok(())
+  }
+}
+
+/// Everything about a record that gets logged. Key-value pairs aren't kept, since dhc doesn't
+/// use them.
+struct Entry {
+  level: Level,
+  timestamp: u64,
+  file: &'static str,
+  line: u32,
+  column: u32,
+  function: &'static str,
+  module: &'static str,
+  message: Message,
+}
+
+impl Entry {
+  fn new(record: &Record) -> Entry {
+    let location = record.location();
+    Entry {
+      level: record.level(),
+      timestamp: logger::current_timestamp(),
+      file: location.file,
+      line: location.line,
+      column: location.column,
+      function: location.function,
+      module: location.module,
+      message: Message::new(record.msg()),
+    }
+  }
+
+  fn log<D: Drain>(&self, drain: &D, values: &OwnedKVList) {
+    let location = RecordLocation {
+      file: self.file,
+      line: self.line,
+      column: self.column,
+      function: self.function,
+      module: self.module,
+    };
+    let rstatic = RecordStatic {
+      location: &location,
+      tag: "",
+      level: self.level,
+    };
+    logger::with_timestamp(self.timestamp, || {
+      let _ = drain.log(
+        &Record::new(&rstatic, &format_args!("{}", self.message.as_str()), BorrowedKV(&())),
+        values,
+      );
+    });
+  }
+}
+
+struct Slot<T> {
+  /// Equal to the slot's position when it's free to be written, and one past it once it's full.
+  sequence: AtomicUsize,
+  value: UnsafeCell<MaybeUninit<T>>,
+}
+
+/// Bounded multi-producer, single-consumer queue, after Dmitry Vyukov's bounded MPMC queue.
+struct Queue<T> {
+  slots: Box<[Slot<T>]>,
+  mask: usize,
+
+  /// Position of the next value to be pushed.
+  head: AtomicUsize,
+
+  /// Position of the next value to be popped, only modified by the consumer.
+  tail: AtomicUsize,
+}
+
+unsafe impl<T: Send> Sync for Queue<T> {}
+
+impl<T> Queue<T> {
+  fn new(capacity: usize) -> Queue<T> {
+    let capacity = capacity.next_power_of_two();
+    Queue {
+      slots: (0..capacity)
+        .map(|i| Slot {
+          sequence: AtomicUsize::new(i),
+          value: UnsafeCell::new(MaybeUninit::uninit()),
+        })
+        .collect::<Vec<_>>()
+        .into_boxed_slice(),
+      mask: capacity - 1,
+      head: AtomicUsize::new(0),
+      tail: AtomicUsize::new(0),
+    }
+  }
+
+  /// Push a value, returning its position, or None if the queue is full.
+  fn push(&self, value: T) -> Option<usize> {
+    let mut pos = self.head.load(Ordering::Relaxed);
+    loop {
+      let slot = &self.slots[pos & self.mask];
+      let sequence = slot.sequence.load(Ordering::Acquire);
+      let diff = sequence as isize - pos as isize;
+      if diff == 0 {
+        match self
+          .head
+          .compare_exchange_weak(pos, pos.wrapping_add(1), Ordering::Relaxed, Ordering::Relaxed)
+        {
+          Ok(_) => {
+            unsafe { (*slot.value.get()).as_mut_ptr().write(value) };
+            slot.sequence.store(pos.wrapping_add(1), Ordering::Release);
+            return Some(pos);
+          }
+          Err(current) => pos = current,
+        }
+      } else if diff < 0 {
+        return None;
+      } else {
+        pos = self.head.load(Ordering::Relaxed);
+      }
+    }
+  }
+
+  /// Pop the oldest value. Must only be called from one thread at a time.
+  fn pop(&self) -> Option<T> {
+    let pos = self.tail.load(Ordering::Relaxed);
+    let slot = &self.slots[pos & self.mask];
+    if slot.sequence.load(Ordering::Acquire) != pos.wrapping_add(1) {
+      return None;
+    }
+
+    let value = unsafe { (*slot.value.get()).as_ptr().read() };
+    slot
+      .sequence
+      .store(pos.wrapping_add(self.slots.len()), Ordering::Release);
+    self.tail.store(pos.wrapping_add(1), Ordering::Relaxed);
+    Some(value)
+  }
+}
+
+impl<T> Drop for Queue<T> {
+  fn drop(&mut self) {
+    while self.pop().is_some() {}
+  }
+}
+
+/// Counts of what happened to the records that were logged.
+#[derive(Copy, Clone, Default, Debug)]
+pub struct AsyncLogStats {
+  pub written: u64,
+  pub dropped: u64,
+}
+
+/// Drain that records end up in. Whoever holds the lock is the queue's consumer.
+type OutputDrain = Box<dyn Drain<Ok = (), Err = slog::Never> + Send>;
+
+struct Shared {
+  queue: Queue<Entry>,
+  output: Mutex<OutputDrain>,
+
+  /// Number of records written, which is also the position of the next one to be written.
+  written: AtomicUsize,
+
+  /// Records dropped since the writer last reported it.
+  dropped: AtomicU64,
+
+  dropped_total: AtomicU64,
+  shutdown: AtomicBool,
+}
+
+pub struct AsyncDrain {
+  shared: Arc<Shared>,
+  writer: Option<JoinHandle<()>>,
+}
+
+// The queue is only touched through atomics, so a panic in the middle of logging can't leave it in
+// a state that anyone else would notice.
+impl std::panic::RefUnwindSafe for AsyncDrain {}
+impl std::panic::UnwindSafe for AsyncDrain {}
+
+impl AsyncDrain {
+  /// Start a writer thread that logs to `drain`, with room for `capacity` records in flight.
+  pub fn new<D>(drain: D, capacity: usize) -> AsyncDrain
+  where
+    D: Drain<Ok = (), Err = slog::Never> + Send + 'static,
+  {
+    let shared = Arc::new(Shared {
+      queue: Queue::new(capacity),
+      output: Mutex::new(Box::new(drain)),
+      written: AtomicUsize::new(0),
+      dropped: AtomicU64::new(0),
+      dropped_total: AtomicU64::new(0),
+      shutdown: AtomicBool::new(false),
+    });
+
+    let writer_shared = Arc::clone(&shared);
+    let writer = std::thread::Builder::new()
+      .name("dhc log writer".to_string())
+      .spawn(move || run_writer(writer_shared))
+      .expect("failed to spawn log writer");
+
+    AsyncDrain {
+      shared,
+      writer: Some(writer),
+    }
+  }
+
+  pub fn stats(&self) -> AsyncLogStats {
+    AsyncLogStats {
+      written: self.shared.written.load(Ordering::Relaxed) as u64,
+      dropped: self.shared.dropped_total.load(Ordering::Relaxed),
+    }
+  }
+
+  /// Handle that can write out whatever is still queued, even after the drain has been handed off
+  /// to a logger.
+  pub fn flusher(&self) -> AsyncFlusher {
+    AsyncFlusher {
+      shared: Arc::clone(&self.shared),
+    }
+  }
+
+  fn wake_writer(&self) {
+    if let Some(ref writer) = self.writer {
+      writer.thread().unpark();
+    }
+  }
+}
+
+impl Drain for AsyncDrain {
+  type Ok = ();
+  type Err = slog::Never;
+
+  fn log(&self, record: &Record, _: &OwnedKVList) -> Result<(), slog::Never> {
+    let shared = &*self.shared;
+    let urgent = record.level().is_at_least(Level::Error);
+    let pos = match shared.queue.push(Entry::new(record)) {
+      Some(pos) => pos,
+      None => {
+        shared.dropped.fetch_add(1, Ordering::Relaxed);
+        shared.dropped_total.fetch_add(1, Ordering::Relaxed);
+        return Ok(());
+      }
+    };
+
+    // Errors get written as soon as the writer gets to run, but never by waiting for it here: the
+    // writer runs below the priority of the input threads, so waiting would only stall them.
+    let backlog = pos.wrapping_sub(shared.written.load(Ordering::Relaxed));
+    if urgent || backlog >= shared.queue.slots.len() / 2 {
+      self.wake_writer();
+    }
+    Ok(())
+  }
+}
+
+impl Drop for AsyncDrain {
+  fn drop(&mut self) {
+    self.shared.shutdown.store(true, Ordering::Release);
+    if let Some(writer) = self.writer.take() {
+      writer.thread().unpark();
+      let _ = writer.join();
+    }
+  }
+}
+
+impl fmt::Debug for AsyncDrain {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    write!(f, "AsyncDrain({:?})", self.stats())
+  }
+}
+
+/// Handle to an AsyncDrain's queue, for writing it out when the process is about to go away.
+#[derive(Clone)]
+pub struct AsyncFlusher {
+  shared: Arc<Shared>,
+}
+
+impl AsyncFlusher {
+  /// Write everything that's been queued so far on the calling thread, instead of waiting for the
+  /// writer thread, which might never get to run again. Gives up after `timeout` if the writer is
+  /// stuck in the middle of a batch, and returns whether the queue was written out.
+  pub fn flush(&self, timeout: Duration) -> bool {
+    match self.shared.output.try_lock_for(timeout) {
+      Some(output) => {
+        write_queued(&self.shared, &*output);
+        true
+      }
+      None => false,
+    }
+  }
+}
+
+/// Write every queued record to `output`, which must be the locked output drain.
+fn write_queued(shared: &Shared, output: &OutputDrain) {
+  let values = OwnedKVList::from(slog::o!());
+  while let Some(entry) = shared.queue.pop() {
+    entry.log(output, &values);
+    shared.written.fetch_add(1, Ordering::Release);
+  }
+
+  let dropped = shared.dropped.swap(0, Ordering::Relaxed);
+  if dropped > 0 {
+    let message = format!("log queue overflowed, dropped {} records", dropped);
+    drop_warning(&message).log(output, &values);
+  }
+}
+
+fn run_writer(shared: Arc<Shared>) {
+  unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL as i32) };
+
+  loop {
+    // Check this before draining, so that nothing logged before shutdown gets left behind.
+    let shutdown = shared.shutdown.load(Ordering::Acquire);
+    write_queued(&shared, &*shared.output.lock());
+
+    if shutdown {
+      return;
+    }
+    std::thread::park_timeout(WRITE_INTERVAL);
+  }
+}
+
+fn drop_warning(message: &str) -> Entry {
+  Entry {
+    level: Level::Warning,
+    timestamp: logger::current_timestamp(),
+    file: file!(),
+    line: line!(),
+    column: column!(),
+    function: "",
+    module: module_path!(),
+    message: Message::new(&format_args!("{}", message)),
+  }
+}
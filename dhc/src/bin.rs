@@ -1,11 +1,335 @@
 extern crate dhc;
 
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::os::windows::ffi::OsStrExt;
+use std::sync::atomic::Ordering;
+use std::time::{Duration, Instant};
+
+use winapi::shared::minwindef::FARPROC;
+use winapi::um::libloaderapi::{GetProcAddress, LoadLibraryW};
+use winapi::um::synchapi::{CreateEventW, WaitForSingleObject};
+use winapi::um::winbase::WAIT_OBJECT_0;
+
+/// Look up a benchmark exported by one of the DLLs that sits next to dhc.exe, exiting if it can't
+/// be found.
+fn benchmark_proc(dll: &str, name: &str) -> FARPROC {
+  let path = std::env::current_exe()
+    .expect("failed to get executable path")
+    .with_file_name(dll);
+  let wide: Vec<u16> = OsStr::new(&path).encode_wide().chain(Some(0)).collect();
+  let module = unsafe { LoadLibraryW(wide.as_ptr()) };
+  if module.is_null() {
+    eprintln!("failed to load {}: {}", path.display(), std::io::Error::last_os_error());
+    std::process::exit(1);
+  }
+
+  let name = std::ffi::CString::new(name).unwrap();
+  let proc = unsafe { GetProcAddress(module, name.as_ptr()) };
+  if proc.is_null() {
+    eprintln!("{} doesn't export {:?}", path.display(), name);
+    std::process::exit(1);
+  }
+  proc
+}
+
+/// Measure how long initialization takes, the way that a game would see it.
+fn startup() {
+  let start = Instant::now();
+  dhc::ffi::dhc_init();
+  let device_count = dhc::ffi::dhc_get_device_count();
+  let first_call = start.elapsed();
+
+  while dhc::startup_times().background.is_none() {
+    std::thread::sleep(Duration::from_millis(1));
+  }
+
+  let times = dhc::startup_times();
+  println!("first call:  {:>8} us ({} devices)", first_call.as_micros(), device_count);
+  println!("  dhc::init: {:>8} us", times.first_call.unwrap_or_default().as_micros());
+  println!("background:  {:>8} us", times.background.unwrap_or_default().as_micros());
+}
+
+/// Measure how the cost of an update scales with the number of devices.
+fn bench_update() {
+  const ITERATIONS: usize = 100_000;
+  for &device_count in &[1, 2, 4, 8, 16, 32, 64] {
+    let elapsed = dhc::benchmark_update(device_count, ITERATIONS);
+    let per_update = elapsed.as_nanos() as f64 / ITERATIONS as f64;
+    println!(
+      "{:>3} devices: {:>8.1} ns per update, {:>6.1} ns per device",
+      device_count,
+      per_update,
+      per_update / device_count as f64
+    );
+  }
+}
+
+/// Compare GetDeviceState's compiled program against the per-object path that it replaced.
+fn bench_get_device_state() {
+  type Benchmark = unsafe extern "system" fn(u32, *mut f64, *mut f64);
+  let proc = benchmark_proc("dinput8_benchmark.dll", "DhcBenchmarkGetDeviceState");
+  let benchmark: Benchmark = unsafe { std::mem::transmute(proc) };
+
+  let (mut program, mut apply) = (0.0, 0.0);
+  unsafe { benchmark(10_000_000, &mut program, &mut apply) };
+  println!("DeviceStateProgram: {:>6.1} ns per GetDeviceState", program);
+  println!("DeviceFormat::Apply: {:>5.1} ns per GetDeviceState", apply);
+}
+
+/// Measure how long it takes to decode an input report, generically and natively.
+fn bench_decode() {
+  for (name, nanos) in dhc::benchmark_decode(10_000_000) {
+    println!("{:<24} {:>6.1} ns per report", format!("{}:", name), nanos);
+  }
+}
+
+/// Compare reading raw input a message at a time against draining it with GetRawInputBuffer.
+fn bench_rawinput() {
+  for &batch_size in &[1, 4, 16, 64] {
+    match dhc::benchmark_raw_input(batch_size, 200) {
+      Ok(result) => println!(
+        "{:>2} reports per batch: per message {:>8.1} ns per report, batched {:>8.1} ns per report",
+        result.batch_size, result.per_message, result.batched
+      ),
+      Err(err) => {
+        eprintln!("{} reports per batch: {}", batch_size, err);
+        std::process::exit(1);
+      }
+    }
+  }
+}
+
+/// Hotplug devices as fast as possible, making sure that bindings stay consistent.
+fn stress_hotplug() {
+  const ITERATIONS: usize = 100_000;
+  for &device_count in &[1, 4, 16, 64] {
+    match dhc::stress_hotplug(device_count, ITERATIONS) {
+      Ok(elapsed) => println!(
+        "{:>3} devices: {} hotplugs in {} ms",
+        device_count,
+        ITERATIONS,
+        elapsed.as_millis()
+      ),
+      Err(err) => {
+        eprintln!("{:>3} devices: {}", device_count, err);
+        std::process::exit(1);
+      }
+    }
+  }
+}
+
+/// Measure what disabled log statements cost.
+fn bench_log() {
+  const ITERATIONS: u32 = 10_000_000;
+  let result = dhc::benchmark_logging(ITERATIONS);
+  println!("empty loop:             {:>6.2} ns", result.baseline);
+  println!("disabled debug!:        {:>6.2} ns", result.disabled_debug);
+  println!("dhc_log_is_enabled:     {:>6.2} ns", result.ffi_check);
+
+  // The C++ side, as built into dinput8_benchmark.dll, whose copy of dhc never gets initialized here.
+  type Benchmark = unsafe extern "system" fn(u32, *mut f64, *mut f64, *mut f64, *mut f64);
+  let proc = benchmark_proc("dinput8_benchmark.dll", "DhcBenchmarkLogging");
+  let benchmark: Benchmark = unsafe { std::mem::transmute(proc) };
+  let (mut baseline, mut level_check, mut log_debug, mut log_verbose) = (0.0, 0.0, 0.0, 0.0);
+  unsafe { benchmark(ITERATIONS, &mut baseline, &mut level_check, &mut log_debug, &mut log_verbose) };
+  println!("C++ empty loop:         {:>6.2} ns", baseline);
+  println!("dhc_log_level_enabled:  {:>6.2} ns", level_check);
+  println!("disabled LOG(DEBUG):    {:>6.2} ns", log_debug);
+  println!("disabled LOG(VERBOSE):  {:>6.2} ns", log_verbose);
+}
+
+/// Measure how long logging holds up the thread that logs, synchronously and asynchronously.
+fn bench_async_log() {
+  const ITERATIONS: u32 = 100_000;
+  match dhc::benchmark_async_logging(ITERATIONS) {
+    Ok(result) => {
+      println!(
+        "sync:  {:>8} ns mean, {:>8} us max",
+        result.sync_mean.as_nanos(),
+        result.sync_max.as_micros()
+      );
+      println!(
+        "async: {:>8} ns mean, {:>8} us max, {} of {} dropped",
+        result.async_mean.as_nanos(),
+        result.async_max.as_micros(),
+        result.async_dropped,
+        ITERATIONS
+      );
+    }
+    Err(err) => {
+      eprintln!("failed to benchmark logging: {}", err);
+      std::process::exit(1);
+    }
+  }
+}
+
+/// Print a flight recorder dump as a timeline.
+fn decode_flight(path: Option<String>) {
+  let path = path.unwrap_or_else(|| "dhc_flight.bin".to_string());
+  let read = |path: &str| dhc::flight::read_dump(&mut std::io::BufReader::new(std::fs::File::open(path)?));
+  let dump = match read(&path) {
+    Ok(dump) => dump,
+    Err(err) => {
+      eprintln!("failed to read {}: {}", path, err);
+      std::process::exit(1);
+    }
+  };
+
+  println!("{} events", dump.events.len());
+  let start = match dump.events.first() {
+    Some(event) => event.timestamp,
+    None => return,
+  };
+  let frequency = dump.qpc_frequency.max(1) as f64;
+  for event in &dump.events {
+    let ms = event.timestamp.wrapping_sub(start) as i64 as f64 * 1000.0 / frequency;
+    println!("{:>8} {:>14.6} ms  {}", event.sequence, ms, event);
+  }
+}
+
+/// Watch the live metrics of a running game, like top.
+fn top(process_id: Option<String>) {
+  let process_id = match process_id.as_deref().map(str::parse::<u32>) {
+    Some(Ok(process_id)) => process_id,
+    _ => {
+      eprintln!("usage: dhc top <pid>");
+      std::process::exit(1);
+    }
+  };
+  let view = match dhc::metrics::MetricsView::open(process_id) {
+    Ok(view) => view,
+    Err(err) => {
+      eprintln!("failed to open metrics of process {}: {}", process_id, err);
+      std::process::exit(1);
+    }
+  };
+
+  let block = view.block();
+  let frequency = block.clock_frequency.load(Ordering::Relaxed).max(1) as f64;
+  let timing = |name: &str, timing: &dhc::metrics::Timing| {
+    let count = timing.count.load(Ordering::Relaxed);
+    let total = timing.total_ticks.load(Ordering::Relaxed) as f64;
+    let max = timing.max_ticks.load(Ordering::Relaxed) as f64;
+    let mean = if count == 0 { 0.0 } else { total / count as f64 };
+    println!(
+      "{:<12} {:>10} calls, {:>8.1} us mean, {:>8.1} us max",
+      name,
+      count,
+      mean * 1e6 / frequency,
+      max * 1e6 / frequency
+    );
+  };
+
+  // Rates are per refresh, so they need the previous counts, keyed by what they were counting.
+  let mut previous_real: HashMap<u64, (u64, u64)> = HashMap::new();
+  let mut previous_virtual = vec![(0, 0); block.virtual_devices.len()];
+  let mut last = Instant::now();
+  loop {
+    std::thread::sleep(Duration::from_secs(1));
+    let now = Instant::now();
+    let seconds = now.duration_since(last).as_secs_f64();
+    last = now;
+
+    print!("\x1b[2J\x1b[H");
+    println!("dhc metrics for process {}", process_id);
+    println!();
+    timing("input loop", &block.input_loop);
+    timing("update", &block.update);
+
+    println!();
+    println!(
+      "{:<24} {:>10} {:>10} {:>8} {:>10} {:>5}",
+      "device", "reports/s", "bytes/s", "errors", "duplicates", "bound"
+    );
+    let mut current_real = HashMap::new();
+    for slot in block.real_devices.iter() {
+      let device = slot.device.load(Ordering::Relaxed);
+      if device == 0 {
+        continue;
+      }
+      let reports = slot.reports.load(Ordering::Relaxed);
+      let bytes = slot.bytes.load(Ordering::Relaxed);
+      let (previous_reports, previous_bytes) = previous_real.get(&device).cloned().unwrap_or((reports, bytes));
+      current_real.insert(device, (reports, bytes));
+
+      let bound = match slot.bound_to.load(Ordering::Relaxed) {
+        0 => "-".to_string(),
+        idx => format!("P{}", idx),
+      };
+      println!(
+        "{:<24} {:>10.1} {:>10.1} {:>8} {:>10} {:>5}",
+        dhc::flight::DeviceCode(device).to_string(),
+        reports.wrapping_sub(previous_reports) as f64 / seconds,
+        bytes.wrapping_sub(previous_bytes) as f64 / seconds,
+        slot.parse_errors.load(Ordering::Relaxed),
+        slot.duplicates.load(Ordering::Relaxed),
+        bound
+      );
+    }
+    previous_real = current_real;
+
+    println!();
+    println!("{:<6} {:>10} {:>10}  {}", "player", "polls/s", "xpolls/s", "bound to");
+    for (idx, slot) in block.virtual_devices.iter().enumerate() {
+      let polls = slot.polls.load(Ordering::Relaxed);
+      let xinput_polls = slot.xinput_polls.load(Ordering::Relaxed);
+      let (previous_polls, previous_xinput_polls) = previous_virtual[idx];
+      previous_virtual[idx] = (polls, xinput_polls);
+
+      let bound_device = slot.bound_device.load(Ordering::Relaxed);
+      if polls == 0 && xinput_polls == 0 && bound_device == 0 {
+        continue;
+      }
+      let bound = match bound_device {
+        0 => "-".to_string(),
+        device => dhc::flight::DeviceCode(device).to_string(),
+      };
+      println!(
+        "{:<6} {:>10.1} {:>10.1}  {}",
+        format!("P{}", idx + 1),
+        polls.wrapping_sub(previous_polls) as f64 / seconds,
+        xinput_polls.wrapping_sub(previous_xinput_polls) as f64 / seconds,
+        bound
+      );
+    }
+  }
+}
+
 fn main() {
+  match std::env::args().nth(1).as_deref() {
+    Some("startup") => return startup(),
+    Some("bench-update") => return bench_update(),
+    Some("bench-get-device-state") => return bench_get_device_state(),
+    Some("bench-decode") => return bench_decode(),
+    Some("bench-rawinput") => return bench_rawinput(),
+    Some("stress-hotplug") => return stress_hotplug(),
+    Some("bench-log") => return bench_log(),
+    Some("bench-async-log") => return bench_async_log(),
+    Some("flight") => return decode_flight(std::env::args().nth(2)),
+    Some("top") => return top(std::env::args().nth(2)),
+    _ => {}
+  }
+
   dhc::init();
   let ctx = dhc::Context::instance();
 
+  // Sleep until one of the virtual devices changes, instead of polling.
+  let event = unsafe { CreateEventW(std::ptr::null_mut(), 0, 0, std::ptr::null()) };
+  assert!(!event.is_null());
+  for i in 0..ctx.device_count() {
+    ctx.set_event_notification(i, event);
+  }
+
   loop {
+    // Wake up periodically anyway, to pick up hotplugged devices.
+    let rc = unsafe { WaitForSingleObject(event, 3000) };
     ctx.update();
-    std::thread::sleep(std::time::Duration::from_millis(3000));
+
+    if rc == WAIT_OBJECT_0 {
+      for i in 0..ctx.device_count() {
+        println!("P{}: {}", i + 1, ctx.device_state(i));
+      }
+    }
   }
 }
@@ -0,0 +1,40 @@
+//! Timestamps from QueryPerformanceCounter, which are cheap to take and comparable across threads.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use winapi::shared::ntdef::LARGE_INTEGER;
+use winapi::um::profileapi::{QueryPerformanceCounter, QueryPerformanceFrequency};
+
+/// Ticks per second, which is fixed at boot. Zero until it's first asked for.
+static FREQUENCY: AtomicU64 = AtomicU64::new(0);
+
+/// Current time, in ticks.
+pub fn now() -> u64 {
+  let mut count: LARGE_INTEGER = unsafe { std::mem::zeroed() };
+  unsafe { QueryPerformanceCounter(&mut count) };
+  unsafe { *count.QuadPart() as u64 }
+}
+
+/// Number of ticks per second.
+pub fn frequency() -> u64 {
+  let cached = FREQUENCY.load(Ordering::Relaxed);
+  if cached != 0 {
+    return cached;
+  }
+
+  let mut frequency: LARGE_INTEGER = unsafe { std::mem::zeroed() };
+  unsafe { QueryPerformanceFrequency(&mut frequency) };
+  let frequency = unsafe { *frequency.QuadPart() as u64 }.max(1);
+  FREQUENCY.store(frequency, Ordering::Relaxed);
+  frequency
+}
+
+pub fn to_nanos(ticks: u64) -> u64 {
+  (u128::from(ticks) * 1_000_000_000 / u128::from(frequency())) as u64
+}
+
+/// Milliseconds since the counter started, which is when the system started, wrapping like
+/// GetTickCount.
+pub fn to_millis(ticks: u64) -> u32 {
+  (u128::from(ticks) * 1000 / u128::from(frequency())) as u32
+}
@@ -16,7 +16,11 @@ static DEFAULT_CONFIG: &str = indoc!(
   # Open a console to output logging.
   console = true
 
-  # Number of devices to emulate.
+  # Write logs from a background thread, so that logging doesn't hold up input.
+  # If the log can't keep up, lines are dropped, and a warning says how many.
+  async_logging = false
+
+  # Number of devices to emulate, up to 64.
   device_count = 2
 
   # The mode of emulation to use.
@@ -24,10 +28,36 @@ static DEFAULT_CONFIG: &str = indoc!(
   # Most games (i.e. any game that supports a PS4 controller) will want "directinput".
   mode = "directinput"
 
+  # Devices that XInput's four controller slots map to, numbered from 0.
+  # By default, the first four devices are used.
+  # xinput_slots = [0, 1, 2, 3]
+
   # Override the left stick with dpad inputs.
   # This flag emulates console behavior for games such as UNDER NIGHT IN-BIRTH on PS4.
   dpad_override = false
 
+  # Decode controller reports when the game asks for them, instead of as they arrive.
+  # This saves CPU with controllers that report much faster than the game polls, but buffered
+  # DirectInput data only sees changes between polls.
+  lazy_decode = false
+
+  # How to read reports from controllers.
+  # Valid values are "rawinput", "iocp".
+  # "iocp" reads each controller on its own with overlapped I/O instead of through the window
+  # message queue, which helps when several high-rate controllers are plugged in.
+  backend = "rawinput"
+
+  # How often to poll XInput controllers, in Hz.
+  xinput_poll_rate = 1000
+
+  # Remember controllers in dhc_devices.toml, so that they can be set up faster next time.
+  # Delete the file if a controller stops working after a firmware update.
+  device_cache = true
+
+  # Number of spans that each thread keeps when dhc is built with tracing, after which the oldest
+  # get overwritten. Each one takes 32 bytes, allocated as they're recorded.
+  trace_spans_per_thread = 65536
+
   # Deadzone customization.
   # This allows you to set a threshold for left analog stick values.
   # Any x/y values (from 0 to 1) below it are snapped to the center.
@@ -60,23 +90,107 @@ impl<'de> Deserialize<'de> for EmulationMode {
   }
 }
 
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum InputBackend {
+  RawInput,
+  Iocp,
+}
+
+impl Default for InputBackend {
+  fn default() -> Self {
+    InputBackend::RawInput
+  }
+}
+
+impl<'de> Deserialize<'de> for InputBackend {
+  fn deserialize<D>(deserializer: D) -> Result<Self, D::Error>
+  where
+    D: Deserializer<'de>,
+  {
+    let s = String::deserialize(deserializer)?;
+    match s.as_str() {
+      "rawinput" => Ok(InputBackend::RawInput),
+      "iocp" => Ok(InputBackend::Iocp),
+      _ => Err(serde::de::Error::custom(format!("unknown input backend: {}", s))),
+    }
+  }
+}
+
 #[derive(Clone, Deserialize, Debug)]
 pub struct Config {
   pub console: bool,
   pub log_level: logger::LogLevel,
+  #[serde(default = "default_async_logging")]
+  pub async_logging: bool,
   pub device_count: usize,
   pub mode: EmulationMode,
   pub dpad_override: bool,
+  #[serde(default)]
+  pub lazy_decode: bool,
+  #[serde(default)]
+  pub backend: InputBackend,
+  #[serde(default = "default_xinput_poll_rate")]
+  pub xinput_poll_rate: u32,
+  #[serde(default = "default_device_cache")]
+  pub device_cache: bool,
+  #[serde(default)]
+  pub xinput_slots: Option<Vec<usize>>,
+  #[serde(default = "default_trace_spans_per_thread")]
+  pub trace_spans_per_thread: usize,
   pub deadzone: Option<DeadzoneConfig>,
 }
 
+fn default_async_logging() -> bool {
+  false
+}
+
+fn default_xinput_poll_rate() -> u32 {
+  1000
+}
+
+fn default_device_cache() -> bool {
+  true
+}
+
+fn default_trace_spans_per_thread() -> usize {
+  65536
+}
+
 #[derive(Clone, Deserialize, Debug)]
 pub struct DeadzoneConfig {
   pub enabled: bool,
   pub threshold: f32,
 }
 
+/// Most devices that can be emulated.
+pub const MAX_DEVICE_COUNT: usize = 64;
+
+/// Number of controller slots that XInput has.
+pub const XINPUT_SLOT_COUNT: usize = 4;
+
 impl Config {
+  /// Number of devices to emulate, limited to what's supported.
+  pub fn device_count(&self) -> usize {
+    self.device_count.min(MAX_DEVICE_COUNT)
+  }
+
+  /// Device that an XInput controller slot maps to, if any.
+  pub fn xinput_slot(&self, user_index: usize) -> Option<usize> {
+    if user_index >= XINPUT_SLOT_COUNT {
+      return None;
+    }
+
+    let device = match self.xinput_slots {
+      Some(ref slots) => *slots.get(user_index)?,
+      None => user_index,
+    };
+    if device < self.device_count() {
+      Some(device)
+    } else {
+      None
+    }
+  }
+
   fn parse(s: &str) -> io::Result<Config> {
     toml::from_str(s).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))
   }
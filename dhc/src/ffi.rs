@@ -1,15 +1,29 @@
 use crate::*;
 
-use crate::logger::LogLevel;
+use crate::logger::{LevelCache, LogLevel};
 
 #[no_mangle]
 pub extern "C" fn dhc_init() {
   crate::init();
 }
 
+/// Time spent in the first call to dhc_init, in microseconds, or 0 if it hasn't returned yet.
+#[no_mangle]
+pub extern "C" fn dhc_get_startup_first_call_us() -> u64 {
+  startup_times().first_call.map_or(0, |time| time.as_micros() as u64)
+}
+
+/// Time from the first call to dhc_init until initialization finished in the background, in
+/// microseconds, or 0 if it's still going.
+#[no_mangle]
+pub extern "C" fn dhc_get_startup_total_us() -> u64 {
+  startup_times().background.map_or(0, |time| time.as_micros() as u64)
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn dhc_log(level: LogLevel, msg: *const u8, msg_len: usize) {
-  let string = std::str::from_utf8_unchecked(std::slice::from_raw_parts(msg, msg_len));
+  // Messages come from C++ streams, which will happily format strings that aren't UTF-8.
+  let string = String::from_utf8_lossy(std::slice::from_raw_parts(msg, msg_len));
 
   if level == LogLevel::Fatal {
     panic!("{}", string);
@@ -18,14 +32,83 @@ pub unsafe extern "C" fn dhc_log(level: LogLevel, msg: *const u8, msg_len: usize
   log!(level.to_log(), "{}", string);
 }
 
+/// Write out log records that are still queued for the log writer thread. Call this when the
+/// process is about to go away, since the writer might not get another chance to run.
+#[no_mangle]
+pub extern "C" fn dhc_log_flush() {
+  crate::logger::flush();
+}
+
+/// Write the flight recorder's events to dhc_flight.bin, next to the executable.
+#[no_mangle]
+pub extern "C" fn dhc_flight_recorder_dump() -> bool {
+  crate::flight::dump_default()
+}
+
+/// Start time of a span, for dhc_trace_span. Always 0 unless dhc is built with tracing.
+#[no_mangle]
+pub extern "C" fn dhc_trace_now() -> u64 {
+  #[cfg(feature = "tracing")]
+  return crate::clock::now();
+
+  #[cfg(not(feature = "tracing"))]
+  return 0;
+}
+
+/// Record a span named `name` that started at `start` (from dhc_trace_now) and ends now.
+///
+/// `name` must be a NUL-terminated UTF-8 string. It's copied the first time it's seen, so it only
+/// needs to live until this returns, but each distinct name is kept forever.
+#[no_mangle]
+pub unsafe extern "C" fn dhc_trace_span(name: *const std::os::raw::c_char, start: u64) {
+  #[cfg(feature = "tracing")]
+  {
+    let end = crate::clock::now();
+    crate::spans::record_foreign(std::ffi::CStr::from_ptr(name), start, end);
+  }
+
+  #[cfg(not(feature = "tracing"))]
+  let _ = (name, start);
+}
+
+/// Write the spans recorded so far to dhc_trace.json, next to the executable. Returns false if
+/// that failed, or if dhc isn't built with tracing.
+#[no_mangle]
+pub extern "C" fn dhc_trace_export() -> bool {
+  #[cfg(feature = "tracing")]
+  return crate::spans::export_default();
+
+  #[cfg(not(feature = "tracing"))]
+  return false;
+}
+
 #[no_mangle]
 pub extern "C" fn dhc_log_is_enabled(level: LogLevel) -> bool {
   log_enabled!(level.to_log())
 }
 
+/// Register a 32-bit integer to be kept up to date with the lowest LogLevel that's logged, so that
+/// callers can check whether a level is enabled without calling into dhc. Until logging is
+/// initialized, it's set to one past LogLevel::Fatal.
+///
+/// The integer must stay alive until it's passed to dhc_log_unregister_level, and must only be read
+/// atomically.
+#[no_mangle]
+pub unsafe extern "C" fn dhc_log_register_level(level: *mut i32) {
+  crate::logger::register_level_cache(LevelCache(level as *const _));
+}
+
+/// Stop updating an integer registered with dhc_log_register_level, so that it can go away.
+#[no_mangle]
+pub extern "C" fn dhc_log_unregister_level(level: *mut i32) {
+  crate::logger::unregister_level_cache(LevelCache(level as *const _));
+}
+
+// The device count and mode come straight from the configuration, so that games can create their
+// devices without waiting for the input thread to start.
 #[no_mangle]
 pub extern "C" fn dhc_xinput_is_enabled() -> bool {
-  Context::instance().xinput_enabled()
+  CONFIG.mode == config::EmulationMode::XInput
 }
 
 #[no_mangle]
@@ -35,7 +118,19 @@ pub extern "C" fn dhc_update() {
 
 #[no_mangle]
 pub extern "C" fn dhc_get_device_count() -> usize {
-  Context::instance().device_count()
+  CONFIG.device_count()
+}
+
+/// Look up the device that an XInput controller slot maps to. Returns false if the slot is empty.
+#[no_mangle]
+pub unsafe extern "C" fn dhc_get_xinput_slot(user_index: usize, device_index: *mut usize) -> bool {
+  match CONFIG.xinput_slot(user_index) {
+    Some(idx) => {
+      *device_index = idx;
+      true
+    }
+    None => false,
+  }
 }
 
 #[no_mangle]
@@ -43,6 +138,61 @@ pub extern "C" fn dhc_get_inputs(index: usize) -> DeviceInputs {
   Context::instance().device_state(index)
 }
 
+/// Get latency statistics for a virtual device: how long it takes for a report to reach the game
+/// since startup, and how often the game polled over the last logging interval. Returns false if
+/// the index is out of range.
+#[no_mangle]
+pub unsafe extern "C" fn dhc_get_latency_stats(index: usize, stats: *mut LatencyStats) -> bool {
+  match Context::instance().latency_stats(index) {
+    Some(result) => {
+      *stats = result;
+      true
+    }
+    None => false,
+  }
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_get_xinput_state(index: usize) -> XInputState {
+  Context::instance().xinput_state(index)
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_set_event_notification(index: usize, event: *mut std::ffi::c_void) {
+  Context::instance().set_event_notification(index, event as winapi::shared::ntdef::HANDLE);
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_get_device_data_count(index: usize) -> usize {
+  Context::instance().device_event_count(index)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn dhc_peek_device_data(
+  index: usize,
+  offset: usize,
+  events: *mut InputEvent,
+  count: usize,
+) -> usize {
+  let out = std::slice::from_raw_parts_mut(events, count);
+  Context::instance().peek_device_events(index, offset, out)
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_consume_device_data(index: usize, count: usize) -> usize {
+  Context::instance().consume_device_events(index, count)
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_take_device_data_overflow(index: usize) -> bool {
+  Context::instance().take_device_events_overflow(index)
+}
+
+#[no_mangle]
+pub extern "C" fn dhc_peek_device_data_overflow(index: usize) -> bool {
+  Context::instance().device_events_overflowed(index)
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn dhc_get_axis(inputs: *const DeviceInputs, axis_type: AxisType) -> f64 {
   (*inputs).get_axis(axis_type).get().into()
@@ -0,0 +1,315 @@
+//! Always-on flight recorder.
+//!
+//! Hotplug, binding, report and poll events are recorded into a fixed-size ring in memory, which
+//! costs a handful of relaxed stores per event, so it can stay on when logging can't. The ring is
+//! dumped to dhc_flight.bin when dhc panics (which includes FATAL log messages from the DLLs), or
+//! whenever dhc_flight_recorder_dump is called, and `dhc flight <file>` turns a dump into a
+//! timeline.
+
+use std::fmt;
+use std::fs::File;
+use std::io::{self, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{fence, AtomicU64, AtomicUsize, Ordering};
+
+use crate::clock;
+use crate::input::DeviceId;
+
+/// Number of events kept, which needs to be a power of two.
+const CAPACITY: usize = 16384;
+
+const MAGIC: [u8; 8] = *b"DHCFLGHT";
+const VERSION: u32 = 1;
+const RECORD_SIZE: u32 = 40;
+
+/// Set in the device code of XInput devices, to tell them apart from raw input handles.
+const XINPUT_DEVICE_FLAG: u64 = 1 << 63;
+
+#[repr(u16)]
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum EventKind {
+  /// A real device showed up: `device`.
+  DeviceArrived = 1,
+
+  /// A real device went away: `device`.
+  DeviceRemoved = 2,
+
+  /// Virtual device `index` was bound to `device`.
+  Bound = 3,
+
+  /// Virtual device `index` was unbound from `device`.
+  Unbound = 4,
+
+  /// `index` reports came in from `device`, the newest of which started with the bytes in `data`.
+  Report = 5,
+
+  /// The game read virtual device `index` through DirectInput.
+  Poll = 6,
+
+  /// The game read virtual device `index` through XInput.
+  XInputPoll = 7,
+}
+
+impl EventKind {
+  fn from_u16(value: u16) -> Option<EventKind> {
+    Some(match value {
+      1 => EventKind::DeviceArrived,
+      2 => EventKind::DeviceRemoved,
+      3 => EventKind::Bound,
+      4 => EventKind::Unbound,
+      5 => EventKind::Report,
+      6 => EventKind::Poll,
+      7 => EventKind::XInputPoll,
+      _ => return None,
+    })
+  }
+}
+
+/// One slot in the ring. Everything is stored as separate atomics, so that a dump taken while
+/// events are being recorded only ever sees torn records, which it can detect and skip.
+struct Slot {
+  /// One more than the event's sequence number, or 0 while the slot is being written.
+  sequence: AtomicU64,
+  timestamp: AtomicU64,
+
+  /// Event kind in the upper half, index in the lower.
+  kind_index: AtomicU64,
+  device: AtomicU64,
+  data: AtomicU64,
+}
+
+impl Slot {
+  const EMPTY: Slot = Slot {
+    sequence: AtomicU64::new(0),
+    timestamp: AtomicU64::new(0),
+    kind_index: AtomicU64::new(0),
+    device: AtomicU64::new(0),
+    data: AtomicU64::new(0),
+  };
+}
+
+static SLOTS: [Slot; CAPACITY] = [Slot::EMPTY; CAPACITY];
+static HEAD: AtomicUsize = AtomicUsize::new(0);
+
+/// Encode a device ID into the 64 bits that are recorded for it.
+pub fn device_code(id: DeviceId) -> u64 {
+  match id {
+    DeviceId::RawInput(id) => id.0 & !XINPUT_DEVICE_FLAG,
+    DeviceId::XInput(id) => XINPUT_DEVICE_FLAG | id.0 as u64,
+  }
+}
+
+pub fn record(kind: EventKind, index: u32, device: u64, data: u64) {
+  record_at(clock::now(), kind, index, device, data);
+}
+
+/// Record an event that happened at `timestamp`, for callers that already know the time.
+pub fn record_at(timestamp: u64, kind: EventKind, index: u32, device: u64, data: u64) {
+  let sequence = HEAD.fetch_add(1, Ordering::Relaxed);
+  let slot = &SLOTS[sequence & (CAPACITY - 1)];
+
+  slot.sequence.store(0, Ordering::Relaxed);
+  fence(Ordering::Release);
+  slot.timestamp.store(timestamp, Ordering::Relaxed);
+  slot
+    .kind_index
+    .store((kind as u64) << 32 | u64::from(index), Ordering::Relaxed);
+  slot.device.store(device, Ordering::Relaxed);
+  slot.data.store(data, Ordering::Relaxed);
+  slot.sequence.store(sequence as u64 + 1, Ordering::Release);
+}
+
+/// Record a run of reports from a device that arrived at `timestamp`, along with the start of the
+/// newest one.
+pub fn record_reports(timestamp: u64, device: u64, count: usize, newest: &[u8]) {
+  let mut data = [0u8; 8];
+  let len = newest.len().min(data.len());
+  data[..len].copy_from_slice(&newest[..len]);
+  record_at(
+    timestamp,
+    EventKind::Report,
+    count as u32,
+    device,
+    u64::from_le_bytes(data),
+  );
+}
+
+/// Recorded event, as read back from a dump.
+#[derive(Copy, Clone, Debug)]
+pub struct Event {
+  pub sequence: u64,
+  pub timestamp: u64,
+  pub kind: Option<EventKind>,
+  pub index: u32,
+  pub device: u64,
+  pub data: u64,
+}
+
+/// Copy the events that are in the ring right now, oldest first.
+fn snapshot() -> Vec<Event> {
+  let mut events = Vec::with_capacity(CAPACITY);
+  for slot in SLOTS.iter() {
+    let sequence = slot.sequence.load(Ordering::Acquire);
+    if sequence == 0 {
+      continue;
+    }
+
+    let timestamp = slot.timestamp.load(Ordering::Relaxed);
+    let kind_index = slot.kind_index.load(Ordering::Relaxed);
+    let device = slot.device.load(Ordering::Relaxed);
+    let data = slot.data.load(Ordering::Relaxed);
+    fence(Ordering::Acquire);
+    if slot.sequence.load(Ordering::Relaxed) != sequence {
+      continue;
+    }
+
+    events.push(Event {
+      sequence: sequence - 1,
+      timestamp,
+      kind: EventKind::from_u16((kind_index >> 32) as u16),
+      index: kind_index as u32,
+      device,
+      data,
+    });
+  }
+  events.sort_unstable_by_key(|event| event.sequence);
+  events
+}
+
+/// Write the contents of the ring to `path`, returning the number of events written.
+pub fn dump(path: &Path) -> io::Result<usize> {
+  let events = snapshot();
+  let mut file = BufWriter::new(File::create(path)?);
+  file.write_all(&MAGIC)?;
+  file.write_all(&VERSION.to_le_bytes())?;
+  file.write_all(&RECORD_SIZE.to_le_bytes())?;
+  file.write_all(&clock::frequency().to_le_bytes())?;
+  file.write_all(&(events.len() as u64).to_le_bytes())?;
+  for event in &events {
+    let kind = event.kind.map_or(0, |kind| kind as u16);
+    file.write_all(&event.sequence.to_le_bytes())?;
+    file.write_all(&event.timestamp.to_le_bytes())?;
+    file.write_all(&(u32::from(kind)).to_le_bytes())?;
+    file.write_all(&event.index.to_le_bytes())?;
+    file.write_all(&event.device.to_le_bytes())?;
+    file.write_all(&event.data.to_le_bytes())?;
+  }
+  file.flush()?;
+  Ok(events.len())
+}
+
+/// Where dumps go unless asked otherwise.
+pub fn default_path() -> PathBuf {
+  crate::config_path("dhc_flight.bin")
+}
+
+/// Dump the ring to the default path, logging what happened.
+pub fn dump_default() -> bool {
+  let path = default_path();
+  match dump(&path) {
+    Ok(count) => {
+      info!("dumped {} flight recorder events to {}", count, path.display());
+      true
+    }
+    Err(err) => {
+      error!("failed to dump flight recorder to {}: {}", path.display(), err);
+      false
+    }
+  }
+}
+
+/// Contents of a dump.
+pub struct Dump {
+  pub qpc_frequency: u64,
+  pub events: Vec<Event>,
+}
+
+fn read_u32(reader: &mut impl Read) -> io::Result<u32> {
+  let mut buf = [0u8; 4];
+  reader.read_exact(&mut buf)?;
+  Ok(u32::from_le_bytes(buf))
+}
+
+fn read_u64(reader: &mut impl Read) -> io::Result<u64> {
+  let mut buf = [0u8; 8];
+  reader.read_exact(&mut buf)?;
+  Ok(u64::from_le_bytes(buf))
+}
+
+pub fn read_dump(reader: &mut impl Read) -> io::Result<Dump> {
+  let invalid = |msg: &str| io::Error::new(io::ErrorKind::InvalidData, msg.to_string());
+
+  let mut magic = [0u8; 8];
+  reader.read_exact(&mut magic)?;
+  if magic != MAGIC {
+    return Err(invalid("not a flight recorder dump"));
+  }
+  if read_u32(reader)? != VERSION {
+    return Err(invalid("unsupported flight recorder dump version"));
+  }
+  if read_u32(reader)? != RECORD_SIZE {
+    return Err(invalid("unexpected flight recorder record size"));
+  }
+
+  let qpc_frequency = read_u64(reader)?;
+  let count = read_u64(reader)? as usize;
+  let mut events = Vec::with_capacity(count.min(CAPACITY));
+  for _ in 0..count {
+    let sequence = read_u64(reader)?;
+    let timestamp = read_u64(reader)?;
+    let kind = read_u32(reader)?;
+    let index = read_u32(reader)?;
+    let device = read_u64(reader)?;
+    let data = read_u64(reader)?;
+    events.push(Event {
+      sequence,
+      timestamp,
+      kind: EventKind::from_u16(kind as u16),
+      index,
+      device,
+      data,
+    });
+  }
+
+  Ok(Dump { qpc_frequency, events })
+}
+
+/// Recorded device code, formatted like the DeviceId it came from.
+pub struct DeviceCode(pub u64);
+
+impl fmt::Display for DeviceCode {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    if self.0 & XINPUT_DEVICE_FLAG != 0 {
+      write!(f, "XInput({})", self.0 & !XINPUT_DEVICE_FLAG)
+    } else {
+      write!(f, "RawInput({:#x})", self.0)
+    }
+  }
+}
+
+impl fmt::Display for Event {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    let device = DeviceCode(self.device);
+    match self.kind {
+      Some(EventKind::DeviceArrived) => write!(f, "arrived   {}", device),
+      Some(EventKind::DeviceRemoved) => write!(f, "removed   {}", device),
+      Some(EventKind::Bound) => write!(f, "bound     P{} -> {}", self.index + 1, device),
+      Some(EventKind::Unbound) => write!(f, "unbound   P{} -x {}", self.index + 1, device),
+      Some(EventKind::Report) => {
+        write!(f, "report    {} x{} [", device, self.index)?;
+        for (i, byte) in self.data.to_le_bytes().iter().enumerate() {
+          let separator = if i == 0 { "" } else { " " };
+          write!(f, "{}{:02x}", separator, byte)?;
+        }
+        write!(f, "]")
+      }
+      Some(EventKind::Poll) => write!(f, "poll      P{}", self.index + 1),
+      Some(EventKind::XInputPoll) => write!(f, "xpoll     P{}", self.index + 1),
+      None => write!(
+        f,
+        "unknown   index {} device {:#x} data {:#x}",
+        self.index, self.device, self.data
+      ),
+    }
+  }
+}
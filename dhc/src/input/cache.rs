@@ -0,0 +1,182 @@
+//! On-disk cache of what we learned about devices the last time we opened them.
+//!
+//! Opening a device means reading its strings and preparsed data from the driver, and compiling a
+//! report plan through hid.dll, which can take a while for Bluetooth devices. Devices whose
+//! reports can be decoded without hid.dll are remembered here by path and VID/PID, so that the
+//! next time they show up they can be bound without talking to the driver at all.
+//! Nothing in here depends on Windows.
+
+use std::io;
+use std::path::{Path, PathBuf};
+
+use serde::{Deserialize, Serialize};
+
+use crate::input::report::{button_target, ReportPlan, ValueField, ValueTarget};
+use crate::input::DeviceType;
+
+/// Bumped whenever the meaning of anything in the cache changes, which invalidates old caches.
+const CACHE_VERSION: u32 = 1;
+
+/// Everything needed to bind a device without opening it.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub(crate) struct CachedDevice {
+  pub path: String,
+  pub vendor_id: u16,
+  pub product_id: u16,
+  pub name: String,
+  pub device_type: DeviceType,
+
+  /// Size of the device's input reports, including the report ID.
+  pub report_len: usize,
+
+  /// Only missing for XInput devices, which are read through XInput instead.
+  pub plan: Option<CachedPlan>,
+}
+
+/// ReportPlan in a form that can be written out. Fields are identified by their usage, and get
+/// mapped to their targets again when they're read back in.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct CachedPlan {
+  report_id: u8,
+
+  /// Bit offset and usage of each button.
+  buttons: Vec<(u32, u16)>,
+
+  values: Vec<CachedValue>,
+}
+
+#[derive(Clone, Debug, Serialize, Deserialize)]
+struct CachedValue {
+  bit_offset: u32,
+  bit_size: u32,
+  logical_min: i32,
+  logical_max: i32,
+  signed: bool,
+  usage: u16,
+}
+
+impl CachedPlan {
+  pub fn new(plan: &ReportPlan) -> CachedPlan {
+    CachedPlan {
+      report_id: plan.report_id(),
+      buttons: plan
+        .buttons()
+        .iter()
+        .map(|button| (button.bit_offset, button.usage))
+        .collect(),
+      values: plan
+        .values()
+        .iter()
+        .map(|value| CachedValue {
+          bit_offset: value.bit_offset,
+          bit_size: value.bit_size,
+          logical_min: value.logical_min,
+          logical_max: value.logical_max,
+          signed: value.signed,
+          usage: value.usage,
+        })
+        .collect(),
+    }
+  }
+
+  /// Rebuild the plan, or return None if the cache refers to usages that we don't handle anymore.
+  pub fn to_plan(&self) -> Option<ReportPlan> {
+    let mut plan = ReportPlan::new(self.report_id);
+    for &(bit_offset, usage) in &self.buttons {
+      plan.add_button(bit_offset, usage, button_target(usage)?);
+    }
+
+    for value in &self.values {
+      plan
+        .add_value(ValueField {
+          bit_offset: value.bit_offset,
+          bit_size: value.bit_size,
+          logical_min: value.logical_min,
+          logical_max: value.logical_max,
+          signed: value.signed,
+          usage: value.usage,
+          target: ValueTarget::from_usage(value.usage)?,
+        })
+        .ok()?;
+    }
+    Some(plan)
+  }
+}
+
+#[derive(Serialize, Deserialize)]
+struct CacheFile {
+  version: u32,
+  device: Vec<CachedDevice>,
+}
+
+pub(crate) struct DeviceCache {
+  path: PathBuf,
+  devices: Vec<CachedDevice>,
+}
+
+impl DeviceCache {
+  /// Load the cache at `path`. A cache that's missing, unreadable or from another version of dhc
+  /// is treated as empty, and gets replaced the next time a device is added.
+  pub fn load<P: AsRef<Path>>(path: P) -> DeviceCache {
+    let path = path.as_ref().to_path_buf();
+    let devices = match std::fs::read_to_string(&path) {
+      Ok(contents) => match toml::from_str::<CacheFile>(&contents) {
+        Ok(file) if file.version == CACHE_VERSION => file.device,
+        Ok(file) => {
+          info!("ignoring device cache from version {}", file.version);
+          Vec::new()
+        }
+        Err(err) => {
+          warn!("failed to parse device cache: {}", err);
+          Vec::new()
+        }
+      },
+      Err(ref err) if err.kind() == io::ErrorKind::NotFound => Vec::new(),
+      Err(err) => {
+        warn!("failed to read device cache: {}", err);
+        Vec::new()
+      }
+    };
+
+    info!("loaded {} devices from {}", devices.len(), path.display());
+    DeviceCache { path, devices }
+  }
+
+  pub fn lookup(&self, path: &str, vendor_id: u16, product_id: u16) -> Option<&CachedDevice> {
+    self
+      .devices
+      .iter()
+      .find(|device| device.path == path && device.vendor_id == vendor_id && device.product_id == product_id)
+  }
+
+  /// Add or replace a device, and write the cache back out.
+  pub fn insert(&mut self, device: CachedDevice) {
+    self.remove(&device.path);
+    self.devices.push(device);
+    if let Err(err) = self.save() {
+      warn!("failed to write device cache: {}", err);
+    }
+  }
+
+  /// Forget a device, if the cache was wrong about it.
+  pub fn remove(&mut self, path: &str) {
+    self.devices.retain(|device| device.path != path);
+  }
+
+  fn save(&self) -> io::Result<()> {
+    let file = CacheFile {
+      version: CACHE_VERSION,
+      device: self.devices.clone(),
+    };
+    let contents = toml::to_string(&file).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+    // Write to a temporary file first, so that a crash or a second game writing at the same time
+    // can't leave a half-written cache behind.
+    let tmp_path = self.path.with_extension(format!("tmp.{}", std::process::id()));
+    std::fs::write(&tmp_path, contents)?;
+    std::fs::rename(&tmp_path, &self.path).map_err(|err| {
+      let _ = std::fs::remove_file(&tmp_path);
+      err
+    })
+  }
+}
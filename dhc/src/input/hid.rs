@@ -2,10 +2,12 @@ use std::ffi::CString;
 use std::fmt::Write;
 use std::io;
 use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
 
 use winapi::shared::hidpi::{
-  HidP_GetCaps, HidP_GetLinkCollectionNodes, HidP_GetUsageValue, HidP_GetUsages, HidP_GetValueCaps,
-  HidP_MaxUsageListLength,
+  HidP_GetButtonCaps, HidP_GetCaps, HidP_GetLinkCollectionNodes, HidP_GetUsageValue, HidP_GetUsages,
+  HidP_GetValueCaps, HidP_InitializeReportForID, HidP_MaxUsageListLength, HidP_SetUsageValue, HidP_SetUsages,
 };
 use winapi::shared::hidpi::{
   HidP_Input, HIDP_STATUS_BAD_LOG_PHY_VALUES, HIDP_STATUS_BUFFER_TOO_SMALL, HIDP_STATUS_BUTTON_NOT_PRESSED,
@@ -15,33 +17,35 @@ use winapi::shared::hidpi::{
   HIDP_STATUS_NOT_IMPLEMENTED, HIDP_STATUS_NOT_VALUE_ARRAY, HIDP_STATUS_NULL, HIDP_STATUS_REPORT_DOES_NOT_EXIST,
   HIDP_STATUS_SUCCESS, HIDP_STATUS_USAGE_NOT_FOUND, HIDP_STATUS_VALUE_OUT_OF_RANGE,
 };
-use winapi::shared::hidpi::{HIDP_CAPS, HIDP_LINK_COLLECTION_NODE, HIDP_VALUE_CAPS, PHIDP_PREPARSED_DATA};
+use winapi::shared::hidpi::{
+  HIDP_BUTTON_CAPS, HIDP_CAPS, HIDP_LINK_COLLECTION_NODE, HIDP_VALUE_CAPS, PHIDP_PREPARSED_DATA,
+};
 use winapi::shared::hidsdi::{
-  HidD_FreePreparsedData, HidD_GetManufacturerString, HidD_GetPreparsedData, HidD_GetProductString,
-  HidD_GetSerialNumberString,
+  HidD_FreePreparsedData, HidD_GetFeature, HidD_GetManufacturerString, HidD_GetPreparsedData, HidD_GetProductString,
+  HidD_GetSerialNumberString, HidD_SetOutputReport,
 };
-use winapi::shared::minwindef::UINT;
+use winapi::shared::minwindef::{DWORD, FALSE, TRUE, UINT};
 use winapi::shared::ntdef::{HANDLE, NTSTATUS};
-use winapi::um::fileapi::{CreateFileA, OPEN_EXISTING};
+use winapi::shared::winerror::{ERROR_IO_PENDING, ERROR_OPERATION_ABORTED};
+use winapi::um::errhandlingapi::GetLastError;
+use winapi::um::fileapi::{CreateFileA, ReadFile, OPEN_EXISTING};
 use winapi::um::handleapi::CloseHandle;
 use winapi::um::handleapi::INVALID_HANDLE_VALUE;
-use winapi::um::winnt::{FILE_SHARE_READ, FILE_SHARE_WRITE};
+use winapi::um::ioapiset::{CancelIoEx, GetOverlappedResult};
+use winapi::um::minwinbase::OVERLAPPED;
+use winapi::um::synchapi::{CreateEventW, WaitForSingleObject};
+use winapi::um::winbase::{FILE_FLAG_OVERLAPPED, INFINITE, WAIT_OBJECT_0};
+use winapi::um::winnt::{FILE_SHARE_READ, FILE_SHARE_WRITE, GENERIC_READ, GENERIC_WRITE};
 use winapi::um::winuser::*;
 
-use crate::input::types::{DeviceInputs, Hat};
-use crate::input::{DeviceDescription, DeviceId, DeviceType, RawInputDeviceId};
-
-const USAGE_PAGE_BUTTON: u16 = 9;
-
-const USAGE_X: u16 = 0x30;
-const USAGE_Y: u16 = 0x31;
-const USAGE_Z: u16 = 0x32;
-
-const USAGE_RX: u16 = 0x33;
-const USAGE_RY: u16 = 0x34;
-const USAGE_RZ: u16 = 0x35;
+use parking_lot::Mutex;
 
-const USAGE_HAT: u16 = 0x39;
+use crate::input::cache::{CachedDevice, CachedPlan, DeviceCache};
+use crate::input::native::{self, Calibration, NativeDevice};
+use crate::input::negotiate::{self, HidTransport};
+use crate::input::report::{button_target, ReportPlan, ValueField, ValueTarget, USAGE_PAGE_BUTTON};
+use crate::input::types::DeviceInputs;
+use crate::input::{DeviceDescription, DeviceId, DeviceType, RawInputDeviceId};
 
 const MAX_BUTTONS: usize = 32;
 
@@ -51,6 +55,9 @@ struct HidPreparsedData {
 
 unsafe impl Send for HidPreparsedData {}
 
+// hid.dll only ever reads preparsed data after it's been created.
+unsafe impl Sync for HidPreparsedData {}
+
 impl Drop for HidPreparsedData {
   fn drop(&mut self) {
     unsafe { HidD_FreePreparsedData(self.raw()) };
@@ -168,6 +175,20 @@ impl HidPreparsedData {
     }
   }
 
+  fn get_button_caps(&self) -> Result<Vec<HIDP_BUTTON_CAPS>, HidPError> {
+    let caps = self.get_caps()?;
+    let mut vec = Vec::with_capacity(caps.NumberInputButtonCaps as usize);
+    unsafe {
+      let mut len = caps.NumberInputButtonCaps;
+      let rc = HidP_GetButtonCaps(HidP_Input, vec.as_mut_ptr(), &mut len, self.raw());
+      let result = hidp_result(rc);
+      result.and(Ok({
+        vec.set_len(len as usize);
+        vec
+      }))
+    }
+  }
+
   #[allow(dead_code)]
   fn get_link_collection_nodes(&self) -> Result<Vec<HIDP_LINK_COLLECTION_NODE>, HidPError> {
     let mut vec = Vec::with_capacity(128);
@@ -222,20 +243,210 @@ impl HidPreparsedData {
 
     hidp_result(rc).and(Ok(result as i32))
   }
+
+  /// Create an input report with every field set to its default value.
+  fn initialize_report(&self, report_id: u8, len: usize) -> Result<Vec<u8>, HidPError> {
+    let mut report = vec![0u8; len];
+    let rc = unsafe {
+      HidP_InitializeReportForID(
+        HidP_Input,
+        report_id,
+        self.raw(),
+        report.as_mut_ptr() as *mut i8,
+        report.len() as u32,
+      )
+    };
+
+    hidp_result(rc).and(Ok(report))
+  }
+
+  fn set_usage(&self, report: &mut [u8], usage_page: u16, usage: u16) -> Result<(), HidPError> {
+    let mut usage = usage;
+    let mut len = 1;
+    let rc = unsafe {
+      HidP_SetUsages(
+        HidP_Input,
+        usage_page,
+        0,
+        &mut usage,
+        &mut len,
+        self.raw(),
+        report.as_mut_ptr() as *mut i8,
+        report.len() as u32,
+      )
+    };
+
+    hidp_result(rc)
+  }
+
+  fn set_usage_value(&self, report: &mut [u8], usage_page: u16, usage: u16, value: u32) -> Result<(), HidPError> {
+    let rc = unsafe {
+      HidP_SetUsageValue(
+        HidP_Input,
+        usage_page,
+        0,
+        usage,
+        value,
+        self.raw(),
+        report.as_mut_ptr() as *mut i8,
+        report.len() as u32,
+      )
+    };
+
+    hidp_result(rc)
+  }
 }
 
-fn unlerp(x: i32, min: i32, max: i32) -> f32 {
-  ((x - min) as f32) / ((max - min) as f32)
+/// Bit offsets at which two reports differ.
+fn changed_bits(a: &[u8], b: &[u8]) -> Vec<u32> {
+  let mut result = Vec::new();
+  for (idx, (x, y)) in a.iter().zip(b.iter()).enumerate() {
+    let diff = x ^ y;
+    for bit in 0..8 {
+      if diff & (1 << bit) != 0 {
+        result.push((idx * 8 + bit) as u32);
+      }
+    }
+  }
+  result
+}
+
+/// IDs of every input report that the device describes, in order.
+fn input_report_ids(button_caps: &[HIDP_BUTTON_CAPS], value_caps: &[HIDP_VALUE_CAPS]) -> Vec<u8> {
+  let mut report_ids: Vec<u8> = button_caps
+    .iter()
+    .map(|cap| cap.ReportID)
+    .chain(value_caps.iter().map(|cap| cap.ReportID))
+    .collect();
+  report_ids.sort_unstable();
+  report_ids.dedup();
+  report_ids
+}
+
+/// Work out where each field lives in the input report, by having hid.dll write it into an empty
+/// report and seeing which bits change.
+///
+/// Returns None if the device's reports can't be described by a single ReportPlan, in which case
+/// the caller needs to keep going through hid.dll.
+fn calibrate_report_plan(
+  hid: &HidPreparsedData,
+  value_caps: &[HIDP_VALUE_CAPS],
+) -> Result<Option<ReportPlan>, HidPError> {
+  let caps = hid.get_caps()?;
+  let button_caps = hid.get_button_caps()?;
+
+  let report_ids = input_report_ids(&button_caps, value_caps);
+  if report_ids.len() > 1 {
+    info!("device has multiple input reports ({:?}), not compiling a report plan", report_ids);
+    return Ok(None);
+  }
+
+  let report_id = report_ids.first().copied().unwrap_or(0);
+  let blank = hid.initialize_report(report_id, caps.InputReportByteLength as usize)?;
+  let mut plan = ReportPlan::new(report_id);
+
+  for button_cap in button_caps.iter().filter(|cap| cap.UsagePage == USAGE_PAGE_BUTTON) {
+    let (usage_min, usage_max) = if button_cap.IsRange != 0 {
+      let range = unsafe { button_cap.u.Range() };
+      (range.UsageMin, range.UsageMax)
+    } else {
+      let usage = unsafe { button_cap.u.NotRange().Usage };
+      (usage, usage)
+    };
+
+    for usage in usage_min..=usage_max {
+      let target = match button_target(usage) {
+        Some(target) => target,
+        None => continue,
+      };
+
+      let mut report = blank.clone();
+      hid.set_usage(&mut report, USAGE_PAGE_BUTTON, usage)?;
+      match changed_bits(&blank, &report).as_slice() {
+        [bit] => plan.add_button(*bit, usage, target),
+        bits => {
+          info!("button {} occupies bits {:?}, not compiling a report plan", usage, bits);
+          return Ok(None);
+        }
+      }
+    }
+  }
+
+  for value_cap in value_caps {
+    let usage = unsafe { value_cap.u.NotRange().Usage };
+    let target = match ValueTarget::from_usage(usage) {
+      Some(target) => target,
+      None => continue,
+    };
+
+    let bit_size = u32::from(value_cap.BitSize);
+    if value_cap.ReportCount != 1 || bit_size == 0 || bit_size > 32 {
+      info!(
+        "usage {:#x} has {} fields of {} bits, not compiling a report plan",
+        usage, value_cap.ReportCount, bit_size
+      );
+      return Ok(None);
+    }
+
+    let mask = if bit_size == 32 { !0 } else { (1 << bit_size) - 1 };
+    let mut low = blank.clone();
+    let mut high = blank.clone();
+    hid.set_usage_value(&mut low, value_cap.UsagePage, usage, 0)?;
+    hid.set_usage_value(&mut high, value_cap.UsagePage, usage, mask)?;
+
+    let bits = changed_bits(&low, &high);
+    let contiguous = bits.windows(2).all(|pair| pair[1] == pair[0] + 1);
+    if bits.len() != bit_size as usize || !contiguous {
+      info!("usage {:#x} occupies bits {:?}, not compiling a report plan", usage, bits);
+      return Ok(None);
+    }
+
+    let field = ValueField {
+      bit_offset: bits[0],
+      bit_size,
+      logical_min: value_cap.LogicalMin,
+      logical_max: value_cap.LogicalMax,
+      signed: value_cap.LogicalMin < 0,
+      usage,
+      target,
+    };
+    if let Err(err) = plan.add_value(field) {
+      info!("{}, not compiling a report plan", err);
+      return Ok(None);
+    }
+  }
+
+  Ok(Some(plan))
 }
 
 pub struct HidParser {
-  hid: HidPreparsedData,
+  /// Missing for devices that were bound from the device cache, which don't need hid.dll.
+  hid: Option<HidPreparsedData>,
   device_type: DeviceType,
   value_caps: Vec<HIDP_VALUE_CAPS>,
+
+  /// Size of the device's input reports, including the report ID.
+  report_len: usize,
+
+  /// Compiled layout of the device's input report, if we managed to figure it out.
+  plan: Option<ReportPlan>,
+
+  /// Fixed-offset parser for devices that we know about.
+  native: Option<&'static NativeDevice>,
+
+  /// What the native parser needs to know about this particular device, read while negotiating.
+  calibration: Calibration,
+
+  /// IDs of the input reports that the device describes. Empty for parsers rebuilt from the
+  /// device cache, which only know about the reports that they can decode.
+  report_ids: Vec<u8>,
+
+  /// Whether we've already complained about a report that a cached parser can't decode.
+  warned_unknown_report: AtomicBool,
 }
 
 impl HidParser {
-  fn new(hid: HidPreparsedData) -> Result<HidParser, HidPError> {
+  fn new(hid: HidPreparsedData, vendor_id: u16, product_id: u16) -> Result<HidParser, HidPError> {
     let mut device_type = DeviceType::Generic;
 
     if hid.get_button_count() == 14 {
@@ -244,6 +455,7 @@ impl HidParser {
       device_type = DeviceType::PS3;
     }
 
+    let report_len = hid.get_caps()?.InputReportByteLength as usize;
     let value_caps = hid.get_value_caps()?;
     for (idx, value_cap) in value_caps.iter().enumerate() {
       debug!("Value cap {}:", idx);
@@ -263,23 +475,139 @@ impl HidParser {
       }
     }
 
+    let plan = match calibrate_report_plan(&hid, &value_caps) {
+      Ok(plan) => plan,
+      Err(err) => {
+        warn!("failed to compile report plan: {:?}", err);
+        None
+      }
+    };
+
+    if let Some(ref plan) = plan {
+      info!(
+        "compiled report plan for report {}: {} buttons, {} values",
+        plan.report_id(),
+        plan.buttons().len(),
+        plan.values().len()
+      );
+    }
+
+    let native = native::lookup(vendor_id, product_id);
+    if let Some(native) = native {
+      info!("using native parser for {}", native.name);
+    }
+
+    let report_ids = input_report_ids(&hid.get_button_caps()?, &value_caps);
+
     Ok(HidParser {
-      hid,
+      hid: Some(hid),
       device_type,
       value_caps,
+      report_len,
+      plan,
+      native,
+      report_ids,
+      calibration: Calibration::default(),
+      warned_unknown_report: AtomicBool::new(false),
+    })
+  }
+
+  /// Rebuild the parser of a device that we've opened before. Only devices that never need to go
+  /// through hid.dll can be rebuilt, which is checked by `is_cacheable`.
+  fn from_cache(cached: &CachedDevice) -> Option<HidParser> {
+    let plan = match cached.device_type {
+      DeviceType::XInput => None,
+      _ => Some(cached.plan.as_ref()?.to_plan()?),
+    };
+
+    Some(HidParser {
+      hid: None,
+      device_type: cached.device_type,
+      value_caps: Vec::new(),
+      report_len: cached.report_len,
+      plan,
+      native: native::lookup(cached.vendor_id, cached.product_id),
+      report_ids: Vec::new(),
+      calibration: Calibration::default(),
+      warned_unknown_report: AtomicBool::new(false),
+    })
+  }
+
+  /// Whether the parser can be rebuilt from the device cache. XInput devices are never parsed,
+  /// and anything else needs every one of its input reports to be covered by the plan or the
+  /// native parser, since a rebuilt parser has to drop the rest.
+  fn is_cacheable(&self) -> bool {
+    if self.device_type == DeviceType::XInput {
+      return true;
+    }
+
+    let plan = match self.plan {
+      Some(ref plan) => plan,
+      None => return false,
+    };
+    let native_reports = self.native.map(|native| native.layouts()).unwrap_or(&[]);
+    self.report_ids.iter().all(|&report_id| {
+      report_id == plan.report_id() || native_reports.iter().any(|layout| layout.report_id == report_id)
     })
   }
 
   fn new_xinput(hid: HidPreparsedData) -> Result<HidParser, HidPError> {
+    let report_len = hid.get_caps()?.InputReportByteLength as usize;
     let value_caps = hid.get_value_caps()?;
     Ok(HidParser {
-      hid,
+      hid: Some(hid),
       device_type: DeviceType::XInput,
       value_caps,
+      report_len,
+      plan: None,
+      native: None,
+      report_ids: Vec::new(),
+      calibration: Calibration::default(),
+      warned_unknown_report: AtomicBool::new(false),
     })
   }
 
+  /// Masks of the bits that parse looks at, for each report ID that it has a fast path for.
+  ///
+  /// Masks that share a report ID are ordered from longest to shortest, and the first one that
+  /// fits a report applies to it.
+  pub fn relevance_masks(&self) -> Vec<(u8, Vec<u8>)> {
+    let mut result = Vec::new();
+    if let Some(native) = self.native {
+      for layout in native.layouts() {
+        result.push((layout.report_id, layout.relevance_mask()));
+      }
+    }
+    if let Some(plan) = &self.plan {
+      result.push((plan.report_id(), plan.relevance_mask()));
+    }
+    result
+  }
+
+  pub fn report_len(&self) -> usize {
+    self.report_len
+  }
+
   pub fn parse(&self, data: &[u8]) -> Result<DeviceInputs, HidPError> {
+    trace_span!("HidParser::parse");
+    // Reports that neither the native parser nor the plan know about still go through hid.dll.
+    if let Some(inputs) = self.native.and_then(|native| native.parse(data, &self.calibration)) {
+      return Ok(inputs);
+    }
+
+    if let Some(inputs) = self.plan.as_ref().and_then(|plan| plan.decode(data)) {
+      return Ok(inputs);
+    }
+
+    // Parsers rebuilt from the device cache have no hid.dll to fall back on, so reports that the
+    // plan doesn't cover get dropped. Complain about the first one, not about every report.
+    if self.hid.is_none() {
+      if !self.warned_unknown_report.swap(true, Ordering::Relaxed) {
+        warn!("dropping report {:?} that the cached report plan doesn't cover", data.first());
+      }
+      return Err(HidPError::ReportDoesNotExist);
+    }
+
     match self.device_type {
       DeviceType::PS4 => self.parse_ps4(data),
 
@@ -300,61 +628,21 @@ impl HidParser {
   }
 
   pub fn parse_ps4(&self, data: &[u8]) -> Result<DeviceInputs, HidPError> {
+    let hid = self.hid.as_ref().ok_or(HidPError::InvalidPreparsedData)?;
     let mut result = DeviceInputs::default();
 
-    let buttons = self.hid.get_buttons(data)?;
-    for button in &buttons {
-      match button {
-        0 => break,
-        1 => result.button_west.set(),
-        2 => result.button_south.set(),
-        3 => result.button_east.set(),
-        4 => result.button_north.set(),
-        5 => result.button_l1.set(),
-        6 => result.button_r1.set(),
-        7 => result.button_l2.set(),
-        8 => result.button_r2.set(),
-        9 => result.button_select.set(),
-        10 => result.button_start.set(),
-        11 => result.button_l3.set(),
-        12 => result.button_r3.set(),
-        13 => result.button_home.set(),
-        14 => result.button_trackpad.set(),
-        _ => {}
+    let buttons = hid.get_buttons(data)?;
+    for &button in buttons.iter().take_while(|&&button| button != 0) {
+      if let Some(target) = button_target(button) {
+        result.button_mut(target).set();
       }
     }
 
     for value_cap in &self.value_caps {
-      let logical_min = value_cap.LogicalMin;
-      let logical_max = value_cap.LogicalMax;
-
       let usage = unsafe { value_cap.u.NotRange().Usage };
-      let value = self.hid.get_usage_value(data, value_cap.UsagePage, usage)?;
-
-      let unlerped = unlerp(value, logical_min, logical_max);
-      match usage {
-        USAGE_X => result.axis_left_stick_x.set_value(unlerped),
-        USAGE_Y => result.axis_left_stick_y.set_value(unlerped),
-        USAGE_Z => result.axis_right_stick_x.set_value(unlerped),
-        USAGE_RZ => result.axis_left_stick_y.set_value(unlerped),
-        USAGE_RX => result.axis_left_trigger.set_value(unlerped),
-        USAGE_RY => result.axis_right_trigger.set_value(unlerped),
-        USAGE_HAT => {
-          let direction = match value {
-            0 => Hat::North,
-            1 => Hat::NorthEast,
-            2 => Hat::East,
-            3 => Hat::SouthEast,
-            4 => Hat::South,
-            5 => Hat::SouthWest,
-            6 => Hat::West,
-            7 => Hat::NorthWest,
-            _ => Hat::Neutral,
-          };
-          result.hat_dpad = direction;
-        }
-
-        _ => continue,
+      let value = hid.get_usage_value(data, value_cap.UsagePage, usage)?;
+      if let Some(target) = ValueTarget::from_usage(usage) {
+        target.apply(&mut result, value, value_cap.LogicalMin, value_cap.LogicalMax);
       }
     }
 
@@ -460,15 +748,15 @@ fn hid_get_serial_number(handle: HANDLE) -> Option<String> {
   }
 }
 
-fn open_rawinput_hid_device(path: CString) -> io::Result<HANDLE> {
+fn open_rawinput_hid_device(path: &CString, access: DWORD, flags: DWORD) -> io::Result<HANDLE> {
   let hid_file = unsafe {
     CreateFileA(
       path.as_ptr(),
-      0,
+      access,
       FILE_SHARE_READ | FILE_SHARE_WRITE,
       std::ptr::null_mut(),
       OPEN_EXISTING,
-      0,
+      flags,
       std::ptr::null_mut(),
     )
   };
@@ -483,6 +771,116 @@ fn open_rawinput_hid_device(path: CString) -> io::Result<HANDLE> {
   }
 }
 
+/// Read/write handle to a HID device, for devices that we need to talk to. It's opened for
+/// overlapped I/O, so that reads can time out.
+pub(crate) struct HidHandle {
+  handle: HANDLE,
+  input_report_len: usize,
+}
+
+unsafe impl Send for HidHandle {}
+
+impl Drop for HidHandle {
+  fn drop(&mut self) {
+    unsafe { CloseHandle(self.handle) };
+  }
+}
+
+impl HidTransport for HidHandle {
+  fn input_report_len(&self) -> usize {
+    self.input_report_len
+  }
+
+  fn get_feature(&mut self, buf: &mut [u8]) -> io::Result<()> {
+    let result = unsafe { HidD_GetFeature(self.handle, buf.as_mut_ptr() as *mut _, buf.len() as u32) };
+    if result == 0 {
+      Err(std::io::Error::last_os_error())
+    } else {
+      Ok(())
+    }
+  }
+
+  fn set_output_report(&mut self, data: &[u8]) -> io::Result<()> {
+    let result = unsafe { HidD_SetOutputReport(self.handle, data.as_ptr() as *mut _, data.len() as u32) };
+    if result == 0 {
+      Err(std::io::Error::last_os_error())
+    } else {
+      Ok(())
+    }
+  }
+
+  fn read_input_report(&mut self, buf: &mut [u8], timeout: Duration) -> io::Result<usize> {
+    let event = unsafe { CreateEventW(std::ptr::null_mut(), TRUE, FALSE, std::ptr::null()) };
+    if event.is_null() {
+      return Err(std::io::Error::last_os_error());
+    }
+
+    let mut overlapped: OVERLAPPED = unsafe { std::mem::zeroed() };
+    overlapped.hEvent = event;
+    let mut read = 0;
+    let mut result = unsafe {
+      ReadFile(
+        self.handle,
+        buf.as_mut_ptr() as *mut _,
+        buf.len() as DWORD,
+        &mut read,
+        &mut overlapped,
+      )
+    };
+    if result == 0 && unsafe { GetLastError() } == ERROR_IO_PENDING {
+      let timeout_ms = timeout.as_millis().min(u128::from(INFINITE - 1)) as DWORD;
+      if unsafe { WaitForSingleObject(event, timeout_ms) } != WAIT_OBJECT_0 {
+        unsafe { CancelIoEx(self.handle, &mut overlapped) };
+      }
+      // The read has to be finished one way or another before `overlapped` goes away.
+      result = unsafe { GetOverlappedResult(self.handle, &mut overlapped, &mut read, TRUE) };
+    }
+
+    let err = std::io::Error::last_os_error();
+    unsafe { CloseHandle(event) };
+    if result != 0 {
+      Ok(read as usize)
+    } else if err.raw_os_error() == Some(ERROR_OPERATION_ABORTED as i32) {
+      Ok(0)
+    } else {
+      Err(err)
+    }
+  }
+}
+
+/// Switch a device over to the reports that its native parser wants, if it needs it, and read its
+/// calibration. Returns the handle that was used, which is kept open for as long as the device is
+/// around.
+fn negotiate_reports(
+  path: &CString,
+  native: &NativeDevice,
+  input_report_len: usize,
+) -> Option<(HidHandle, Calibration)> {
+  let negotiation = native.negotiation?;
+  let handle = open_rawinput_hid_device(path, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED).ok()?;
+  let mut transport = HidHandle {
+    handle,
+    input_report_len,
+  };
+
+  match negotiate::negotiate(negotiation, &mut transport) {
+    Ok(true) => {
+      info!("switched {} to full reports", native.name);
+      let calibration = negotiate::read_calibration(negotiation, &mut transport).unwrap_or_else(|err| {
+        warn!("failed to read calibration of {}: {}", native.name, err);
+        Calibration::default()
+      });
+      debug!("{} calibration: {:?}", native.name, calibration);
+      Some((transport, calibration))
+    }
+    Ok(false) => None,
+    Err(err) => {
+      warn!("failed to switch {} to full reports: {}", native.name, err);
+      None
+    }
+  }
+}
+
 fn get_rawinput_device_name(hid_file: HANDLE) -> String {
   let vendor_name = hid_get_manufacturer_string(hid_file);
   let product_name = hid_get_product_string(hid_file);
@@ -524,34 +922,100 @@ fn is_xinput_device_path(path: &CString) -> bool {
   twoway::find_bytes(path.as_bytes(), b"&IG_").is_some()
 }
 
+/// Everything we need to know about a newly opened device.
+pub(crate) struct OpenedDevice {
+  pub parser: HidParser,
+  pub device_type: DeviceType,
+  pub description: DeviceDescription,
+  pub path: CString,
+
+  /// Handle that we talked to the device through while opening it, if any.
+  pub handle: Option<HidHandle>,
+}
+
 pub(crate) fn open_rawinput_device(
   device_id: RawInputDeviceId,
-) -> io::Result<(HidParser, DeviceType, DeviceDescription)> {
+  cache: Option<&Mutex<DeviceCache>>,
+) -> io::Result<OpenedDevice> {
   let info = get_rawinput_device_info(device_id);
+  assert_eq!(RIM_TYPEHID, info.dwType);
+  let hid_info = unsafe { info.u.hid() };
+  let vendor_id = hid_info.dwVendorId as u16;
+  let product_id = hid_info.dwProductId as u16;
 
   let hid_path = get_rawinput_device_path(device_id);
+  let path_str = hid_path.to_string_lossy().into_owned();
+
+  if let Some(cache) = cache {
+    // Don't hold the cache while the device is being opened: negotiation can take a while, and
+    // other devices are being opened on other threads.
+    let cached = cache.lock().lookup(&path_str, vendor_id, product_id).cloned();
+    if let Some(cached) = cached {
+      match HidParser::from_cache(&cached) {
+        Some(hid_parser) => {
+          info!("{:?}: using cached description of {}", device_id, cached.name);
+          return Ok(finish_open(device_id, hid_parser, cached.name, hid_path));
+        }
+        None => {
+          warn!("{:?}: ignoring unusable cache entry for {}", device_id, path_str);
+          cache.lock().remove(&path_str);
+        }
+      }
+    }
+  }
+
   let is_xinput = is_xinput_device_path(&hid_path);
-  let hid_file = open_rawinput_hid_device(hid_path)?;
+  let hid_file = open_rawinput_hid_device(&hid_path, 0, 0)?;
   let device_name = get_rawinput_device_name(hid_file);
-  let preparsed_data = hid_get_preparsed_data(hid_file)?;
+  let preparsed_data = hid_get_preparsed_data(hid_file);
   unsafe { CloseHandle(hid_file) };
 
-  assert_eq!(RIM_TYPEHID, info.dwType);
-
   let hid_parser = if is_xinput {
-    HidParser::new_xinput(preparsed_data)
+    HidParser::new_xinput(preparsed_data?)
   } else {
-    HidParser::new(preparsed_data)
+    HidParser::new(preparsed_data?, vendor_id, product_id)
   }?;
 
-  let device_type = hid_parser.device_type;
+  if let Some(cache) = cache {
+    if hid_parser.is_cacheable() {
+      cache.lock().insert(CachedDevice {
+        path: path_str,
+        vendor_id,
+        product_id,
+        name: device_name.clone(),
+        device_type: hid_parser.device_type,
+        report_len: hid_parser.report_len(),
+        plan: hid_parser.plan.as_ref().map(CachedPlan::new),
+      });
+    }
+  }
 
-  Ok((
-    hid_parser,
+  Ok(finish_open(device_id, hid_parser, device_name, hid_path))
+}
+
+fn finish_open(
+  device_id: RawInputDeviceId,
+  mut hid_parser: HidParser,
+  device_name: String,
+  path: CString,
+) -> OpenedDevice {
+  let device_type = hid_parser.device_type;
+  let negotiated = hid_parser
+    .native
+    .and_then(|native| negotiate_reports(&path, native, hid_parser.report_len()));
+  let handle = negotiated.map(|(handle, calibration)| {
+    hid_parser.calibration = calibration;
+    handle
+  });
+
+  OpenedDevice {
+    parser: hid_parser,
     device_type,
-    DeviceDescription {
+    description: DeviceDescription {
       device_id: DeviceId::RawInput(device_id),
       device_name,
     },
-  ))
+    path,
+    handle,
+  }
 }
@@ -0,0 +1,304 @@
+//! Input backend that reads HID reports straight from the device with overlapped I/O.
+//!
+//! Each device keeps a ReadFile in flight at all times, and its completions are picked up by a
+//! small pool of worker threads waiting on an I/O completion port. This takes the window message
+//! queue out of the path of every report, and a slow device arrival on the message loop thread no
+//! longer holds up input from other devices. Raw input is still used to find out when devices
+//! come and go.
+
+use std::cell::UnsafeCell;
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::io;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+use parking_lot::Mutex;
+
+use winapi::shared::minwindef::DWORD;
+use winapi::shared::ntdef::HANDLE;
+use winapi::shared::winerror::ERROR_IO_PENDING;
+use winapi::um::errhandlingapi::GetLastError;
+use winapi::um::fileapi::{CreateFileA, ReadFile, OPEN_EXISTING};
+use winapi::um::handleapi::{CloseHandle, INVALID_HANDLE_VALUE};
+use winapi::um::ioapiset::{CancelIoEx, CreateIoCompletionPort, GetQueuedCompletionStatus, PostQueuedCompletionStatus};
+use winapi::um::minwinbase::OVERLAPPED;
+use winapi::um::processthreadsapi::{GetCurrentThread, SetThreadPriority};
+use winapi::um::winbase::{FILE_FLAG_OVERLAPPED, INFINITE, THREAD_PRIORITY_HIGHEST};
+use winapi::um::winnt::{FILE_SHARE_READ, FILE_SHARE_WRITE, GENERIC_READ};
+
+use crate::input::{RawInputDeviceId, RawInputDeviceState};
+
+/// Number of threads servicing the completion port.
+const WORKER_COUNT: usize = 2;
+
+/// Completion key of the packets that tell workers to exit. Devices are associated with key 0.
+const QUIT_KEY: usize = 1;
+
+/// Whatever the reports read from a device get handed to.
+pub(crate) trait ReportHandler: Send + 'static {
+  /// Handle a run of back-to-back reports of `size` bytes each.
+  fn handle_reports(&mut self, reports: &[u8], size: usize);
+}
+
+impl ReportHandler for RawInputDeviceState {
+  fn handle_reports(&mut self, reports: &[u8], size: usize) {
+    RawInputDeviceState::handle_reports(self, reports, size);
+  }
+}
+
+/// A device with a read in flight.
+///
+/// Every outstanding read owns a strong reference to the device, which is leaked when the read is
+/// issued and reclaimed from the OVERLAPPED pointer when it completes.
+#[repr(C)]
+struct IocpDevice<H> {
+  /// Must be the first field, so that completions can be turned back into the device.
+  overlapped: UnsafeCell<OVERLAPPED>,
+
+  /// Only touched by whoever owns the outstanding read.
+  buffer: UnsafeCell<Vec<u8>>,
+
+  handle: OwnedHandle,
+  device_id: RawInputDeviceId,
+  report_len: usize,
+  closing: AtomicBool,
+  state: Mutex<H>,
+}
+
+// The OVERLAPPED and the buffer are only ever accessed by one thread at a time: the one that
+// issues a read, and then the one that picks up its completion.
+unsafe impl<H: Send> Send for IocpDevice<H> {}
+unsafe impl<H: Send> Sync for IocpDevice<H> {}
+
+struct OwnedHandle(HANDLE);
+
+impl Drop for OwnedHandle {
+  fn drop(&mut self) {
+    unsafe { CloseHandle(self.0) };
+  }
+}
+
+impl<H> IocpDevice<H> {
+  /// Issue the next read. Returns false if the device can't be read from anymore.
+  fn start_read(device: Arc<IocpDevice<H>>) -> bool {
+    if device.closing.load(Ordering::SeqCst) {
+      return false;
+    }
+
+    // The read's own reference can go away on a worker as soon as the read is issued.
+    let ptr = Arc::into_raw(Arc::clone(&device));
+    let rc = unsafe {
+      *device.overlapped.get() = std::mem::zeroed();
+      let buffer = &mut *device.buffer.get();
+      ReadFile(
+        device.handle.0,
+        buffer.as_mut_ptr() as *mut _,
+        buffer.len() as DWORD,
+        std::ptr::null_mut(),
+        device.overlapped.get(),
+      )
+    };
+
+    // Reads that complete immediately still queue a completion packet.
+    if rc == 0 && unsafe { GetLastError() } != ERROR_IO_PENDING {
+      warn!(
+        "{:?}: ReadFile failed: {}",
+        device.device_id,
+        io::Error::last_os_error()
+      );
+      drop(unsafe { Arc::from_raw(ptr) });
+      return false;
+    }
+
+    // remove sets `closing` before cancelling, so if it raced with us and cancelled before the
+    // read was issued, we're guaranteed to see it here, and cancel the read ourselves.
+    if device.closing.load(Ordering::SeqCst) {
+      unsafe { CancelIoEx(device.handle.0, std::ptr::null_mut()) };
+    }
+    true
+  }
+}
+
+struct CompletionPort(HANDLE);
+
+unsafe impl Send for CompletionPort {}
+unsafe impl Sync for CompletionPort {}
+
+impl Drop for CompletionPort {
+  fn drop(&mut self) {
+    unsafe { CloseHandle(self.0) };
+  }
+}
+
+fn run_worker<H: ReportHandler>(port: Arc<CompletionPort>) {
+  unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST as i32) };
+
+  loop {
+    let mut bytes = 0;
+    let mut key = 0;
+    let mut overlapped = std::ptr::null_mut();
+    let rc = unsafe { GetQueuedCompletionStatus(port.0, &mut bytes, &mut key, &mut overlapped, INFINITE) };
+    if overlapped.is_null() {
+      if rc != 0 && key == QUIT_KEY {
+        return;
+      }
+
+      // Nothing was dequeued, so there's no device to deal with, but the port is still usable.
+      error!("GetQueuedCompletionStatus failed: {}", io::Error::last_os_error());
+      continue;
+    }
+
+    let device = unsafe { Arc::from_raw(overlapped as *const IocpDevice<H>) };
+    if rc == 0 {
+      // Reads fail when the device goes away or when we cancel them, and either way the device
+      // is done: its removal shows up through raw input.
+      if !device.closing.load(Ordering::Acquire) {
+        info!(
+          "{:?}: read failed: {}",
+          device.device_id,
+          io::Error::last_os_error()
+        );
+      }
+      continue;
+    }
+
+    {
+      let buffer = unsafe { &*device.buffer.get() };
+      let mut state = device.state.lock();
+      state.handle_reports(&buffer[..bytes as usize], device.report_len);
+    }
+
+    IocpDevice::start_read(device);
+  }
+}
+
+/// Owner of the completion port and every device that's read through it.
+pub(crate) struct IocpBackend<H: ReportHandler = RawInputDeviceState> {
+  port: Arc<CompletionPort>,
+  devices: HashMap<RawInputDeviceId, Arc<IocpDevice<H>>>,
+}
+
+impl<H: ReportHandler> IocpBackend<H> {
+  pub fn new() -> io::Result<IocpBackend<H>> {
+    let port = unsafe { CreateIoCompletionPort(INVALID_HANDLE_VALUE, std::ptr::null_mut(), 0, 0) };
+    if port.is_null() {
+      return Err(io::Error::last_os_error());
+    }
+
+    let port = Arc::new(CompletionPort(port));
+    for i in 0..WORKER_COUNT {
+      let port = Arc::clone(&port);
+      std::thread::Builder::new()
+        .name(format!("dhc iocp worker {}", i))
+        .spawn(move || run_worker::<H>(port))?;
+    }
+
+    info!("started IOCP input backend with {} workers", WORKER_COUNT);
+    Ok(IocpBackend {
+      port,
+      devices: HashMap::new(),
+    })
+  }
+
+  /// Start reading a device. If the device can't be read through the completion port, its state
+  /// is handed back so that it can be read through raw input instead.
+  pub fn add(
+    &mut self,
+    device_id: RawInputDeviceId,
+    path: &CString,
+    report_len: usize,
+    state: H,
+  ) -> Result<(), H> {
+    let handle = unsafe {
+      CreateFileA(
+        path.as_ptr(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        std::ptr::null_mut(),
+        OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED,
+        std::ptr::null_mut(),
+      )
+    };
+    if handle == INVALID_HANDLE_VALUE {
+      warn!("{:?}: failed to open for reading: {}", device_id, io::Error::last_os_error());
+      return Err(state);
+    }
+    self.attach(device_id, OwnedHandle(handle), report_len, state)
+  }
+
+  /// Start reading a handle that was opened with FILE_FLAG_OVERLAPPED.
+  fn attach(&mut self, device_id: RawInputDeviceId, handle: OwnedHandle, report_len: usize, state: H) -> Result<(), H> {
+    let port = unsafe { CreateIoCompletionPort(handle.0, self.port.0, 0, 0) };
+    if port.is_null() {
+      warn!(
+        "{:?}: failed to associate with completion port: {}",
+        device_id,
+        io::Error::last_os_error()
+      );
+      return Err(state);
+    }
+
+    let device = Arc::new(IocpDevice {
+      overlapped: UnsafeCell::new(unsafe { std::mem::zeroed() }),
+      buffer: UnsafeCell::new(vec![0; report_len]),
+      handle,
+      device_id,
+      report_len,
+      closing: AtomicBool::new(false),
+      state: Mutex::new(state),
+    });
+
+    if !IocpDevice::start_read(Arc::clone(&device)) {
+      // The failed read gave its reference back, so this is the only one left.
+      match Arc::try_unwrap(device) {
+        Ok(device) => return Err(device.state.into_inner()),
+        Err(_) => unreachable!(),
+      }
+    }
+
+    self.devices.insert(device_id, device);
+    Ok(())
+  }
+
+  /// Stop reading a device. Returns false if the device wasn't being read through this backend.
+  pub fn remove(&mut self, device_id: RawInputDeviceId) -> bool {
+    match self.devices.remove(&device_id) {
+      Some(device) => {
+        // The outstanding read holds the last reference, and closes the handle when it's aborted.
+        device.closing.store(true, Ordering::SeqCst);
+        unsafe { CancelIoEx(device.handle.0, std::ptr::null_mut()) };
+        true
+      }
+      None => false,
+    }
+  }
+}
+
+impl<H: ReportHandler> Drop for IocpBackend<H> {
+  fn drop(&mut self) {
+    let devices: Vec<_> = self.devices.values().cloned().collect();
+    let device_ids: Vec<_> = self.devices.keys().copied().collect();
+    for device_id in device_ids {
+      self.remove(device_id);
+    }
+
+    // Give the cancelled reads a chance to complete while there are still workers to pick them up,
+    // so that their devices and handles don't leak.
+    for _ in 0..1000 {
+      if devices.iter().all(|device| Arc::strong_count(device) == 1) {
+        break;
+      }
+      std::thread::sleep(Duration::from_millis(1));
+    }
+
+    for _ in 0..WORKER_COUNT {
+      unsafe { PostQueuedCompletionStatus(self.port.0, 0, QUIT_KEY, std::ptr::null_mut()) };
+    }
+  }
+}
+
+#[cfg(test)]
+mod benchmark;
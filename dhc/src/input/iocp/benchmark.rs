@@ -0,0 +1,193 @@
+//! Report latency through the IOCP backend, with simulated devices sending at 1 kHz.
+//!
+//! Run with `cargo test --release -p dhc iocp::benchmark -- --ignored --nocapture`.
+
+use std::ffi::CString;
+use std::io;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+use winapi::shared::minwindef::DWORD;
+use winapi::shared::winerror::ERROR_PIPE_CONNECTED;
+use winapi::um::errhandlingapi::GetLastError;
+use winapi::um::fileapi::{CreateFileA, WriteFile, OPEN_EXISTING};
+use winapi::um::handleapi::INVALID_HANDLE_VALUE;
+use winapi::um::namedpipeapi::{ConnectNamedPipe, CreateNamedPipeA, SetNamedPipeHandleState};
+use winapi::um::processthreadsapi::GetCurrentProcessId;
+use winapi::um::winbase::{
+  FILE_FLAG_OVERLAPPED, PIPE_ACCESS_OUTBOUND, PIPE_READMODE_MESSAGE, PIPE_TYPE_MESSAGE, PIPE_WAIT,
+};
+use winapi::um::winnt::{FILE_SHARE_READ, FILE_SHARE_WRITE, GENERIC_READ};
+
+use super::{IocpBackend, OwnedHandle, ReportHandler};
+use crate::input::RawInputDeviceId;
+
+/// Latency between a report being written and a worker handing it off, across every simulated
+/// device.
+struct IocpBenchmark {
+  sent: u64,
+  received: u64,
+  mean_latency: Duration,
+  max_latency: Duration,
+}
+
+#[derive(Default)]
+struct BenchmarkTotals {
+  received: AtomicU64,
+  total_ticks: AtomicU64,
+  max_ticks: AtomicU64,
+}
+
+/// Records how long ago each report was written, from the timestamp that the writer put in it.
+struct BenchmarkHandler(Arc<BenchmarkTotals>);
+
+impl ReportHandler for BenchmarkHandler {
+  fn handle_reports(&mut self, reports: &[u8], size: usize) {
+    let now = crate::clock::now();
+    for report in reports.chunks_exact(size) {
+      let mut sent = [0u8; 8];
+      sent.copy_from_slice(&report[1..9]);
+      let ticks = now.saturating_sub(u64::from_le_bytes(sent));
+      self.0.received.fetch_add(1, Ordering::Relaxed);
+      self.0.total_ticks.fetch_add(ticks, Ordering::Relaxed);
+      self.0.max_ticks.fetch_max(ticks, Ordering::Relaxed);
+    }
+  }
+}
+
+/// Simulate `device_count` devices that each send a report every millisecond for `duration`, and
+/// measure how long reports take to get through the completion port.
+///
+/// Each device is a message-mode named pipe, so that every ReadFile picks up exactly one report,
+/// like it does on a HID device.
+fn benchmark(device_count: usize, duration: Duration) -> io::Result<IocpBenchmark> {
+  const REPORT_LEN: usize = 64;
+
+  let mut backend = IocpBackend::<BenchmarkHandler>::new()?;
+  let totals = Arc::new(BenchmarkTotals::default());
+  let mut pipes = Vec::new();
+  for i in 0..device_count {
+    let path = CString::new(format!(
+      "\\\\.\\pipe\\dhc-iocp-benchmark-{}-{}",
+      unsafe { GetCurrentProcessId() },
+      i
+    ))
+    .unwrap();
+    let pipe = unsafe {
+      CreateNamedPipeA(
+        path.as_ptr(),
+        PIPE_ACCESS_OUTBOUND,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+        1,
+        (REPORT_LEN * 64) as DWORD,
+        0,
+        0,
+        std::ptr::null_mut(),
+      )
+    };
+    if pipe == INVALID_HANDLE_VALUE {
+      return Err(io::Error::last_os_error());
+    }
+    let pipe = OwnedHandle(pipe);
+
+    // The client end of a pipe starts out in byte mode, whatever mode the pipe was created in.
+    let client = unsafe {
+      CreateFileA(
+        path.as_ptr(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        std::ptr::null_mut(),
+        OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED,
+        std::ptr::null_mut(),
+      )
+    };
+    if client == INVALID_HANDLE_VALUE {
+      return Err(io::Error::last_os_error());
+    }
+    let client = OwnedHandle(client);
+    let mut mode = PIPE_READMODE_MESSAGE;
+    if unsafe { SetNamedPipeHandleState(client.0, &mut mode, std::ptr::null_mut(), std::ptr::null_mut()) } == 0 {
+      return Err(io::Error::last_os_error());
+    }
+
+    let device_id = RawInputDeviceId(i as u64);
+    if backend
+      .attach(device_id, client, REPORT_LEN, BenchmarkHandler(Arc::clone(&totals)))
+      .is_err()
+    {
+      return Err(io::Error::new(io::ErrorKind::Other, "failed to read benchmark pipe"));
+    }
+
+    // The reader has already connected, which is what ERROR_PIPE_CONNECTED means.
+    if unsafe { ConnectNamedPipe(pipe.0, std::ptr::null_mut()) } == 0
+      && unsafe { GetLastError() } != ERROR_PIPE_CONNECTED
+    {
+      return Err(io::Error::last_os_error());
+    }
+    pipes.push(pipe);
+  }
+
+  // Spin instead of sleeping, since Sleep's granularity is far coarser than a millisecond.
+  let interval = crate::clock::frequency() / 1000;
+  let end = crate::clock::now() + crate::clock::frequency() * duration.as_millis() as u64 / 1000;
+  let mut next = crate::clock::now();
+  let mut sent = 0;
+  let mut report = [0u8; REPORT_LEN];
+  report[0] = 0x01;
+  while next < end {
+    while crate::clock::now() < next {
+      std::hint::spin_loop();
+    }
+
+    for pipe in &pipes {
+      report[1..9].copy_from_slice(&crate::clock::now().to_le_bytes());
+      let mut written = 0;
+      let rc = unsafe {
+        WriteFile(
+          pipe.0,
+          report.as_ptr() as *const _,
+          REPORT_LEN as DWORD,
+          &mut written,
+          std::ptr::null_mut(),
+        )
+      };
+      if rc == 0 {
+        return Err(io::Error::last_os_error());
+      }
+      sent += 1;
+    }
+    next += interval;
+  }
+
+  // Let the last reports drain before tearing everything down.
+  std::thread::sleep(Duration::from_millis(100));
+  drop(backend);
+  drop(pipes);
+
+  let received = totals.received.load(Ordering::Relaxed);
+  let to_duration = |ticks: u64| Duration::from_nanos(crate::clock::to_nanos(ticks));
+  Ok(IocpBenchmark {
+    sent,
+    received,
+    mean_latency: to_duration(totals.total_ticks.load(Ordering::Relaxed) / received.max(1)),
+    max_latency: to_duration(totals.max_ticks.load(Ordering::Relaxed)),
+  })
+}
+
+#[test]
+#[ignore]
+fn latency() {
+  for &device_count in &[1, 2, 4, 8] {
+    let result = benchmark(device_count, Duration::from_secs(2)).unwrap();
+    println!(
+      "{} devices: {:>6} of {:>6} reports, {:>6} us mean, {:>6} us max",
+      device_count,
+      result.received,
+      result.sent,
+      result.mean_latency.as_micros(),
+      result.max_latency.as_micros()
+    );
+  }
+}
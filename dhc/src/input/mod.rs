@@ -1,30 +1,69 @@
 use std::collections::{HashMap, VecDeque};
 use std::fmt;
-use std::mem::MaybeUninit;
-use std::sync::atomic::{AtomicUsize, Ordering};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
 use std::sync::mpsc::{channel, Sender};
 use std::sync::Arc;
-
-use parking_lot::Mutex;
+use std::time::Duration;
 
 use winapi::shared::minwindef::{LPARAM, LRESULT, UINT, WPARAM};
 use winapi::shared::ntdef::HANDLE;
 use winapi::shared::windef::HWND;
 use winapi::um::processthreadsapi::{GetCurrentThread, SetThreadPriority};
+use winapi::um::synchapi::SetEvent;
+use winapi::um::sysinfoapi::GetTickCount;
 use winapi::um::winbase::THREAD_PRIORITY_HIGHEST;
 use winapi::um::winuser::*;
 
 use hwndloop::*;
 
-pub(crate) mod types;
+use serde::{Deserialize, Serialize};
+
+use crate::config::InputBackend;
+use crate::metrics::RealDeviceSlot;
+use crate::seqlock::SeqLock;
+
+pub(crate) use dhc_hid::{native, negotiate, report, types};
 use types::*;
 
+mod cache;
+
 mod hid;
 use hid::*;
 
+mod iocp;
+use iocp::IocpBackend;
+
+
+mod probe;
+use probe::{DeviceProber, ProbeResult, WM_PROBE_COMPLETE};
+
+mod mpsc_queue;
+use mpsc_queue::MpscQueue;
+
+mod ring;
+pub(crate) use ring::RingConsumer;
+use ring::RingProducer;
+
 mod xinput;
+use xinput::XInputPoller;
+
+/// Maximum number of buffered input events kept for each device.
+const DEVICE_EVENT_CAPACITY: usize = 1024;
+
+/// Largest report that can be decoded lazily. Devices with bigger reports are always decoded eagerly.
+const MAX_LAZY_REPORT_LEN: usize = 256;
 
-#[derive(Copy, Clone, PartialEq, Debug)]
+/// Number of reports from the biggest device that the raw input arena should be able to hold.
+const RAW_INPUT_BATCH_SIZE: usize = 64;
+
+/// Size of the RAWHID header that precedes the reports in a raw input block.
+const RAWHID_HEADER_SIZE: usize = 8;
+
+/// Number of reports kept for a device while it's being opened. Older ones are dropped.
+const PENDING_REPORT_CAPACITY: usize = 32;
+
+#[derive(Copy, Clone, PartialEq, Debug, Serialize, Deserialize)]
 pub(crate) enum DeviceType {
   PS4,
   PS3,
@@ -32,7 +71,7 @@ pub(crate) enum DeviceType {
   XInput,
 }
 
-#[derive(Debug)]
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
 pub enum RawInputDeviceType {
   Joystick,
   GamePad,
@@ -96,9 +135,316 @@ impl RawInputDeviceType {
   }
 }
 
+/// Event handle that gets signalled by the input thread when a device's inputs change.
+///
+/// Notifications are edge-triggered: after the event has been signalled, it won't be signalled
+/// again until the consumer calls `rearm`, no matter how many reports arrive in the meantime.
+#[derive(Debug)]
+pub struct DeviceNotifier {
+  handle: AtomicUsize,
+  armed: AtomicBool,
+
+  /// Number of reports that the device has sent, whether or not they changed anything.
+  reports: AtomicU64,
+}
+
+impl DeviceNotifier {
+  fn new() -> DeviceNotifier {
+    DeviceNotifier {
+      handle: AtomicUsize::new(0),
+      armed: AtomicBool::new(true),
+      reports: AtomicU64::new(0),
+    }
+  }
+
+  pub fn report_count(&self) -> u64 {
+    self.reports.load(Ordering::Relaxed)
+  }
+
+  fn record_reports(&self, count: u64) {
+    self.reports.fetch_add(count, Ordering::Relaxed);
+  }
+
+  /// Set the event handle to signal, or null to disable notifications.
+  pub fn set_handle(&self, handle: HANDLE) {
+    self.armed.store(true, Ordering::SeqCst);
+    self.handle.store(handle as usize, Ordering::SeqCst);
+  }
+
+  pub fn rearm(&self) {
+    self.armed.store(true, Ordering::Release);
+  }
+
+  fn notify(&self) {
+    let handle = self.handle.load(Ordering::Acquire);
+    if handle != 0 && self.armed.swap(false, Ordering::AcqRel) {
+      unsafe { SetEvent(handle as HANDLE) };
+    }
+  }
+}
+
+/// Inputs of a device along with everything derived from them, rendered once by the input thread.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct PublishedInputs {
+  pub inputs: DeviceInputs,
+  pub xinput: XInputGamepad,
+
+  /// When the report that these came from arrived, as a clock timestamp, or 0 if they didn't.
+  pub received: u64,
+}
+
+impl PublishedInputs {
+  fn new(inputs: DeviceInputs, received: u64) -> PublishedInputs {
+    PublishedInputs {
+      inputs,
+      xinput: inputs.to_xinput(),
+      received,
+    }
+  }
+}
+
+/// Input thread side of a device, which publishes its latest inputs and records every change.
+struct DevicePublisher {
+  buffer: triple_buffer::Input<PublishedInputs>,
+  events: RingProducer<InputEvent>,
+  notifier: Arc<DeviceNotifier>,
+  generation: Arc<AtomicUsize>,
+  last: DeviceInputs,
+  sequence: u32,
+}
+
+/// Consumer side of a device.
+#[derive(Debug)]
+pub struct DeviceSubscriber {
+  pub buffer: triple_buffer::Output<PublishedInputs>,
+  pub events: RingConsumer<InputEvent>,
+  pub notifier: Arc<DeviceNotifier>,
+
+  /// Decoder that needs to be polled before reading `buffer`, for lazily decoded devices.
+  pub decoder: Option<LazyDecoder>,
+}
+
+fn device_channel(generation: &Arc<AtomicUsize>) -> (DevicePublisher, DeviceSubscriber) {
+  let default_inputs = DeviceInputs::default();
+  let (buffer_in, buffer_out) = triple_buffer::TripleBuffer::new(PublishedInputs::new(default_inputs, 0)).split();
+  let (events_in, events_out) = ring::ring(DEVICE_EVENT_CAPACITY);
+  let notifier = Arc::new(DeviceNotifier::new());
+  let publisher = DevicePublisher {
+    buffer: buffer_in,
+    events: events_in,
+    notifier: Arc::clone(&notifier),
+    generation: Arc::clone(generation),
+    last: default_inputs,
+    sequence: 0,
+  };
+  let subscriber = DeviceSubscriber {
+    buffer: buffer_out,
+    events: events_out,
+    notifier,
+    decoder: None,
+  };
+  (publisher, subscriber)
+}
+
+/// Time decoding reports through a compiled report plan and through each native parser, in
+/// nanoseconds per report.
+pub(crate) fn benchmark_decode(iterations: u32) -> Vec<(&'static str, f64)> {
+  let mut result = vec![("report plan", report::benchmark(iterations))];
+  result.extend(native::benchmark(iterations));
+  result
+}
+
+/// Subscriber for a device that doesn't exist, which never publishes anything.
+pub(crate) fn unconnected_subscriber() -> DeviceSubscriber {
+  device_channel(&Arc::new(AtomicUsize::new(0))).1
+}
+
+fn lazy_device_channel(
+  device_id: RawInputDeviceId,
+  generation: &Arc<AtomicUsize>,
+  hid: Arc<HidParser>,
+) -> (RawReportPublisher, DeviceSubscriber) {
+  let (publisher, mut subscriber) = device_channel(generation);
+  let report = Arc::new(SeqLock::new(RawReport {
+    sequence: 0,
+    len: 0,
+    received: 0,
+    data: [0; MAX_LAZY_REPORT_LEN],
+  }));
+  let raw_publisher = RawReportPublisher {
+    report: Arc::clone(&report),
+    sequence: 0,
+    generation: Arc::clone(generation),
+    notifier: Arc::clone(&subscriber.notifier),
+  };
+  subscriber.decoder = Some(LazyDecoder {
+    device_id,
+    report,
+    hid,
+    publisher,
+    last_sequence: 0,
+  });
+  (raw_publisher, subscriber)
+}
+
+impl DevicePublisher {
+  /// Publish the inputs from a report that arrived at `received`.
+  fn publish(&mut self, inputs: DeviceInputs, received: u64) {
+    if self.record(inputs, received) {
+      self.generation.fetch_add(1, Ordering::Release);
+      self.notifier.notify();
+    }
+  }
+
+  /// Record changed inputs without telling anyone about them. Returns whether anything changed.
+  fn record(&mut self, inputs: DeviceInputs, received: u64) -> bool {
+    // Stamp events with when their report arrived, rather than with when they got decoded.
+    let timestamp = crate::clock::to_millis(if received != 0 { received } else { crate::clock::now() });
+    let DevicePublisher {
+      ref mut events,
+      ref mut sequence,
+      ref last,
+      ..
+    } = *self;
+
+    // If nobody is reading buffered data, the ring fills up and we just drop the events.
+    let mut changed = false;
+    inputs.diff(last, |mut event| {
+      event.timestamp = timestamp;
+      event.sequence = *sequence;
+      *sequence = sequence.wrapping_add(1);
+      events.push(event);
+      changed = true;
+    });
+
+    // Reports that don't change anything don't need to be published, which lets dhc_update skip
+    // all of its work until something actually happens.
+    if changed {
+      self.last = inputs;
+      self.buffer.write(PublishedInputs::new(inputs, received));
+    }
+    changed
+  }
+}
+
+/// Newest raw report of a lazily decoded device.
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct RawReport {
+  sequence: u32,
+  len: u32,
+  received: u64,
+  data: [u8; MAX_LAZY_REPORT_LEN],
+}
+
+/// Input thread side of a lazily decoded device, which only stashes the newest report.
+struct RawReportPublisher {
+  report: Arc<SeqLock<RawReport>>,
+  sequence: u32,
+  generation: Arc<AtomicUsize>,
+  notifier: Arc<DeviceNotifier>,
+}
+
+impl RawReportPublisher {
+  fn publish(&mut self, data: &[u8], received: u64) {
+    let mut report = RawReport {
+      sequence: self.sequence.wrapping_add(1),
+      len: data.len() as u32,
+      received,
+      data: [0; MAX_LAZY_REPORT_LEN],
+    };
+    report.data[..data.len()].copy_from_slice(data);
+    self.sequence = report.sequence;
+    self.report.write(report);
+
+    // We don't know whether anything changed without decoding the report, so always notify.
+    self.generation.fetch_add(1, Ordering::Release);
+    self.notifier.notify();
+  }
+}
+
+/// Consumer side of a lazily decoded device, which decodes the newest report the first time it
+/// gets looked at.
+///
+/// Since reports that arrive between two polls are never decoded, buffered events only capture
+/// the changes between polls, and event notifications fire for every new report.
+pub struct LazyDecoder {
+  device_id: RawInputDeviceId,
+  report: Arc<SeqLock<RawReport>>,
+  hid: Arc<HidParser>,
+  publisher: DevicePublisher,
+  last_sequence: u32,
+}
+
+impl LazyDecoder {
+  /// Decode the newest report if it hasn't been already.
+  pub fn poll(&mut self) {
+    let report = self.report.read();
+    if report.sequence == self.last_sequence {
+      return;
+    }
+    self.last_sequence = report.sequence;
+
+    match self.hid.parse(&report.data[..report.len as usize]) {
+      Ok(mut inputs) => {
+        crate::mangle_inputs(&mut inputs);
+        self.publisher.record(inputs, report.received);
+      }
+      // Reports that a cached parser doesn't know about are dropped, and only warned about once.
+      Err(HidPError::ReportDoesNotExist) => {}
+      Err(err) => {
+        let device = crate::flight::device_code(DeviceId::RawInput(self.device_id));
+        if let Some(metrics) = crate::metrics::find_real_device(device) {
+          metrics.parse_errors.fetch_add(1, Ordering::Relaxed);
+        }
+        warn!("failed to read inputs: {:?}", err);
+      }
+    }
+  }
+}
+
+impl fmt::Debug for LazyDecoder {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    f.debug_struct("LazyDecoder")
+      .field("last_sequence", &self.last_sequence)
+      .finish()
+  }
+}
+
+/// Device arrivals and removals that the consumer hasn't picked up yet.
+///
+/// Both the input thread and the XInput poller queue events, and the consumer drains them
+/// directly, without a round trip through the input thread.
+struct EventQueue {
+  queue: MpscQueue<RawInputEvent>,
+  generation: Arc<AtomicUsize>,
+}
+
+impl EventQueue {
+  fn new(generation: Arc<AtomicUsize>) -> EventQueue {
+    EventQueue {
+      queue: MpscQueue::new(),
+      generation,
+    }
+  }
+
+  fn push(&self, event: RawInputEvent) {
+    self.queue.push(event);
+    self.generation.fetch_add(1, Ordering::Release);
+  }
+
+  fn take(&self) -> Vec<RawInputEvent> {
+    if self.queue.is_empty() {
+      Vec::new()
+    } else {
+      self.queue.take()
+    }
+  }
+}
+
 #[derive(Debug)]
 pub enum RawInputEvent {
-  DeviceArrived(DeviceDescription, triple_buffer::Output<DeviceInputs>),
+  DeviceArrived(DeviceDescription, DeviceSubscriber),
   DeviceRemoved(DeviceId),
 }
 
@@ -106,66 +452,313 @@ pub enum RawInputEvent {
 enum RawInputCommand {
   RegisterType(RawInputDeviceType, Sender<()>),
   UnregisterType(RawInputDeviceType, Sender<()>),
-  GetEvents(Sender<VecDeque<RawInputEvent>>),
 }
 
 struct RawInputManager {
-  event_queue: Mutex<VecDeque<RawInputEvent>>,
-  events_pending: Arc<AtomicUsize>,
+  lazy_decode: bool,
+
+  /// Reads HID devices instead of WM_INPUT, if that backend is enabled.
+  iocp: Option<IocpBackend>,
+
+  /// Device types that have been registered, and whether they're registered for WM_INPUT as well
+  /// as arrivals and removals. With the IOCP backend, only devices that it couldn't open need
+  /// WM_INPUT, so it's only asked for while there are any.
+  registered_types: Vec<RawInputDeviceType>,
+  input_sink: bool,
+
+  arena: RawInputArena,
+  stats: RawInputStats,
+  events: Arc<EventQueue>,
+  generation: Arc<AtomicUsize>,
   devices: HashMap<RawInputDeviceId, RawInputDeviceState>,
-  xinput_devices: HashMap<XInputDeviceId, XInputDeviceState>,
+  xinput: XInputPoller,
+
+  /// Opens devices that arrive, on other threads.
+  prober: DeviceProber,
+
+  /// Devices that are still being opened.
+  pending: HashMap<RawInputDeviceId, PendingDevice>,
 }
 
-struct RawInputDeviceState {
-  buffer: triple_buffer::Input<DeviceInputs>,
-  hid: HidParser,
-  is_xinput: bool,
+/// A device that arrived but hasn't been opened yet, along with the newest reports it sent.
+struct PendingDevice {
+  probe: u64,
+  reports: VecDeque<Vec<u8>>,
 }
 
-impl RawInputDeviceState {
-  fn handle_input(&mut self, input: &RAWHID) {
+impl PendingDevice {
+  fn new(probe: u64) -> PendingDevice {
+    PendingDevice {
+      probe,
+      reports: VecDeque::new(),
+    }
+  }
+
+  fn buffer_input(&mut self, input: &RAWHID) {
     let size = input.dwSizeHid as usize;
     let count = input.dwCount as usize;
-    let ptr = input.bRawData.as_ptr();
-    let mut inputs = DeviceInputs::default();
-    for i in 0..count {
-      let begin = (size * i) as isize;
-      let slice = unsafe { std::slice::from_raw_parts(ptr.offset(begin), size) };
-      match self.hid.parse(slice) {
-        Ok(result) => inputs = result,
-        Err(err) => warn!("failed to read inputs: {:?}", err),
+    if size == 0 {
+      return;
+    }
+
+    let data = unsafe { std::slice::from_raw_parts(input.bRawData.as_ptr(), size * count) };
+    for report in data.chunks_exact(size) {
+      if self.reports.len() == PENDING_REPORT_CAPACITY {
+        self.reports.pop_front();
+      }
+      self.reports.push_back(report.to_vec());
+    }
+  }
+}
+
+/// Detects reports whose input-relevant bytes are identical to those of the previous report.
+///
+/// Lots of devices send reports at a fixed rate whether anything changed or not, and they often
+/// include counters or timestamps. For reports that the parser has a fast path for, only the bits
+/// it looks at are compared. Other reports are compared in full.
+struct DuplicateFilter {
+  device_id: RawInputDeviceId,
+
+  /// Report IDs and relevance masks of the parser's fast paths.
+  masks: Vec<(u8, Vec<u8>)>,
+
+  /// Masked (or full) bytes of the previous report.
+  last: Vec<u8>,
+  last_mask: Option<usize>,
+
+  reports: u64,
+  suppressed: u64,
+}
+
+impl DuplicateFilter {
+  const LOG_INTERVAL: u64 = 10000;
+
+  fn new(device_id: RawInputDeviceId, hid: &HidParser) -> DuplicateFilter {
+    DuplicateFilter {
+      device_id,
+      masks: hid.relevance_masks(),
+      last: Vec::new(),
+      last_mask: None,
+      reports: 0,
+      suppressed: 0,
+    }
+  }
+
+  fn is_duplicate(&mut self, data: &[u8]) -> bool {
+    let masks = &self.masks;
+    let mask_idx = masks
+      .iter()
+      .position(|(report_id, mask)| !data.is_empty() && data[0] == *report_id && data.len() >= mask.len());
+    let mask = mask_idx.map(|idx| masks[idx].1.as_slice());
+    let len = mask.map_or(data.len(), |mask| mask.len());
+
+    // The first report doesn't have anything to compare against, since `last` starts out empty.
+    let mut duplicate = mask_idx == self.last_mask && len == self.last.len();
+    self.last.resize(len, 0);
+    for (i, last) in self.last.iter_mut().enumerate() {
+      let byte = mask.map_or(data[i], |mask| data[i] & mask[i]);
+      if *last != byte {
+        *last = byte;
+        duplicate = false;
       }
     }
+    self.last_mask = mask_idx;
 
-    crate::mangle_inputs(&mut inputs);
-    self.buffer.write(inputs);
+    self.reports += 1;
+    if duplicate {
+      self.suppressed += 1;
+    }
+    if self.reports % Self::LOG_INTERVAL == 0 {
+      self.log_stats();
+    }
+    duplicate
+  }
+
+  fn log_stats(&self) {
+    if self.reports > 0 {
+      debug!(
+        "{:?}: suppressed {} of {} reports ({:.1}%)",
+        self.device_id,
+        self.suppressed,
+        self.reports,
+        100.0 * self.suppressed as f64 / self.reports as f64
+      );
+    }
   }
 }
 
-struct XInputDeviceState {
-  buffer: triple_buffer::Input<DeviceInputs>,
+/// Measures the rate at which a device actually sends reports.
+struct ReportRate {
+  device_id: RawInputDeviceId,
+  window_start: Option<u32>,
+  reports: u64,
+  windows: u64,
 }
 
-impl HwndLoopCallbacks<RawInputCommand> for RawInputManager {
-  fn set_up(&mut self, _hwnd: HWND) {
-    unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST as i32) };
+impl ReportRate {
+  const WINDOW_MS: u32 = 10000;
+
+  fn new(device_id: RawInputDeviceId) -> ReportRate {
+    ReportRate {
+      device_id,
+      window_start: None,
+      reports: 0,
+      windows: 0,
+    }
   }
 
-  fn handle_message(&mut self, hwnd: HWND, msg: UINT, w: WPARAM, l: LPARAM) -> LRESULT {
+  fn record(&mut self, reports: u64) {
+    let now = unsafe { GetTickCount() };
+    let window_start = *self.window_start.get_or_insert(now);
+    self.reports += reports;
+
+    let elapsed = now.wrapping_sub(window_start);
+    if elapsed >= Self::WINDOW_MS {
+      let rate = self.reports as f64 * 1000.0 / f64::from(elapsed);
+
+      // Only the first measurement is interesting enough to always show up.
+      if self.windows == 0 {
+        info!("{:?}: receiving {:.0} reports per second", self.device_id, rate);
+      } else {
+        debug!("{:?}: receiving {:.0} reports per second", self.device_id, rate);
+      }
+
+      self.windows += 1;
+      self.reports = 0;
+      self.window_start = Some(now);
+    }
+  }
+}
+
+enum ReportSink {
+  /// Decode every report on the input thread.
+  Eager(DevicePublisher),
+
+  /// Hand the newest report over to the consumer, which decodes it when it polls.
+  Lazy(RawReportPublisher),
+}
+
+impl ReportSink {
+  fn notifier(&self) -> &DeviceNotifier {
+    match self {
+      ReportSink::Eager(publisher) => &publisher.notifier,
+      ReportSink::Lazy(publisher) => &publisher.notifier,
+    }
+  }
+}
+
+pub(crate) struct RawInputDeviceState {
+  device_id: RawInputDeviceId,
+  metrics: RealDeviceSlot,
+  sink: ReportSink,
+  filter: DuplicateFilter,
+  rate: ReportRate,
+
+  /// Handle that the device was configured through, which needs to stay open.
+  _handle: Option<HidHandle>,
+
+  hid: Arc<HidParser>,
+  is_xinput: bool,
+}
+
+impl RawInputDeviceState {
+  fn handle_input(&mut self, input: &RAWHID) {
+    let size = input.dwSizeHid as usize;
+    let count = input.dwCount as usize;
+    let reports = unsafe { std::slice::from_raw_parts(input.bRawData.as_ptr(), size * count) };
+    self.handle_reports(reports, size);
+  }
+
+  /// Handle a run of back-to-back reports of `size` bytes each.
+  pub(crate) fn handle_reports(&mut self, reports: &[u8], size: usize) {
+    if size == 0 || reports.len() < size {
+      return;
+    }
+    let count = reports.len() / size;
+    let received = crate::clock::now();
+    self.rate.record(count as u64);
+    self.sink.notifier().record_reports(count as u64);
+    self.metrics.record_reports(count, reports.len());
+    crate::flight::record_reports(
+      received,
+      crate::flight::device_code(DeviceId::RawInput(self.device_id)),
+      count,
+      &reports[size * (count - 1)..size * count],
+    );
+
+    match self.sink {
+      ReportSink::Eager(ref mut publisher) => {
+        // Publish every report, so that changes that only last for one of them still get recorded.
+        for report in reports.chunks_exact(size) {
+          if self.filter.is_duplicate(report) {
+            self.metrics.record_duplicate();
+            continue;
+          }
+
+          match self.hid.parse(report) {
+            Ok(mut inputs) => {
+              crate::mangle_inputs(&mut inputs);
+              publisher.publish(inputs, received);
+            }
+            Err(HidPError::ReportDoesNotExist) => {}
+            Err(err) => {
+              self.metrics.record_parse_error();
+              warn!("failed to read inputs: {:?}", err);
+            }
+          }
+        }
+      }
+
+      ReportSink::Lazy(ref mut publisher) => {
+        // Only the newest report matters.
+        let report = &reports[size * (count - 1)..size * count];
+        if self.filter.is_duplicate(report) {
+          self.metrics.record_duplicate();
+        } else {
+          publisher.publish(report, received);
+        }
+      }
+    }
+  }
+}
+
+impl RawInputManager {
+  fn dispatch_message(&mut self, hwnd: HWND, msg: UINT, w: WPARAM, l: LPARAM) -> LRESULT {
     if msg == WM_INPUT {
       self.handle_device_input(hwnd, l as HRAWINPUT);
+    } else if msg == WM_PROBE_COMPLETE {
+      for result in self.prober.take_results() {
+        self.handle_probe_result(result);
+      }
+      self.update_input_sink(hwnd);
+      return 0;
     } else if msg == WM_INPUT_DEVICE_CHANGE {
       let device = RawInputDeviceId::from_handle(l as HANDLE);
       if w == GIDC_ARRIVAL as usize {
         self.handle_device_arrival(device);
       } else if w == GIDC_REMOVAL as usize {
         self.handle_device_removal(device);
+        self.update_input_sink(hwnd);
       } else {
         panic!("Unknown argument to WM_INPUT_DEVICE_CHANGE: {}", w);
       }
     }
     unsafe { DefWindowProcA(hwnd, msg, w, l) }
   }
+}
+
+impl HwndLoopCallbacks<RawInputCommand> for RawInputManager {
+  fn set_up(&mut self, hwnd: HWND) {
+    unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST as i32) };
+    self.prober.start(hwnd);
+  }
+
+  fn handle_message(&mut self, hwnd: HWND, msg: UINT, w: WPARAM, l: LPARAM) -> LRESULT {
+    let start = crate::clock::now();
+    let result = self.dispatch_message(hwnd, msg, w, l);
+    crate::metrics::block().input_loop.record_since(start);
+    result
+  }
 
   fn handle_command(&mut self, hwnd: HWND, cmd: RawInputCommand) {
     match cmd {
@@ -176,47 +769,360 @@ impl HwndLoopCallbacks<RawInputCommand> for RawInputManager {
       RawInputCommand::UnregisterType(device_type, reply) => {
         self.cmd_unregister_device_type(hwnd, device_type, reply);
       }
+    }
+  }
+}
 
-      RawInputCommand::GetEvents(reply) => {
-        self.cmd_get_events(hwnd, reply);
+/// Reusable buffer that raw input blocks get read into.
+///
+/// Raw input blocks need to be 8-byte aligned, even in 32-bit processes.
+struct RawInputArena {
+  buffer: Vec<u64>,
+  wow64: bool,
+}
+
+impl RawInputArena {
+  fn new() -> RawInputArena {
+    let mut arena = RawInputArena {
+      buffer: Vec::new(),
+      wow64: is_wow64(),
+    };
+
+    // Start out with enough room for full-speed USB reports, and grow as devices show up.
+    arena.reserve_reports(64);
+    arena
+  }
+
+  fn len(&self) -> usize {
+    self.buffer.len() * std::mem::size_of::<u64>()
+  }
+
+  fn reserve(&mut self, bytes: usize) {
+    if bytes > self.len() {
+      self.buffer.resize((bytes + 7) / 8, 0);
+    }
+  }
+
+  /// Make room for a batch of reports of the given size.
+  fn reserve_reports(&mut self, report_len: usize) {
+    // Headers from GetRawInputBuffer are 64-bit sized under WOW64.
+    let header_size = std::mem::size_of::<RAWINPUTHEADER>().max(24);
+    let block_size = (header_size + RAWHID_HEADER_SIZE + report_len + 7) & !7;
+    self.reserve(block_size * RAW_INPUT_BATCH_SIZE);
+  }
+
+  fn as_mut_ptr(&mut self) -> *mut u8 {
+    self.buffer.as_mut_ptr() as *mut u8
+  }
+}
+
+#[cfg(target_pointer_width = "32")]
+fn is_wow64() -> bool {
+  use winapi::um::processthreadsapi::GetCurrentProcess;
+  use winapi::um::wow64apiset::IsWow64Process;
+
+  let mut result = 0;
+  let rc = unsafe { IsWow64Process(GetCurrentProcess(), &mut result) };
+  rc != 0 && result != 0
+}
+
+#[cfg(target_pointer_width = "64")]
+fn is_wow64() -> bool {
+  false
+}
+
+/// Header fields of a raw input block, plus a pointer to its data.
+struct RawInputBlock {
+  dw_type: u32,
+  size: u32,
+  device: HANDLE,
+  hid: *const RAWHID,
+}
+
+impl RawInputBlock {
+  /// Read the block at `ptr`.
+  ///
+  /// `wow64_layout` should be true for blocks returned by GetRawInputBuffer in a 32-bit process
+  /// on 64-bit Windows, which get the 64-bit RAWINPUTHEADER layout: the device handle and wParam
+  /// are 8 bytes each, which shifts the data by 8 bytes.
+  #[allow(clippy::cast_ptr_alignment)]
+  unsafe fn read(ptr: *const u8, wow64_layout: bool) -> RawInputBlock {
+    if wow64_layout {
+      let words = ptr as *const u32;
+      RawInputBlock {
+        dw_type: *words,
+        size: *words.offset(1),
+        device: *(ptr.offset(8) as *const u64) as usize as HANDLE,
+        hid: ptr.offset(24) as *const RAWHID,
+      }
+    } else {
+      let header = &*(ptr as *const RAWINPUTHEADER);
+      RawInputBlock {
+        dw_type: header.dwType,
+        size: header.dwSize,
+        device: header.hDevice,
+        hid: ptr.add(std::mem::size_of::<RAWINPUTHEADER>()) as *const RAWHID,
       }
     }
   }
+
+  /// Equivalent of the NEXTRAWINPUTBLOCK macro.
+  fn next(ptr: *mut u8, size: u32) -> *mut u8 {
+    let next = ptr as usize + size as usize;
+    ((next + 7) & !7) as *mut u8
+  }
 }
 
-#[repr(align(8))]
-struct AlignedBuffer {
-  #[allow(dead_code)]
-  data: [u8; 512],
+/// Counters for how well raw input is getting batched.
+#[derive(Default)]
+struct RawInputStats {
+  batches: u64,
+  blocks: u64,
+  max_batch: u64,
+}
+
+impl RawInputStats {
+  const LOG_INTERVAL: u64 = 10000;
+
+  fn record(&mut self, blocks: u64) {
+    self.batches += 1;
+    self.blocks += blocks;
+    self.max_batch = self.max_batch.max(blocks);
+    if self.batches % Self::LOG_INTERVAL == 0 {
+      debug!(
+        "raw input: {} reports in {} batches ({:.2} per batch, max {})",
+        self.blocks,
+        self.batches,
+        self.blocks as f64 / self.batches as f64,
+        self.max_batch
+      );
+    }
+  }
+}
+
+/// Time per raw input block, in nanoseconds, when reading one WM_INPUT message at a time and when
+/// draining the queue with GetRawInputBuffer.
+pub struct RawInputBenchmark {
+  pub batch_size: usize,
+  pub per_message: f64,
+  pub batched: f64,
+}
+
+/// Compare the two ways of reading raw input on a batch of `batch_size` injected mouse moves.
+///
+/// There's no way to inject HID reports, so zero-length mouse moves from SendInput stand in for
+/// them. Each batch is given time to be queued before it's read, so only reading is timed.
+pub(crate) fn benchmark_raw_input(batch_size: usize, iterations: usize) -> std::io::Result<RawInputBenchmark> {
+  let class: Vec<u16> = "STATIC\0".encode_utf16().collect();
+  let hwnd = unsafe {
+    CreateWindowExW(
+      0,
+      class.as_ptr(),
+      std::ptr::null(),
+      0,
+      0,
+      0,
+      0,
+      0,
+      HWND_MESSAGE,
+      std::ptr::null_mut(),
+      std::ptr::null_mut(),
+      std::ptr::null_mut(),
+    )
+  };
+  if hwnd.is_null() {
+    return Err(std::io::Error::last_os_error());
+  }
+
+  let register = |flags, target| {
+    let rid = RAWINPUTDEVICE {
+      usUsagePage: 0x01,
+      usUsage: 0x02,
+      dwFlags: flags,
+      hwndTarget: target,
+    };
+    unsafe { RegisterRawInputDevices(&rid, 1, std::mem::size_of::<RAWINPUTDEVICE>() as UINT) != 0 }
+  };
+
+  let result = if register(RIDEV_INPUTSINK, hwnd) {
+    let per_message = time_raw_input(hwnd, batch_size, iterations, read_raw_input_messages);
+    let batched = time_raw_input(hwnd, batch_size, iterations, read_raw_input_buffer);
+    register(RIDEV_REMOVE, std::ptr::null_mut());
+    match (per_message, batched) {
+      (Ok(per_message), Ok(batched)) => Ok(RawInputBenchmark {
+        batch_size,
+        per_message,
+        batched,
+      }),
+      (Err(err), _) | (_, Err(err)) => Err(err),
+    }
+  } else {
+    Err(std::io::Error::last_os_error())
+  };
+
+  unsafe { DestroyWindow(hwnd) };
+  result
+}
+
+fn time_raw_input(
+  hwnd: HWND,
+  batch_size: usize,
+  iterations: usize,
+  read: fn(HWND, &mut RawInputArena) -> u64,
+) -> std::io::Result<f64> {
+  let mut input: INPUT = unsafe { std::mem::zeroed() };
+  input.type_ = INPUT_MOUSE;
+  unsafe { input.u.mi_mut().dwFlags = MOUSEEVENTF_MOVE };
+  let inputs = vec![input; batch_size];
+
+  let mut arena = RawInputArena::new();
+  let mut elapsed = Duration::from_secs(0);
+  let mut blocks = 0;
+  for _ in 0..iterations {
+    let input_size = std::mem::size_of::<INPUT>() as i32;
+    let sent = unsafe { SendInput(inputs.len() as UINT, inputs.as_ptr() as *mut _, input_size) };
+    if sent as usize != inputs.len() {
+      return Err(std::io::Error::last_os_error());
+    }
+    std::thread::sleep(Duration::from_millis(5));
+
+    let start = std::time::Instant::now();
+    blocks += read(hwnd, &mut arena);
+    elapsed += start.elapsed();
+  }
+
+  if blocks == 0 {
+    return Err(std::io::Error::new(std::io::ErrorKind::TimedOut, "no raw input was received"));
+  }
+  Ok(elapsed.as_nanos() as f64 / blocks as f64)
+}
+
+/// Read raw input the way the input thread used to: GetRawInputData for each WM_INPUT.
+fn read_raw_input_messages(hwnd: HWND, arena: &mut RawInputArena) -> u64 {
+  let header_size = std::mem::size_of::<RAWINPUTHEADER>() as UINT;
+  let mut blocks = 0;
+  let mut msg: MSG = unsafe { std::mem::zeroed() };
+  while unsafe { PeekMessageW(&mut msg, hwnd, WM_INPUT, WM_INPUT, PM_REMOVE) } != 0 {
+    let mut size = arena.len() as UINT;
+    let ptr = arena.as_mut_ptr();
+    let rc = unsafe { GetRawInputData(msg.lParam as HRAWINPUT, RID_INPUT, ptr as *mut _, &mut size, header_size) };
+    if rc != -1i32 as u32 && rc > 0 {
+      let block = unsafe { RawInputBlock::read(ptr, false) };
+      std::hint::black_box(block.device);
+      blocks += 1;
+    }
+    unsafe { DefWindowProcW(hwnd, msg.message, msg.wParam, msg.lParam) };
+  }
+  blocks
+}
+
+/// Read raw input the way the input thread does now: drain the queue with GetRawInputBuffer, and
+/// then throw away the messages for the blocks that were already read.
+fn read_raw_input_buffer(hwnd: HWND, arena: &mut RawInputArena) -> u64 {
+  let header_size = std::mem::size_of::<RAWINPUTHEADER>() as UINT;
+  let mut blocks = 0;
+  loop {
+    let mut size = arena.len() as UINT;
+    let ptr = arena.as_mut_ptr();
+    let count = unsafe { GetRawInputBuffer(ptr as PRAWINPUT, &mut size, header_size) };
+    if count == 0 || count == -1i32 as u32 {
+      break;
+    }
+
+    let mut block_ptr = ptr;
+    for _ in 0..count {
+      let block = unsafe { RawInputBlock::read(block_ptr, arena.wow64) };
+      std::hint::black_box(block.device);
+      block_ptr = RawInputBlock::next(block_ptr, block.size);
+    }
+    blocks += u64::from(count);
+  }
+
+  let mut msg: MSG = unsafe { std::mem::zeroed() };
+  while unsafe { PeekMessageW(&mut msg, hwnd, WM_INPUT, WM_INPUT, PM_REMOVE) } != 0 {
+    unsafe { DefWindowProcW(hwnd, msg.message, msg.wParam, msg.lParam) };
+  }
+  blocks
 }
 
 impl RawInputManager {
-  fn new(events_pending: Arc<AtomicUsize>) -> RawInputManager {
+  fn new(options: &Options, events: Arc<EventQueue>, generation: Arc<AtomicUsize>) -> RawInputManager {
+    let iocp = match options.backend {
+      InputBackend::RawInput => None,
+      InputBackend::Iocp => match IocpBackend::new() {
+        Ok(iocp) => Some(iocp),
+        Err(err) => {
+          error!("failed to start IOCP input backend, falling back to raw input: {}", err);
+          None
+        }
+      },
+    };
+
+    let xinput = XInputPoller::spawn(options.xinput_poll_rate, Arc::clone(&events));
+
     RawInputManager {
-      event_queue: Mutex::new(VecDeque::new()),
+      lazy_decode: options.lazy_decode,
+      input_sink: iocp.is_none(),
+      iocp,
+      registered_types: Vec::new(),
+      arena: RawInputArena::new(),
+      stats: RawInputStats::default(),
+      events,
+      generation,
       devices: HashMap::new(),
-      xinput_devices: HashMap::new(),
-      events_pending,
+      xinput,
+      prober: DeviceProber::new(options.device_cache.clone()),
+      pending: HashMap::new(),
     }
   }
 
-  fn cmd_register_device_type(&mut self, hwnd: HWND, device_type: RawInputDeviceType, reply: Sender<()>) {
+  /// Register for arrivals and removals of a device type, and for its WM_INPUT if `input_sink`.
+  ///
+  /// Without RIDEV_INPUTSINK, WM_INPUT only goes to a window in the foreground, which our
+  /// message-only window never is.
+  fn register(hwnd: HWND, device_type: RawInputDeviceType, input_sink: bool) -> bool {
     let rid = RAWINPUTDEVICE {
       usUsagePage: device_type.usage_page(),
       usUsage: device_type.usage(),
-      dwFlags: RIDEV_INPUTSINK | RIDEV_DEVNOTIFY,
+      dwFlags: if input_sink { RIDEV_INPUTSINK | RIDEV_DEVNOTIFY } else { RIDEV_DEVNOTIFY },
       hwndTarget: hwnd,
     };
-    let result = unsafe { RegisterRawInputDevices(&rid, 1, std::mem::size_of::<RAWINPUTDEVICE>() as UINT) };
-    if result == 0 {
+    unsafe { RegisterRawInputDevices(&rid, 1, std::mem::size_of::<RAWINPUTDEVICE>() as UINT) != 0 }
+  }
+
+  fn cmd_register_device_type(&mut self, hwnd: HWND, device_type: RawInputDeviceType, reply: Sender<()>) {
+    if !Self::register(hwnd, device_type, self.input_sink) {
       panic!(
         "RegisterRawInputDevices failed while registering device type {:?}",
         device_type
       );
     }
+    if !self.registered_types.contains(&device_type) {
+      self.registered_types.push(device_type);
+    }
     reply.send(()).unwrap();
   }
 
+  /// With the IOCP backend, ask for WM_INPUT only while some device is being read through it.
+  fn update_input_sink(&mut self, hwnd: HWND) {
+    let input_sink = self.iocp.is_none() || self.devices.values().any(|device| !device.is_xinput);
+    if input_sink == self.input_sink {
+      return;
+    }
+
+    debug!("{} WM_INPUT", if input_sink { "registering for" } else { "unregistering from" });
+    self.input_sink = input_sink;
+    for &device_type in &self.registered_types {
+      if !Self::register(hwnd, device_type, input_sink) {
+        error!(
+          "RegisterRawInputDevices failed while re-registering device type {:?}: {}",
+          device_type,
+          std::io::Error::last_os_error()
+        );
+      }
+    }
+  }
+
   fn cmd_unregister_device_type(&mut self, _hwnd: HWND, device_type: RawInputDeviceType, reply: Sender<()>) {
     let rid = RAWINPUTDEVICE {
       usUsagePage: device_type.usage_page(),
@@ -231,178 +1137,255 @@ impl RawInputManager {
         device_type
       );
     }
+    self.registered_types.retain(|&registered| registered != device_type);
     reply.send(()).unwrap();
   }
 
-  fn cmd_get_events(&mut self, _hwnd: HWND, reply: Sender<VecDeque<RawInputEvent>>) {
-    let mut events = self.event_queue.lock();
-    let mut empty = VecDeque::new();
-    std::mem::swap(&mut *events, &mut empty);
-    reply.send(empty).unwrap();
+  fn handle_device_input(&mut self, _hwnd: HWND, hrawinput: HRAWINPUT) {
+    trace_span!("handle_device_input");
+    let header_size = std::mem::size_of::<RAWINPUTHEADER>() as UINT;
+
+    // Read the input for this message first, since it's older than anything still in the queue.
+    let mut size = 0;
+    let rc = unsafe { GetRawInputData(hrawinput, RID_INPUT, std::ptr::null_mut(), &mut size, header_size) };
+    if rc == 0 {
+      // If a previous batch already picked up this message's input, there's nothing left to read.
+      if size > 0 {
+        self.arena.reserve(size as usize);
+        let ptr = self.arena.as_mut_ptr();
+        let rc = unsafe { GetRawInputData(hrawinput, RID_INPUT, ptr as *mut _, &mut size, header_size) };
+        if rc == -1i32 as u32 {
+          error!("GetRawInputData failed to get raw input data");
+        } else {
+          let block = unsafe { RawInputBlock::read(ptr, false) };
+          self.dispatch_raw_input(&block);
+        }
+      }
+    }
+
+    self.drain_raw_input();
   }
 
-  fn handle_device_input(&mut self, _hwnd: HWND, hrawinput: HRAWINPUT) {
-    // TODO: Switch to GetRawInputBuffer?
-    let mut buffer = unsafe { MaybeUninit::uninit().assume_init() };
-    let mut size = std::mem::size_of_val(&buffer) as u32;
-    let result = unsafe {
-      GetRawInputData(
-        hrawinput,
-        RID_INPUT,
-        &mut buffer as *mut AlignedBuffer as *mut std::ffi::c_void,
-        &mut size,
-        std::mem::size_of::<RAWINPUTHEADER>() as UINT,
-      )
-    };
+  /// Handle every raw input block that's queued up for us, without waiting for their messages.
+  fn drain_raw_input(&mut self) {
+    let header_size = std::mem::size_of::<RAWINPUTHEADER>() as UINT;
+    let mut total = 0;
 
-    if result == -1i32 as u32 {
-      error!("GetRawInputData failed to get raw input data");
-      return;
+    loop {
+      let mut size = self.arena.len() as UINT;
+      let ptr = self.arena.as_mut_ptr();
+      let count = unsafe { GetRawInputBuffer(ptr as PRAWINPUT, &mut size, header_size) };
+      if count == -1i32 as u32 {
+        // The arena might be too small to hold even the first block.
+        let mut required = 0;
+        unsafe { GetRawInputBuffer(std::ptr::null_mut(), &mut required, header_size) };
+        if required as usize > self.arena.len() {
+          self.arena.reserve(required as usize * RAW_INPUT_BATCH_SIZE);
+          continue;
+        }
+
+        error!("GetRawInputBuffer failed: {}", std::io::Error::last_os_error());
+        break;
+      } else if count == 0 {
+        break;
+      }
+
+      let mut block_ptr = ptr;
+      for _ in 0..count {
+        let block = unsafe { RawInputBlock::read(block_ptr, self.arena.wow64) };
+        self.dispatch_raw_input(&block);
+        block_ptr = RawInputBlock::next(block_ptr, block.size);
+      }
+      total += u64::from(count);
     }
 
-    let rawinput = unsafe { *(&buffer as *const AlignedBuffer as *const RAWINPUT) };
-    let device_id = RawInputDeviceId::from_handle(rawinput.header.hDevice);
-    let device = self.devices.get_mut(&device_id);
-    if device.is_none() {
-      return;
+    if total > 0 {
+      self.stats.record(total);
     }
+  }
 
-    let device = device.unwrap();
-    assert_eq!(RIM_TYPEHID, rawinput.header.dwType);
-    let data = unsafe { rawinput.data.hid() };
+  /// Publish the reports in a raw input block.
+  fn dispatch_raw_input(&mut self, block: &RawInputBlock) {
+    let device_id = RawInputDeviceId::from_handle(block.device);
+    let device = match self.devices.get_mut(&device_id) {
+      Some(device) => device,
+      None => {
+        // Hold on to reports from devices that are still being opened, so that they aren't lost.
+        if let Some(pending) = self.pending.get_mut(&device_id) {
+          pending.buffer_input(unsafe { &*block.hid });
+        }
+        return;
+      }
+    };
 
-    if device.is_xinput {
-      self.read_xinput()
-    } else {
-      device.handle_input(data);
+    assert_eq!(RIM_TYPEHID, block.dw_type);
+
+    // XInput devices are read by the XInput poller.
+    if !device.is_xinput {
+      device.handle_input(unsafe { &*block.hid });
     }
   }
 
   fn handle_device_arrival(&mut self, device_id: RawInputDeviceId) {
-    let (hid, device_type, description) = match open_rawinput_device(device_id) {
+    let probe = self.prober.probe(device_id);
+    self.pending.insert(device_id, PendingDevice::new(probe));
+  }
+
+  fn handle_probe_result(&mut self, result: ProbeResult) {
+    let ProbeResult {
+      device_id,
+      probe,
+      result,
+    } = result;
+
+    // The device might have gone away (or arrived again) while it was being opened.
+    let pending = match self.pending.remove(&device_id) {
+      Some(pending) if pending.probe == probe => pending,
+      Some(pending) => {
+        self.pending.insert(device_id, pending);
+        return;
+      }
+      None => return,
+    };
+
+    let OpenedDevice {
+      parser: hid,
+      device_type,
+      description,
+      path,
+      handle,
+    } = match result {
       Ok(x) => x,
       Err(_) => return,
     };
 
     let is_xinput = device_type == DeviceType::XInput;
-    let default_inputs = DeviceInputs::default();
-    let (write, read) = triple_buffer::TripleBuffer::new(default_inputs).split();
+    let report_len = hid.report_len();
 
-    let device = RawInputDeviceState {
-      buffer: write,
+    let hid = Arc::new(hid);
+    let (sink, subscriber) = if self.lazy_decode && !is_xinput && report_len <= MAX_LAZY_REPORT_LEN {
+      let (publisher, subscriber) = lazy_device_channel(device_id, &self.generation, Arc::clone(&hid));
+      (ReportSink::Lazy(publisher), subscriber)
+    } else {
+      let (publisher, subscriber) = device_channel(&self.generation);
+      (ReportSink::Eager(publisher), subscriber)
+    };
+
+    let mut device = RawInputDeviceState {
+      device_id,
+      metrics: RealDeviceSlot::claim(crate::flight::device_code(DeviceId::RawInput(device_id))),
+      sink,
+      filter: DuplicateFilter::new(device_id, &hid),
+      rate: ReportRate::new(device_id),
+      _handle: handle,
       hid,
       is_xinput,
     };
-    self.devices.insert(device_id, device);
+
+    if !is_xinput {
+      for report in &pending.reports {
+        device.handle_reports(report, report.len());
+      }
+    }
+
+    // XInput devices are read through XInput, which raw input tells us when to do.
+    let device = match self.iocp {
+      Some(ref mut iocp) if !is_xinput => match iocp.add(device_id, &path, report_len, device) {
+        Ok(()) => None,
+        Err(device) => {
+          warn!("{:?}: reading through raw input instead", device_id);
+          Some(device)
+        }
+      },
+      _ => Some(device),
+    };
+
+    if let Some(device) = device {
+      self.arena.reserve_reports(report_len);
+      self.devices.insert(device_id, device);
+    }
 
     if is_xinput {
-      self.scan_xinput();
+      self.xinput.request_rescan();
     } else {
-      let mut queue = self.event_queue.lock();
-      queue.push_back(RawInputEvent::DeviceArrived(description, read));
-      self.events_pending.fetch_add(1, Ordering::SeqCst);
+      self.events.push(RawInputEvent::DeviceArrived(description, subscriber));
     }
   }
 
   fn handle_device_removal(&mut self, device_id: RawInputDeviceId) {
+    // Nobody has heard about devices that were still being opened.
+    if self.pending.remove(&device_id).is_some() {
+      return;
+    }
+
+    if let Some(ref mut iocp) = self.iocp {
+      if iocp.remove(device_id) {
+        self.events.push(RawInputEvent::DeviceRemoved(DeviceId::RawInput(device_id)));
+        return;
+      }
+    }
+
     let device = self.devices.get(&device_id);
     if device.is_none() {
       return;
     }
-    let is_xinput = device.unwrap().is_xinput;
+    let device = device.unwrap();
+    let is_xinput = device.is_xinput;
+    device.filter.log_stats();
 
     self.devices.remove(&device_id);
 
     if is_xinput {
-      self.scan_xinput();
+      self.xinput.request_rescan();
     } else {
-      let mut queue = self.event_queue.lock();
-      queue.push_back(RawInputEvent::DeviceRemoved(DeviceId::RawInput(device_id)));
-      self.events_pending.fetch_add(1, Ordering::SeqCst);
+      self.events.push(RawInputEvent::DeviceRemoved(DeviceId::RawInput(device_id)));
     }
   }
+}
 
-  fn read_xinput(&mut self) {
-    let mut need_scan = false;
-    for (id, device) in self.xinput_devices.iter_mut() {
-      match xinput::read_xinput(*id) {
-        Some(inputs) => device.buffer.write(inputs),
-        None => {
-          warn!("failed to read inputs for {:?}", id);
-          need_scan = true;
-        }
-      }
-    }
-
-    if need_scan {
-      self.scan_xinput();
-    }
-  }
-
-  fn scan_xinput(&mut self) {
-    info!("RawInputManager::scan_xinput()");
-    let mut killed = Vec::new();
-    let mut new = Vec::new();
-    for i in 0..4 {
-      let id = XInputDeviceId(i);
-      let known = self.xinput_devices.contains_key(&id);
-      let exists = xinput::read_xinput(id).is_some();
-      if known == exists {
-        continue;
-      }
-      if !known && exists {
-        new.push(id);
-      }
-      if known && !exists {
-        killed.push(id);
-      }
-    }
-
-    let mut events = VecDeque::new();
-    for id in killed {
-      info!("XInputDevice({:?}) left", id);
-      events.push_back(RawInputEvent::DeviceRemoved(DeviceId::XInput(id)));
-      self.xinput_devices.remove(&id);
-    }
-
-    let default_inputs = DeviceInputs::default();
-    for id in new {
-      info!("XInputDevice({:?}) arrived", id);
-      let (write, read) = triple_buffer::TripleBuffer::new(default_inputs).split();
-      let xinput_device = XInputDeviceState { buffer: write };
-      self.xinput_devices.insert(id, xinput_device);
+/// How the input thread reads devices.
+#[derive(Clone, Debug)]
+pub struct Options {
+  /// Decode HID reports when the consumer polls, instead of as they arrive.
+  pub lazy_decode: bool,
 
-      let description = DeviceDescription {
-        device_id: DeviceId::XInput(id),
-        device_name: format!("{:?}", id),
-      };
+  /// What reads HID reports.
+  pub backend: InputBackend,
 
-      events.push_back(RawInputEvent::DeviceArrived(description, read))
-    }
+  /// Rate at which XInput devices are polled, in Hz.
+  pub xinput_poll_rate: u32,
 
-    let mut queue = self.event_queue.lock();
-    self.events_pending.fetch_add(events.len(), Ordering::SeqCst);
-    queue.append(&mut events);
-  }
+  /// Where to remember devices between runs, if anywhere.
+  pub device_cache: Option<PathBuf>,
 }
 
 /// Client for the RawInputManager.
 pub struct Context {
   eventloop: HwndLoop<RawInputCommand>,
-  events_pending: Arc<AtomicUsize>,
+  events: Arc<EventQueue>,
+  generation: Arc<AtomicUsize>,
 }
 
 impl Context {
-  #[allow(clippy::new_without_default)]
-  pub fn new() -> Context {
-    let events_pending = Arc::new(AtomicUsize::new(0));
-    let manager = RawInputManager::new(Arc::clone(&events_pending));
+  /// Create the input thread, along with the XInput poller.
+  pub fn new(options: Options) -> Context {
+    let generation = Arc::new(AtomicUsize::new(0));
+    let events = Arc::new(EventQueue::new(Arc::clone(&generation)));
+    let manager = RawInputManager::new(&options, Arc::clone(&events), Arc::clone(&generation));
     Context {
       eventloop: HwndLoop::new(Box::new(manager)),
-      events_pending,
+      events,
+      generation,
     }
   }
 
+  /// Counter that the input thread bumps whenever it publishes new inputs or queues an event.
+  ///
+  /// If this hasn't changed since the last time it was read, neither has anything else.
+  pub fn generation(&self) -> usize {
+    self.generation.load(Ordering::Acquire)
+  }
+
   pub fn register_device_type(&self, device_type: RawInputDeviceType) {
     let (tx, rx) = channel();
     let cmd = RawInputCommand::RegisterType(device_type, tx);
@@ -418,17 +1401,9 @@ impl Context {
     rx.recv().unwrap()
   }
 
-  pub fn get_events(&self) -> VecDeque<RawInputEvent> {
-    let events_pending = self.events_pending.load(Ordering::SeqCst);
-    if events_pending > 0 {
-      let (tx, rx) = channel();
-      let cmd = RawInputCommand::GetEvents(tx);
-      self.eventloop.send_command(cmd);
-      let events = rx.recv().unwrap();
-      self.events_pending.fetch_sub(events.len(), Ordering::SeqCst);
-      events
-    } else {
-      VecDeque::new()
-    }
+  /// Take the device arrivals and removals that have happened since the last call, oldest first.
+  pub fn get_events(&self) -> Vec<RawInputEvent> {
+    trace_span!("get_events");
+    self.events.take()
   }
 }
@@ -0,0 +1,80 @@
+use std::fmt;
+use std::ptr;
+use std::sync::atomic::{AtomicPtr, Ordering};
+
+struct Node<T> {
+  value: T,
+  next: *mut Node<T>,
+}
+
+/// Unbounded lock-free multi-producer queue, which is drained all at once.
+///
+/// Producers push onto an intrusive stack with a compare-and-swap, and `take` swaps the whole
+/// stack out and reverses it, so neither side ever waits on the other. Since nodes are never
+/// popped one at a time, there's no ABA problem to worry about.
+pub struct MpscQueue<T> {
+  head: AtomicPtr<Node<T>>,
+}
+
+unsafe impl<T: Send> Send for MpscQueue<T> {}
+unsafe impl<T: Send> Sync for MpscQueue<T> {}
+
+impl<T> MpscQueue<T> {
+  pub fn new() -> MpscQueue<T> {
+    MpscQueue {
+      head: AtomicPtr::new(ptr::null_mut()),
+    }
+  }
+
+  pub fn push(&self, value: T) {
+    let node = Box::into_raw(Box::new(Node {
+      value,
+      next: ptr::null_mut(),
+    }));
+
+    let mut head = self.head.load(Ordering::Relaxed);
+    loop {
+      unsafe { (*node).next = head };
+      match self
+        .head
+        .compare_exchange_weak(head, node, Ordering::Release, Ordering::Relaxed)
+      {
+        Ok(_) => return,
+        Err(current) => head = current,
+      }
+    }
+  }
+
+  pub fn is_empty(&self) -> bool {
+    self.head.load(Ordering::Acquire).is_null()
+  }
+
+  /// Take every value that has been pushed so far, oldest first.
+  pub fn take(&self) -> Vec<T> {
+    let mut node = self.head.swap(ptr::null_mut(), Ordering::Acquire);
+    let mut result = Vec::new();
+    while !node.is_null() {
+      let boxed = unsafe { Box::from_raw(node) };
+      node = boxed.next;
+      result.push(boxed.value);
+    }
+    result.reverse();
+    result
+  }
+}
+
+impl<T> Drop for MpscQueue<T> {
+  fn drop(&mut self) {
+    let mut node = *self.head.get_mut();
+    while !node.is_null() {
+      let boxed = unsafe { Box::from_raw(node) };
+      node = boxed.next;
+    }
+  }
+}
+
+impl<T> fmt::Debug for MpscQueue<T> {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    write!(f, "MpscQueue(empty = {})", self.is_empty())
+  }
+}
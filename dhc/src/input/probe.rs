@@ -0,0 +1,133 @@
+//! Opening newly arrived devices off the input thread.
+//!
+//! Opening a device takes a handful of round trips to its driver, which can take a long time for
+//! Bluetooth devices, and every other device's reports would queue up behind them on the input
+//! thread. Arrivals are instead handed to a small pool of workers, which post a message back to
+//! the input thread's window whenever a device has been opened.
+
+use std::io;
+use std::path::PathBuf;
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::sync::Arc;
+
+use parking_lot::Mutex;
+
+use winapi::shared::windef::HWND;
+use winapi::um::winuser::{PostMessageA, WM_APP};
+
+use crate::input::cache::DeviceCache;
+use crate::input::hid::{open_rawinput_device, OpenedDevice};
+use crate::input::RawInputDeviceId;
+
+/// Number of threads opening devices.
+const WORKER_COUNT: usize = 2;
+
+/// Message posted to the input thread's window when a probe finishes.
+pub(crate) const WM_PROBE_COMPLETE: u32 = WM_APP + 1;
+
+struct ProbeRequest {
+  device_id: RawInputDeviceId,
+  probe: u64,
+}
+
+/// Outcome of opening a device.
+pub(crate) struct ProbeResult {
+  pub device_id: RawInputDeviceId,
+
+  /// Identifies the arrival that this is the result for, since a device can go away (and its
+  /// handle can be reused) while it's being probed.
+  pub probe: u64,
+
+  pub result: io::Result<OpenedDevice>,
+}
+
+pub(crate) struct DeviceProber {
+  requests: Sender<ProbeRequest>,
+
+  /// Handed over to the workers when they're started.
+  receiver: Option<Receiver<ProbeRequest>>,
+
+  results: Arc<Mutex<Vec<ProbeResult>>>,
+
+  /// Where the device cache lives, if it's enabled. It's loaded when the workers start.
+  cache_path: Option<PathBuf>,
+
+  next_probe: u64,
+}
+
+impl DeviceProber {
+  pub fn new(cache_path: Option<PathBuf>) -> DeviceProber {
+    let (requests, receiver) = channel();
+    DeviceProber {
+      requests,
+      receiver: Some(receiver),
+      results: Arc::new(Mutex::new(Vec::new())),
+      cache_path,
+      next_probe: 0,
+    }
+  }
+
+  /// Start the workers, which notify `hwnd` of their results. Probes requested before this wait
+  /// until it's called.
+  pub fn start(&mut self, hwnd: HWND) {
+    let receiver = match self.receiver.take() {
+      Some(receiver) => Arc::new(Mutex::new(receiver)),
+      None => return,
+    };
+
+    let cache = self
+      .cache_path
+      .take()
+      .map(|path| Arc::new(Mutex::new(DeviceCache::load(path))));
+
+    // Window handles are usable from any thread.
+    let hwnd = hwnd as usize;
+    for i in 0..WORKER_COUNT {
+      let receiver = Arc::clone(&receiver);
+      let results = Arc::clone(&self.results);
+      let cache = cache.clone();
+      std::thread::Builder::new()
+        .name(format!("dhc probe worker {}", i))
+        .spawn(move || run_worker(hwnd as HWND, receiver, results, cache))
+        .expect("failed to spawn probe worker");
+    }
+  }
+
+  /// Start opening a device. Returns an identifier for the probe, which its result carries.
+  pub fn probe(&mut self, device_id: RawInputDeviceId) -> u64 {
+    self.next_probe += 1;
+    let probe = self.next_probe;
+    self
+      .requests
+      .send(ProbeRequest { device_id, probe })
+      .expect("probe workers went away");
+    probe
+  }
+
+  /// Take every probe that has finished.
+  pub fn take_results(&self) -> Vec<ProbeResult> {
+    std::mem::replace(&mut *self.results.lock(), Vec::new())
+  }
+}
+
+fn run_worker(
+  hwnd: HWND,
+  receiver: Arc<Mutex<Receiver<ProbeRequest>>>,
+  results: Arc<Mutex<Vec<ProbeResult>>>,
+  cache: Option<Arc<Mutex<DeviceCache>>>,
+) {
+  loop {
+    let request = match receiver.lock().recv() {
+      Ok(request) => request,
+      Err(_) => return,
+    };
+
+    let result = open_rawinput_device(request.device_id, cache.as_deref());
+    results.lock().push(ProbeResult {
+      device_id: request.device_id,
+      probe: request.probe,
+      result,
+    });
+    unsafe { PostMessageA(hwnd, WM_PROBE_COMPLETE, 0, 0) };
+  }
+}
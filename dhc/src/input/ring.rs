@@ -0,0 +1,145 @@
+use std::cell::UnsafeCell;
+use std::fmt;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+
+/// Bounded single-producer, single-consumer ring buffer.
+///
+/// The producer never blocks: when the ring is full, the new value is dropped and the ring is
+/// marked as having overflowed, which the consumer can observe with `take_overflow`.
+///
+/// The consumer can be shared, so that it can be reached without a lock, but only one thread may
+/// read through it at a time.
+struct RingShared<T> {
+  slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+  mask: usize,
+
+  /// Index of the next slot to be written, only modified by the producer.
+  head: AtomicUsize,
+
+  /// Index of the next slot to be read, only modified by the consumer.
+  tail: AtomicUsize,
+
+  overflowed: AtomicBool,
+}
+
+unsafe impl<T: Send> Sync for RingShared<T> {}
+
+pub struct RingProducer<T> {
+  shared: Arc<RingShared<T>>,
+}
+
+pub struct RingConsumer<T> {
+  shared: Arc<RingShared<T>>,
+}
+
+pub fn ring<T: Copy>(capacity: usize) -> (RingProducer<T>, RingConsumer<T>) {
+  let capacity = capacity.next_power_of_two();
+  let slots = (0..capacity)
+    .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+    .collect::<Vec<_>>()
+    .into_boxed_slice();
+  let shared = Arc::new(RingShared {
+    slots,
+    mask: capacity - 1,
+    head: AtomicUsize::new(0),
+    tail: AtomicUsize::new(0),
+    overflowed: AtomicBool::new(false),
+  });
+  (
+    RingProducer {
+      shared: Arc::clone(&shared),
+    },
+    RingConsumer { shared },
+  )
+}
+
+impl<T: Copy> RingProducer<T> {
+  /// Append a value to the ring, returning false if it was dropped because the ring is full.
+  pub fn push(&mut self, value: T) -> bool {
+    let shared = &*self.shared;
+    let head = shared.head.load(Ordering::Relaxed);
+    let tail = shared.tail.load(Ordering::Acquire);
+    if head.wrapping_sub(tail) == shared.slots.len() {
+      shared.overflowed.store(true, Ordering::Relaxed);
+      return false;
+    }
+
+    unsafe { (*shared.slots[head & shared.mask].get()).as_mut_ptr().write(value) };
+    shared.head.store(head.wrapping_add(1), Ordering::Release);
+    true
+  }
+}
+
+impl<T: Copy> RingConsumer<T> {
+  pub fn capacity(&self) -> usize {
+    self.shared.slots.len()
+  }
+
+  /// Number of values available to be read.
+  pub fn len(&self) -> usize {
+    let shared = &*self.shared;
+    let head = shared.head.load(Ordering::Acquire);
+    let tail = shared.tail.load(Ordering::Relaxed);
+    head.wrapping_sub(tail)
+  }
+
+  pub fn is_empty(&self) -> bool {
+    self.len() == 0
+  }
+
+  /// Copy up to `out.len()` values, starting `offset` values past the oldest one, without
+  /// consuming them. Returns the number of values copied.
+  pub fn peek(&self, offset: usize, out: &mut [T]) -> usize {
+    let shared = &*self.shared;
+    let tail = shared.tail.load(Ordering::Relaxed);
+    let len = self.len();
+    if offset >= len {
+      return 0;
+    }
+
+    let count = std::cmp::min(len - offset, out.len());
+    for (i, value) in out.iter_mut().take(count).enumerate() {
+      let idx = tail.wrapping_add(offset + i) & shared.mask;
+      *value = unsafe { (*shared.slots[idx].get()).as_ptr().read() };
+    }
+    count
+  }
+
+  /// Discard up to `count` of the oldest values, returning the number discarded.
+  pub fn consume(&self, count: usize) -> usize {
+    let shared = &*self.shared;
+    let count = std::cmp::min(count, self.len());
+    let tail = shared.tail.load(Ordering::Relaxed);
+    shared.tail.store(tail.wrapping_add(count), Ordering::Release);
+    count
+  }
+
+  pub fn clear(&self) -> usize {
+    self.shared.overflowed.store(false, Ordering::Relaxed);
+    self.consume(usize::max_value())
+  }
+
+  /// Check whether a value has been dropped since the last call.
+  pub fn take_overflow(&self) -> bool {
+    self.shared.overflowed.swap(false, Ordering::Relaxed)
+  }
+
+  /// Check whether a value has been dropped since the last `take_overflow`, without resetting it.
+  pub fn overflowed(&self) -> bool {
+    self.shared.overflowed.load(Ordering::Relaxed)
+  }
+}
+
+impl<T> fmt::Debug for RingProducer<T> {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    write!(f, "RingProducer({})", self.shared.slots.len())
+  }
+}
+
+impl<T> fmt::Debug for RingConsumer<T> {
+  fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+    write!(f, "RingConsumer({})", self.shared.slots.len())
+  }
+}
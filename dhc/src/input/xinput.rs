@@ -1,10 +1,39 @@
-use winapi::shared::minwindef::MAX_PATH;
+//! XInput devices, which get polled by a thread of their own.
+
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use winapi::shared::minwindef::{DWORD, FALSE, FILETIME, MAX_PATH};
+use winapi::shared::ntdef::{HANDLE, LARGE_INTEGER};
+use winapi::um::processthreadsapi::{GetCurrentThread, GetThreadTimes, SetThreadPriority};
+use winapi::um::synchapi::{
+  CreateEventW, CreateWaitableTimerExW, SetEvent, SetWaitableTimer, WaitForMultipleObjects, WaitForSingleObject,
+};
 use winapi::um::sysinfoapi::GetSystemDirectoryW;
+use winapi::um::winbase::{INFINITE, THREAD_PRIORITY_HIGHEST, WAIT_OBJECT_0};
+use winapi::um::winnt::TIMER_ALL_ACCESS;
 
-use rusty_xinput::XInputHandle;
+use rusty_xinput::{XInputHandle, XInputState};
 
 use crate::input::types::*;
+use crate::input::{device_channel, DeviceDescription, DeviceId, DevicePublisher, EventQueue, RawInputEvent};
 use crate::input::XInputDeviceId;
+use crate::metrics::RealDeviceSlot;
+
+/// Number of XInput user slots.
+const SLOT_COUNT: usize = 4;
+
+/// Not in winapi yet. Supported since Windows 10 1803; older versions fail with it, and get a
+/// regular timer instead.
+const CREATE_WAITABLE_TIMER_HIGH_RESOLUTION: DWORD = 0x0000_0002;
+
+/// Delay before probing an empty slot again, which doubles every time the slot turns out to still
+/// be empty. Probing empty slots is expensive, and raw input tells us when to look right away.
+const PROBE_BACKOFF_MIN: Duration = Duration::from_millis(100);
+const PROBE_BACKOFF_MAX: Duration = Duration::from_secs(5);
+
+/// Interval between poller statistics in the log.
+const STATS_INTERVAL: Duration = Duration::from_secs(10);
 
 lazy_static! {
   static ref XINPUT_HANDLE: XInputHandle = open_xinput();
@@ -26,68 +55,373 @@ fn open_xinput() -> XInputHandle {
   XInputHandle::load(&system).expect("failed to load xinput")
 }
 
-pub fn read_xinput(id: XInputDeviceId) -> Option<DeviceInputs> {
-  if let Ok(state) = (*XINPUT_HANDLE).get_state(id.0 as u32) {
-    let mut inputs = DeviceInputs::default();
-    inputs.button_north.set_value(state.north_button());
-    inputs.button_east.set_value(state.east_button());
-    inputs.button_south.set_value(state.south_button());
-    inputs.button_west.set_value(state.west_button());
-    inputs.button_start.set_value(state.start_button());
-    inputs.button_select.set_value(state.select_button());
-    inputs.button_l1.set_value(state.left_shoulder());
-    inputs.button_r1.set_value(state.right_shoulder());
-    inputs.button_l2.set_value(state.left_trigger_bool());
-    inputs.button_r2.set_value(state.right_trigger_bool());
-    inputs.button_l3.set_value(state.left_thumb_button());
-    inputs.button_r3.set_value(state.right_thumb_button());
-
-    // TODO: Use raw?
-    // These values are in the range [-1, 1], ours are [0, 1].
-    // Also, the Y axis is upside down.
-    let (l_x, l_y) = state.left_stick_normalized();
-    inputs.axis_left_stick_x.set_value((l_x + 1.0) / 2.0);
-    inputs.axis_left_stick_y.set_value((1.0 - l_y) / 2.0);
-
-    let (r_x, r_y) = state.right_stick_normalized();
-    inputs.axis_right_stick_x.set_value((r_x + 1.0) / 2.0);
-    inputs.axis_right_stick_y.set_value((1.0 - r_y) / 2.0);
-
-    // TODO: Forward the analog trigger values as well?
-
-    let mut hat_x = 0;
-    let mut hat_y = 0;
-    if state.arrow_up() {
-      hat_y -= 1;
+fn get_state(id: XInputDeviceId) -> Option<XInputState> {
+  (*XINPUT_HANDLE).get_state(id.0 as u32).ok()
+}
+
+/// Buttons, triggers and left stick, laid out like the start of an XINPUT_GAMEPAD.
+fn state_bytes(state: &XInputState) -> [u8; 8] {
+  let gamepad = &state.raw.Gamepad;
+  let mut bytes = [0u8; 8];
+  bytes[0..2].copy_from_slice(&gamepad.wButtons.to_le_bytes());
+  bytes[2] = gamepad.bLeftTrigger;
+  bytes[3] = gamepad.bRightTrigger;
+  bytes[4..6].copy_from_slice(&gamepad.sThumbLX.to_le_bytes());
+  bytes[6..8].copy_from_slice(&gamepad.sThumbLY.to_le_bytes());
+  bytes
+}
+
+fn to_inputs(state: &XInputState) -> DeviceInputs {
+  let mut inputs = DeviceInputs::default();
+  inputs.button_north.set_value(state.north_button());
+  inputs.button_east.set_value(state.east_button());
+  inputs.button_south.set_value(state.south_button());
+  inputs.button_west.set_value(state.west_button());
+  inputs.button_start.set_value(state.start_button());
+  inputs.button_select.set_value(state.select_button());
+  inputs.button_l1.set_value(state.left_shoulder());
+  inputs.button_r1.set_value(state.right_shoulder());
+  inputs.button_l2.set_value(state.left_trigger_bool());
+  inputs.button_r2.set_value(state.right_trigger_bool());
+  inputs.button_l3.set_value(state.left_thumb_button());
+  inputs.button_r3.set_value(state.right_thumb_button());
+
+  // TODO: Use raw?
+  // These values are in the range [-1, 1], ours are [0, 1].
+  // Also, the Y axis is upside down.
+  let (l_x, l_y) = state.left_stick_normalized();
+  inputs.axis_left_stick_x.set_value((l_x + 1.0) / 2.0);
+  inputs.axis_left_stick_y.set_value((1.0 - l_y) / 2.0);
+
+  let (r_x, r_y) = state.right_stick_normalized();
+  inputs.axis_right_stick_x.set_value((r_x + 1.0) / 2.0);
+  inputs.axis_right_stick_y.set_value((1.0 - r_y) / 2.0);
+
+  // TODO: Forward the analog trigger values as well?
+
+  let mut hat_x = 0;
+  let mut hat_y = 0;
+  if state.arrow_up() {
+    hat_y -= 1;
+  }
+
+  if state.arrow_down() {
+    hat_y += 1;
+  }
+
+  if state.arrow_right() {
+    hat_x += 1;
+  }
+
+  if state.arrow_left() {
+    hat_x -= 1;
+  }
+
+  inputs.hat_dpad = match (hat_x, hat_y) {
+    (-1, -1) => Hat::NorthWest,
+    (-1, 0) => Hat::West,
+    (-1, 1) => Hat::SouthWest,
+    (0, -1) => Hat::North,
+    (0, 0) => Hat::Neutral,
+    (0, 1) => Hat::South,
+    (1, -1) => Hat::NorthEast,
+    (1, 0) => Hat::East,
+    (1, 1) => Hat::SouthEast,
+    _ => panic!("impossible"),
+  };
+
+  inputs
+}
+
+/// A connected XInput device.
+struct ConnectedSlot {
+  publisher: DevicePublisher,
+  metrics: RealDeviceSlot,
+
+  /// Packet number of the last state that we published. XInput only bumps it when something
+  /// changed, so states with the same number are skipped.
+  packet_number: DWORD,
+}
+
+enum Slot {
+  Connected(ConnectedSlot),
+
+  /// An empty slot, along with when to probe it next and how long to wait after that.
+  Empty { next_probe: Instant, backoff: Duration },
+}
+
+impl Slot {
+  fn empty(next_probe: Instant) -> Slot {
+    Slot::Empty {
+      next_probe,
+      backoff: PROBE_BACKOFF_MIN,
     }
+  }
+}
+
+/// Timing of the poller, for the log.
+struct PollerStats {
+  window_start: Instant,
+  cpu_start: u64,
+  polls: u64,
+  changes: u64,
+  total_lateness: Duration,
+  max_lateness: Duration,
+  logged: bool,
+}
 
-    if state.arrow_down() {
-      hat_y += 1;
+impl PollerStats {
+  fn new(now: Instant) -> PollerStats {
+    PollerStats {
+      window_start: now,
+      cpu_start: thread_cpu_time(),
+      polls: 0,
+      changes: 0,
+      total_lateness: Duration::default(),
+      max_lateness: Duration::default(),
+      logged: false,
     }
+  }
+
+  /// Record a poll that happened `lateness` after it was due.
+  fn record(&mut self, lateness: Duration, changes: u64) {
+    self.polls += 1;
+    self.changes += changes;
+    self.total_lateness += lateness;
+    self.max_lateness = self.max_lateness.max(lateness);
+  }
 
-    if state.arrow_right() {
-      hat_x += 1;
+  fn maybe_log(&mut self, now: Instant, interval: Duration) {
+    let elapsed = now - self.window_start;
+    if elapsed < STATS_INTERVAL {
+      return;
     }
 
-    if state.arrow_left() {
-      hat_x -= 1;
+    if self.polls > 0 {
+      let cpu = thread_cpu_time();
+      // CPU time is in 100ns units.
+      let cpu_fraction = (cpu - self.cpu_start) as f64 / (elapsed.as_micros() as f64 * 10.0);
+      let message = format!(
+        "xinput poller: {} polls ({:.0} Hz, target {:.0} Hz), {} changes, lateness mean {:.3} ms max {:.3} ms, \
+         cpu {:.2}%",
+        self.polls,
+        self.polls as f64 / elapsed.as_secs_f64(),
+        1.0 / interval.as_secs_f64(),
+        self.changes,
+        self.total_lateness.as_secs_f64() * 1000.0 / self.polls as f64,
+        self.max_lateness.as_secs_f64() * 1000.0,
+        cpu_fraction * 100.0,
+      );
+
+      // Only the first measurement is interesting at the default log level.
+      if self.logged {
+        debug!("{}", message);
+      } else {
+        info!("{}", message);
+        self.logged = true;
+      }
     }
 
-    inputs.hat_dpad = match (hat_x, hat_y) {
-      (-1, -1) => Hat::NorthWest,
-      (-1, 0) => Hat::West,
-      (-1, 1) => Hat::SouthWest,
-      (0, -1) => Hat::North,
-      (0, 0) => Hat::Neutral,
-      (0, 1) => Hat::South,
-      (1, -1) => Hat::NorthEast,
-      (1, 0) => Hat::East,
-      (1, 1) => Hat::SouthEast,
-      _ => panic!("impossible"),
+    self.reset(now);
+  }
+
+  /// Start a new measurement window.
+  fn reset(&mut self, now: Instant) {
+    *self = PollerStats {
+      logged: self.logged,
+      ..PollerStats::new(now)
     };
+  }
+}
+
+/// CPU time used by the current thread, in 100ns units.
+fn thread_cpu_time() -> u64 {
+  let mut creation: FILETIME = unsafe { std::mem::zeroed() };
+  let mut exit: FILETIME = unsafe { std::mem::zeroed() };
+  let mut kernel: FILETIME = unsafe { std::mem::zeroed() };
+  let mut user: FILETIME = unsafe { std::mem::zeroed() };
+  let rc = unsafe { GetThreadTimes(GetCurrentThread(), &mut creation, &mut exit, &mut kernel, &mut user) };
+  if rc == 0 {
+    return 0;
+  }
+  let ticks = |time: FILETIME| (u64::from(time.dwHighDateTime) << 32) | u64::from(time.dwLowDateTime);
+  ticks(kernel) + ticks(user)
+}
+
+struct Handle(HANDLE);
+
+unsafe impl Send for Handle {}
+unsafe impl Sync for Handle {}
+
+/// Handle to the XInput polling thread.
+pub(crate) struct XInputPoller {
+  /// Auto-reset event that asks the poller to probe every empty slot right away.
+  rescan: Arc<Handle>,
+}
 
-    Some(inputs)
+impl XInputPoller {
+  /// Start polling XInput devices `rate` times a second. Arrivals and removals go into `events`.
+  pub fn spawn(rate: u32, events: Arc<EventQueue>) -> XInputPoller {
+    let rescan = unsafe { CreateEventW(std::ptr::null_mut(), FALSE, FALSE, std::ptr::null()) };
+    assert!(!rescan.is_null(), "failed to create XInput rescan event");
+    let rescan = Arc::new(Handle(rescan));
+
+    let interval = Duration::from_nanos(1_000_000_000 / u64::from(rate.max(1)));
+    let thread_rescan = Arc::clone(&rescan);
+    std::thread::Builder::new()
+      .name("dhc xinput poller".into())
+      .spawn(move || run_poller(interval, &thread_rescan, &events))
+      .expect("failed to spawn XInput poller");
+
+    XInputPoller { rescan }
+  }
+
+  /// Probe the empty slots now, because an XInput device came or went.
+  pub fn request_rescan(&self) {
+    unsafe { SetEvent(self.rescan.0) };
+  }
+}
+
+fn create_timer() -> HANDLE {
+  let timer = unsafe {
+    CreateWaitableTimerExW(
+      std::ptr::null_mut(),
+      std::ptr::null(),
+      CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+      TIMER_ALL_ACCESS,
+    )
+  };
+  if !timer.is_null() {
+    return timer;
+  }
+
+  info!("high resolution timers aren't available, XInput polling will be less precise");
+  let timer = unsafe { CreateWaitableTimerExW(std::ptr::null_mut(), std::ptr::null(), 0, TIMER_ALL_ACCESS) };
+  assert!(!timer.is_null(), "failed to create XInput poll timer");
+  timer
+}
+
+/// Wait until `deadline`, or until a rescan is requested. Returns true for a rescan.
+fn wait_until(timer: HANDLE, rescan: HANDLE, deadline: Instant) -> bool {
+  let now = Instant::now();
+  if deadline > now {
+    // Negative due times are relative, in 100ns units.
+    let mut due: LARGE_INTEGER = unsafe { std::mem::zeroed() };
+    unsafe { *due.QuadPart_mut() = -((deadline - now).as_nanos() as i64 / 100).max(1) };
+    unsafe { SetWaitableTimer(timer, &due, 0, None, std::ptr::null_mut(), FALSE) };
   } else {
-    None
+    // Running behind: just check for a rescan.
+    return unsafe { WaitForSingleObject(rescan, 0) } == WAIT_OBJECT_0;
+  }
+
+  let handles = [timer, rescan];
+  let rc = unsafe { WaitForMultipleObjects(2, handles.as_ptr(), FALSE, INFINITE) };
+  rc == WAIT_OBJECT_0 + 1
+}
+
+fn run_poller(interval: Duration, rescan: &Handle, events: &EventQueue) {
+  unsafe { SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST as i32) };
+  info!("polling XInput devices every {:?}", interval);
+
+  let timer = Handle(create_timer());
+  let now = Instant::now();
+  let mut slots: Vec<Slot> = (0..SLOT_COUNT).map(|_| Slot::empty(now)).collect();
+  let mut stats = PollerStats::new(now);
+  let mut deadline = now;
+  let mut rescan_requested = true;
+
+  loop {
+    let now = Instant::now();
+    let mut changes = 0;
+
+    for (i, slot) in slots.iter_mut().enumerate() {
+      let id = XInputDeviceId(i);
+      match slot {
+        Slot::Connected(connected) => match get_state(id) {
+          Some(state) => {
+            if state.raw.dwPacketNumber != connected.packet_number {
+              connected.packet_number = state.raw.dwPacketNumber;
+              let received = crate::clock::now();
+              let device = crate::flight::device_code(DeviceId::XInput(id));
+              crate::flight::record_reports(received, device, 1, &state_bytes(&state));
+              connected.publisher.notifier.record_reports(1);
+              connected.metrics.record_reports(1, std::mem::size_of_val(&state.raw.Gamepad));
+              connected.publisher.publish(to_inputs(&state), received);
+              changes += 1;
+            }
+          }
+
+          None => {
+            info!("XInputDevice({:?}) left", id);
+            events.push(RawInputEvent::DeviceRemoved(DeviceId::XInput(id)));
+            *slot = Slot::empty(now + PROBE_BACKOFF_MIN);
+          }
+        },
+
+        Slot::Empty { next_probe, backoff } => {
+          if rescan_requested {
+            *next_probe = now;
+            *backoff = PROBE_BACKOFF_MIN;
+          }
+          if now < *next_probe {
+            continue;
+          }
+
+          match get_state(id) {
+            Some(state) => {
+              info!("XInputDevice({:?}) arrived", id);
+              let (mut publisher, subscriber) = device_channel(&events.generation);
+              publisher.publish(to_inputs(&state), crate::clock::now());
+              *slot = Slot::Connected(ConnectedSlot {
+                publisher,
+                metrics: RealDeviceSlot::claim(crate::flight::device_code(DeviceId::XInput(id))),
+                packet_number: state.raw.dwPacketNumber,
+              });
+
+              let description = DeviceDescription {
+                device_id: DeviceId::XInput(id),
+                device_name: format!("{:?}", id),
+              };
+              events.push(RawInputEvent::DeviceArrived(description, subscriber));
+            }
+
+            None => {
+              *next_probe = now + *backoff;
+              *backoff = (*backoff * 2).min(PROBE_BACKOFF_MAX);
+            }
+          }
+        }
+      }
+    }
+    rescan_requested = false;
+
+    let connected = slots.iter().any(|slot| match slot {
+      Slot::Connected(_) => true,
+      Slot::Empty { .. } => false,
+    });
+
+    if connected {
+      stats.record(now.saturating_duration_since(deadline), changes);
+      stats.maybe_log(now, interval);
+
+      deadline += interval;
+      if deadline < now {
+        // We fell more than a whole interval behind, so don't try to catch up.
+        deadline = now + interval;
+      }
+    } else {
+      // Nothing to poll, so sleep until the next probe.
+      deadline = slots
+        .iter()
+        .filter_map(|slot| match slot {
+          Slot::Empty { next_probe, .. } => Some(*next_probe),
+          Slot::Connected(_) => None,
+        })
+        .min()
+        .unwrap_or(now + PROBE_BACKOFF_MAX);
+      stats.reset(now);
+    }
+
+    rescan_requested = wait_until(timer.0, rescan.0, deadline);
   }
 }
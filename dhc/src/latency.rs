@@ -0,0 +1,251 @@
+//! Input latency, from a report arriving on the input thread to the game reading it.
+//!
+//! Every snapshot of a virtual device carries the time that the report it came from arrived. The
+//! first read of each snapshot records its age into that device's histograms; reading the same
+//! snapshot again doesn't count, since it's not new to the game. Each device has a histogram that's
+//! cleared every logging interval, which is what gets logged, and one that covers everything since
+//! startup, which is what LatencyStats reports. Histograms are log-linear, like HdrHistogram's: 16
+//! buckets per power of two, which is good to about 6%.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::clock;
+
+/// Values below this are recorded exactly.
+const SUB_BUCKET_BITS: u32 = 4;
+const SUB_BUCKET_COUNT: usize = 1 << SUB_BUCKET_BITS;
+
+/// Ages are clamped to 2^40 ns, about 18 minutes.
+const MAX_VALUE_BITS: u32 = 40;
+const BUCKET_COUNT: usize = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) as usize * SUB_BUCKET_COUNT;
+
+/// How often statistics get logged.
+const LOG_INTERVAL_SECS: u64 = 10;
+
+fn bucket_index(value: u64) -> usize {
+  let value = value.min((1 << MAX_VALUE_BITS) - 1);
+  if value < SUB_BUCKET_COUNT as u64 {
+    return value as usize;
+  }
+
+  let exponent = 63 - value.leading_zeros();
+  let sub_bucket = (value >> (exponent - SUB_BUCKET_BITS)) as usize & (SUB_BUCKET_COUNT - 1);
+  (exponent - SUB_BUCKET_BITS + 1) as usize * SUB_BUCKET_COUNT + sub_bucket
+}
+
+/// Midpoint of the values that land in a bucket.
+fn bucket_value(index: usize) -> u64 {
+  if index < SUB_BUCKET_COUNT {
+    return index as u64;
+  }
+
+  let shift = (index / SUB_BUCKET_COUNT) as u32 - 1;
+  let lower = ((SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT) as u64) << shift;
+  lower + (1 << shift) / 2
+}
+
+/// Lock-free histogram of nanosecond values.
+struct Histogram {
+  buckets: Box<[AtomicU64]>,
+  count: AtomicU64,
+  max: AtomicU64,
+}
+
+impl Histogram {
+  fn new() -> Histogram {
+    Histogram {
+      buckets: (0..BUCKET_COUNT).map(|_| AtomicU64::new(0)).collect(),
+      count: AtomicU64::new(0),
+      max: AtomicU64::new(0),
+    }
+  }
+
+  fn record(&self, value: u64) {
+    self.buckets[bucket_index(value)].fetch_add(1, Ordering::Relaxed);
+    self.count.fetch_add(1, Ordering::Relaxed);
+    self.max.fetch_max(value, Ordering::Relaxed);
+  }
+
+  /// Forget everything recorded so far. Values recorded while this runs might be partly lost.
+  fn reset(&self) {
+    for bucket in self.buckets.iter() {
+      bucket.store(0, Ordering::Relaxed);
+    }
+    self.count.store(0, Ordering::Relaxed);
+    self.max.store(0, Ordering::Relaxed);
+  }
+
+  /// Value that `quantile` of the recorded values are at or below, approximately.
+  fn quantile(&self, quantile: f64) -> u64 {
+    let count = self.count.load(Ordering::Relaxed);
+    if count == 0 {
+      return 0;
+    }
+
+    let target = ((count as f64 * quantile).ceil() as u64).max(1);
+    let mut seen = 0;
+    for (index, bucket) in self.buckets.iter().enumerate() {
+      seen += bucket.load(Ordering::Relaxed);
+      if seen >= target {
+        return bucket_value(index).min(self.max.load(Ordering::Relaxed));
+      }
+    }
+    self.max.load(Ordering::Relaxed)
+  }
+}
+
+/// Latency statistics for one virtual device. The latencies cover every read since startup, while
+/// the rates cover the last logging interval.
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct LatencyStats {
+  /// Number of reads since startup that saw a new snapshot, each of which contributes to the
+  /// percentiles.
+  pub samples: u64,
+
+  pub p50_us: f64,
+  pub p99_us: f64,
+  pub max_us: f64,
+
+  /// Reads per second by the game, over the last logging interval.
+  pub poll_rate: f64,
+
+  /// Reports per second from the bound device, over the last logging interval.
+  pub report_rate: f64,
+}
+
+struct DeviceLatency {
+  /// Ages recorded during the current logging interval.
+  interval: Histogram,
+
+  /// Ages recorded since startup.
+  total: Histogram,
+
+  /// Arrival time of the last snapshot whose age was recorded.
+  last_seen: AtomicU64,
+  polls: AtomicU64,
+
+  /// Counts at the start of the current logging interval.
+  interval_polls: AtomicU64,
+  interval_reports: AtomicU64,
+
+  /// Rates over the last logging interval, as f64 bits.
+  poll_rate: AtomicU64,
+  report_rate: AtomicU64,
+}
+
+pub struct Latency {
+  devices: Vec<DeviceLatency>,
+
+  /// When the current logging interval started, in clock ticks.
+  interval_start: AtomicU64,
+}
+
+impl Latency {
+  pub fn new(device_count: usize) -> Latency {
+    Latency {
+      devices: (0..device_count)
+        .map(|_| DeviceLatency {
+          interval: Histogram::new(),
+          total: Histogram::new(),
+          last_seen: AtomicU64::new(0),
+          polls: AtomicU64::new(0),
+          interval_polls: AtomicU64::new(0),
+          interval_reports: AtomicU64::new(0),
+          poll_rate: AtomicU64::new(0),
+          report_rate: AtomicU64::new(0),
+        })
+        .collect(),
+      interval_start: AtomicU64::new(clock::now()),
+    }
+  }
+
+  /// Record a read of virtual device `idx`, whose snapshot came from a report that arrived at
+  /// `received`, or 0 if it didn't come from a report at all.
+  pub fn record_read(&self, idx: usize, received: u64) {
+    let device = &self.devices[idx];
+    device.polls.fetch_add(1, Ordering::Relaxed);
+    if received != 0 && device.last_seen.swap(received, Ordering::Relaxed) != received {
+      let age = clock::to_nanos(clock::now().saturating_sub(received));
+      device.interval.record(age);
+      device.total.record(age);
+    }
+  }
+
+  /// Check whether it's time to log, claiming the job for the caller if it is. Returns how long
+  /// the logging interval that just finished was.
+  pub fn log_due(&self, now: u64) -> Option<u64> {
+    let start = self.interval_start.load(Ordering::Relaxed);
+    let elapsed = now.saturating_sub(start);
+    if elapsed < LOG_INTERVAL_SECS * clock::frequency() {
+      return None;
+    }
+    self
+      .interval_start
+      .compare_exchange(start, now, Ordering::Relaxed, Ordering::Relaxed)
+      .ok()
+      .map(|_| elapsed)
+  }
+
+  /// Finish the current logging interval, which started `elapsed` ticks ago, log what happened
+  /// during it, and start the next one.
+  /// `report_counts` holds the total number of reports from each virtual device's bound device.
+  pub fn log(&self, elapsed: u64, report_counts: &[Option<u64>]) {
+    let seconds = elapsed as f64 / clock::frequency() as f64;
+    for (idx, device) in self.devices.iter().enumerate() {
+      let polls = device.polls.load(Ordering::Relaxed);
+      let previous_polls = device.interval_polls.swap(polls, Ordering::Relaxed);
+      let poll_rate = polls.wrapping_sub(previous_polls) as f64 / seconds;
+      device.poll_rate.store(poll_rate.to_bits(), Ordering::Relaxed);
+
+      // Devices come and go, so a count that went backwards belongs to a different device.
+      let report_rate = match report_counts.get(idx).cloned().flatten() {
+        Some(reports) => {
+          let previous = device.interval_reports.swap(reports, Ordering::Relaxed);
+          reports.checked_sub(previous).unwrap_or(reports) as f64 / seconds
+        }
+        None => {
+          device.interval_reports.store(0, Ordering::Relaxed);
+          0.0
+        }
+      };
+      device.report_rate.store(report_rate.to_bits(), Ordering::Relaxed);
+
+      let stats = device.stats(&device.interval);
+      device.interval.reset();
+      if stats.samples == 0 && poll_rate == 0.0 {
+        continue;
+      }
+      info!(
+        "P{}: latency p50 = {:.0} us, p99 = {:.0} us, max = {:.0} us ({} samples), {:.1} polls/s, {:.1} reports/s",
+        idx + 1,
+        stats.p50_us,
+        stats.p99_us,
+        stats.max_us,
+        stats.samples,
+        stats.poll_rate,
+        stats.report_rate
+      );
+    }
+  }
+
+  /// Statistics for virtual device `idx`, with latencies since startup.
+  pub fn stats(&self, idx: usize) -> Option<LatencyStats> {
+    let device = self.devices.get(idx)?;
+    Some(device.stats(&device.total))
+  }
+}
+
+impl DeviceLatency {
+  fn stats(&self, histogram: &Histogram) -> LatencyStats {
+    let us = |ns: u64| ns as f64 / 1000.0;
+    LatencyStats {
+      samples: histogram.count.load(Ordering::Relaxed),
+      p50_us: us(histogram.quantile(0.5)),
+      p99_us: us(histogram.quantile(0.99)),
+      max_us: us(histogram.max.load(Ordering::Relaxed)),
+      poll_rate: f64::from_bits(self.poll_rate.load(Ordering::Relaxed)),
+      report_rate: f64::from_bits(self.report_rate.load(Ordering::Relaxed)),
+    }
+  }
+}
@@ -16,39 +16,85 @@ extern crate winapi;
 use winapi::shared::minwindef::MAX_PATH;
 use winapi::um::libloaderapi::{GetModuleFileNameW, GetModuleHandleW};
 
-use parking_lot::Once;
+use parking_lot::{Mutex, Once, RwLock};
 
+use std::collections::HashMap;
 use std::path::PathBuf;
-use std::sync::RwLock;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use winapi::shared::ntdef::HANDLE;
+use winapi::um::synchapi::SetEvent;
+
+/// Time the rest of the enclosing scope as a span, if dhc is built with the `tracing` feature.
+#[cfg(feature = "tracing")]
+macro_rules! trace_span {
+  ($name:expr) => {
+    let _span = crate::spans::Span::new($name);
+  };
+}
+
+#[cfg(not(feature = "tracing"))]
+macro_rules! trace_span {
+  ($name:expr) => {};
+}
 
 pub mod ffi;
 
 mod config;
 use config::Config;
 
+mod async_log;
+mod clock;
+mod latency;
+pub use latency::LatencyStats;
+pub mod metrics;
+pub mod flight;
 mod logger;
+pub use logger::{AsyncLogBenchmark, LogBenchmark};
+
+mod seqlock;
+use seqlock::SeqLock;
+
+#[cfg(feature = "tracing")]
+mod spans;
+
+mod slotmap;
+use slotmap::{SlotKey, SlotMap};
 
 mod input;
 pub use input::types::*;
+pub use input::RawInputBenchmark;
 
 mod unwind;
 
 static ONCE: Once = Once::new();
 
 lazy_static! {
-  static ref CONFIG_RESULT: std::io::Result<Config> = {
-    let mut path = PathBuf::from(get_executable_path());
-    path.pop();
-    path.push("dhc.toml");
-    Config::read(&path)
-  };
+  static ref CONFIG_RESULT: std::io::Result<Config> = Config::read(config_path("dhc.toml"));
   static ref CONFIG: Config = {
     CONFIG_RESULT
       .as_ref()
       .expect("failed to open or create configuration file")
       .clone()
   };
-  static ref CONTEXT: Context = { Context::new(CONFIG.device_count, CONFIG.mode == config::EmulationMode::XInput) };
+  static ref CONTEXT: Context = {
+    Context::new(
+      CONFIG.device_count(),
+      CONFIG.mode == config::EmulationMode::XInput,
+      input::Options {
+        lazy_decode: CONFIG.lazy_decode,
+        backend: CONFIG.backend,
+        xinput_poll_rate: CONFIG.xinput_poll_rate,
+        device_cache: if CONFIG.device_cache {
+          Some(config_path("dhc_devices.toml"))
+        } else {
+          None
+        },
+      },
+    )
+  };
 }
 
 fn get_executable_path() -> String {
@@ -62,133 +108,338 @@ fn get_executable_path() -> String {
   String::from_utf16(&path).expect("executable path isn't UTF-16?")
 }
 
+/// Path of a file that lives next to the executable.
+fn config_path(filename: &str) -> PathBuf {
+  let mut path = PathBuf::from(get_executable_path());
+  path.pop();
+  path.push(filename);
+  path
+}
+
+/// How long each part of initialization took.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct StartupTimes {
+  /// Time spent in the first call to init, which is all that the game waits for.
+  pub first_call: Option<Duration>,
+
+  /// Time from the first call to init until the background initialization finished.
+  pub background: Option<Duration>,
+}
+
+lazy_static! {
+  static ref STARTUP_TIMES: Mutex<StartupTimes> = Mutex::new(StartupTimes::default());
+}
+
+pub fn startup_times() -> StartupTimes {
+  *STARTUP_TIMES.lock()
+}
+
+/// Initialize dhc.
+///
+/// Games call this from inside DirectInput8Create and XInputGetState, often on their main thread
+/// while they're booting, so only the configuration (which decides the device count and mode) is
+/// read here. Setting up logging and the input thread is left to a background thread.
 pub fn init() {
   ONCE.call_once(|| {
-    logger::init(&CONFIG);
+    let start = Instant::now();
+    lazy_static::initialize(&CONFIG);
+
+    // The background thread can finish before we get to record how long we took, so it's handed
+    // our time instead of reading it from STARTUP_TIMES.
+    let (first_call_tx, first_call_rx) = std::sync::mpsc::channel();
+    let spawned = std::thread::Builder::new()
+      .name("dhc init".to_string())
+      .spawn(move || init_background(start, Some(first_call_rx)));
+    if spawned.is_err() {
+      init_background(start, None);
+    }
 
-    info!(
-      "dhc {} ({}) initialized",
-      env!("VERGEN_GIT_SEMVER"),
-      env!("VERGEN_GIT_COMMIT_DATE")
+    let first_call = start.elapsed();
+    STARTUP_TIMES.lock().first_call = Some(first_call);
+    let _ = first_call_tx.send(first_call);
+  });
+}
+
+/// `first_call` delivers the time spent in the first call to init, once it has returned. Without
+/// it, we're running inside that call.
+fn init_background(start: Instant, first_call: Option<std::sync::mpsc::Receiver<Duration>>) {
+  logger::init(&CONFIG);
+
+  info!(
+    "dhc {} ({}) initialized",
+    env!("VERGEN_GIT_SEMVER"),
+    env!("VERGEN_GIT_COMMIT_DATE")
+  );
+
+  // We need to wait until the logger has been initialized to warn about this.
+  if let Err(ref error) = *CONFIG_RESULT {
+    warn!("failed to read config: {}", error);
+    warn!("falling back to default configuration");
+  }
+  if CONFIG.device_count > config::MAX_DEVICE_COUNT {
+    warn!(
+      "device_count {} is too large, only emulating {} devices",
+      CONFIG.device_count,
+      config::MAX_DEVICE_COUNT
     );
+  }
+
+  // Create the shared metrics before there are any devices, so that they can be watched from the
+  // start.
+  metrics::block();
+
+  // Devices only start showing up once their types have been registered, so everything that
+  // they log goes to the logger that we just set up.
+  Context::instance().register_device_types();
+
+  let background = start.elapsed();
+  STARTUP_TIMES.lock().background = Some(background);
+  let first_call = first_call.and_then(|rx| rx.recv().ok()).unwrap_or(background);
+  info!(
+    "startup took {} us in the first call, {} us in total",
+    first_call.as_micros(),
+    background.as_micros()
+  );
+}
+
+/// Buffered events of a real device, along with what the game has to rearm once it reads them.
+struct DeviceEvents {
+  ring: input::RingConsumer<InputEvent>,
+  notifier: Arc<input::DeviceNotifier>,
+}
+
+/// Lock-free handle on the buffered events of whatever a virtual device is bound to.
+///
+/// Only the thread holding the state lock changes the binding, and it waits for readers that
+/// might still be looking at the old events before letting go of them. Readers never wait.
+#[derive(Default)]
+struct EventSlot {
+  /// From `Arc::into_raw`, or null while the virtual device is unbound.
+  events: AtomicPtr<DeviceEvents>,
+
+  /// Number of readers that might be looking at `events`.
+  readers: AtomicUsize,
+}
 
-    // We need to wait until the logger has been initialized to warn about this.
-    if let Err(ref error) = *CONFIG_RESULT {
-      warn!("failed to read config: {}", error);
-      warn!("falling back to default configuration");
+impl EventSlot {
+  /// Run `f` on the bound device's events, if there is one. Only one thread may read a virtual
+  /// device's events at a time, which DirectInput requires of games anyway.
+  fn with<R>(&self, f: impl FnOnce(&DeviceEvents) -> R) -> Option<R> {
+    self.readers.fetch_add(1, Ordering::SeqCst);
+    let ptr = self.events.load(Ordering::SeqCst);
+    let result = if ptr.is_null() { None } else { Some(f(unsafe { &*ptr })) };
+    self.readers.fetch_sub(1, Ordering::Release);
+    result
+  }
+
+  /// Point the slot at another device's events. Must only be called with the state lock held.
+  fn set(&self, events: Option<Arc<DeviceEvents>>) {
+    let new = events.map_or(std::ptr::null_mut(), |events| Arc::into_raw(events) as *mut _);
+    let old = self.events.swap(new, Ordering::SeqCst);
+    if !old.is_null() {
+      // Anyone who could have loaded the old pointer registered as a reader before we swapped it.
+      while self.readers.load(Ordering::Acquire) != 0 {
+        std::hint::spin_loop();
+      }
+      unsafe { drop(Arc::from_raw(old)) };
     }
-  });
+  }
 }
 
-#[derive(Clone, Default)]
+impl Drop for EventSlot {
+  fn drop(&mut self) {
+    self.set(None);
+  }
+}
+
+#[derive(Default)]
 struct VirtualDeviceState {
   inputs: DeviceInputs,
-  binding: Option<input::DeviceId>,
+  xinput: XInputState,
+
+  /// When the report that the inputs came from arrived, or 0.
+  received: u64,
+
+  /// Handle of the bound real device. Stale handles are caught by the slot map.
+  binding: Option<SlotKey>,
+
+  /// Event handle registered with SetEventNotification, or 0.
+  event: usize,
+
+  /// Notifier of the bound real device.
+  notifier: Option<Arc<input::DeviceNotifier>>,
+
+  /// Buffered events of the bound real device, shared with Context so that reads don't lock.
+  events: Arc<EventSlot>,
+}
+
+impl VirtualDeviceState {
+  fn set_inputs(&mut self, inputs: DeviceInputs, xinput: XInputGamepad, received: u64) {
+    self.inputs = inputs;
+    self.received = received;
+
+    // Games use the packet number to tell whether anything changed, so only bump it when it did.
+    if self.xinput.gamepad != xinput {
+      self.xinput.gamepad = xinput;
+      self.xinput.packet_number = self.xinput.packet_number.wrapping_add(1);
+    }
+  }
+
+  /// Signal the registered event handle, for state changes that don't come from the input thread.
+  fn signal(&self) {
+    if self.event != 0 {
+      unsafe { SetEvent(self.event as HANDLE) };
+    }
+  }
 }
 
 struct VirtualDeviceId(usize);
 
+/// Publish a binding (or its end) to the shared metrics.
+fn set_binding_metrics(vdev_idx: usize, device: u64, bound: bool) {
+  if let Some(vdev) = metrics::virtual_device(vdev_idx) {
+    vdev.bound_device.store(if bound { device } else { 0 }, Ordering::Relaxed);
+  }
+  if let Some(rdev) = metrics::find_real_device(device) {
+    let bound_to = if bound { vdev_idx as u32 + 1 } else { 0 };
+    rdev.bound_to.store(bound_to, Ordering::Relaxed);
+  }
+}
+
 struct RealDeviceState {
   id: input::DeviceId,
   name: String,
-  buffer: triple_buffer::Output<DeviceInputs>,
+  buffer: triple_buffer::Output<input::PublishedInputs>,
+  events: Arc<DeviceEvents>,
+  notifier: Arc<input::DeviceNotifier>,
+  decoder: Option<input::LazyDecoder>,
   binding: Option<VirtualDeviceId>,
 }
 
 struct State {
   virtual_devices: Vec<VirtualDeviceState>,
-  real_devices: Vec<RealDeviceState>,
-}
+  real_devices: SlotMap<RealDeviceState>,
 
-fn find_real_device(real_devices: &[RealDeviceState], id: input::DeviceId) -> Option<usize> {
-  for (idx, device) in real_devices.iter().enumerate() {
-    if device.id == id {
-      return Some(idx);
-    }
-  }
-  None
+  /// Handles of the real devices, by their input ID.
+  real_device_keys: HashMap<input::DeviceId, SlotKey>,
+
+  /// Real devices that aren't bound to anything, oldest first.
+  unbound: Vec<SlotKey>,
+
+  /// Number of virtual devices without a binding.
+  unbound_virtual: usize,
 }
 
 impl State {
   fn new(device_count: usize) -> State {
     State {
-      virtual_devices: vec![VirtualDeviceState::default(); device_count],
-      real_devices: Vec::new(),
+      virtual_devices: (0..device_count).map(|_| VirtualDeviceState::default()).collect(),
+      real_devices: SlotMap::new(),
+      real_device_keys: HashMap::new(),
+      unbound: Vec::new(),
+      unbound_virtual: device_count,
     }
   }
 
-  fn bind_devices(&mut self) {
-    let State {
-      ref mut virtual_devices,
-      ref mut real_devices,
-    } = *self;
-
-    // Bind any unbound virtual devices.
-    for (vdev_idx, vdev) in virtual_devices.iter_mut().enumerate() {
-      if vdev.binding.is_some() {
-        continue;
+  /// Take the newest real device that isn't bound to anything.
+  fn pop_unbound(&mut self) -> Option<SlotKey> {
+    while let Some(key) = self.unbound.pop() {
+      if self.real_devices.get(key).map_or(false, |rdev| rdev.binding.is_none()) {
+        return Some(key);
       }
+    }
+    None
+  }
 
-      // Iterate over real devices in reverse order to bind the newest device first.
-      let mut bound = false;
-      for rdev in real_devices.iter_mut().rev() {
-        if rdev.binding.is_some() {
-          continue;
-        }
-
-        info!("Binding virtual device {} to {} ({:?})", vdev_idx, rdev.name, rdev.id);
-        vdev.binding = Some(rdev.id);
-        rdev.binding = Some(VirtualDeviceId(vdev_idx));
-        bound = true;
+  fn bind_devices(&mut self) {
+    // Bind any unbound virtual devices, in order, to the newest real devices first.
+    for vdev_idx in 0..self.virtual_devices.len() {
+      if self.unbound_virtual == 0 {
         break;
       }
+      if self.virtual_devices[vdev_idx].binding.is_some() {
+        continue;
+      }
 
-      if !bound {
+      let key = match self.pop_unbound() {
+        Some(key) => key,
         // We're out of devices to try to bind.
-        break;
-      }
+        None => break,
+      };
+
+      let vdev = &mut self.virtual_devices[vdev_idx];
+      let rdev = self.real_devices.get_mut(key).unwrap();
+      info!("Binding virtual device {} to {} ({:?})", vdev_idx, rdev.name, rdev.id);
+      let device = flight::device_code(rdev.id);
+      flight::record(flight::EventKind::Bound, vdev_idx as u32, device, 0);
+      set_binding_metrics(vdev_idx, device, true);
+
+      // Don't hand out buffered events from before the device was bound.
+      rdev.events.ring.clear();
+      vdev.events.set(Some(Arc::clone(&rdev.events)));
+
+      vdev.binding = Some(key);
+      rdev.binding = Some(VirtualDeviceId(vdev_idx));
+      rdev.notifier.set_handle(vdev.event as HANDLE);
+      vdev.notifier = Some(Arc::clone(&rdev.notifier));
+      vdev.signal();
+      self.unbound_virtual -= 1;
     }
   }
 
-  fn unbind_device(&mut self, real_device_idx: usize) {
-    let State {
-      ref mut virtual_devices,
-      ref mut real_devices,
-    } = *self;
-
-    let rdev = &mut real_devices[real_device_idx];
-    if let Some(VirtualDeviceId(vdev_idx)) = rdev.binding {
-      let vdev = &mut virtual_devices[vdev_idx];
-      assert_eq!(Some(rdev.id), vdev.binding);
+  fn unbind_device(&mut self, key: SlotKey) {
+    let rdev = self.real_devices.get_mut(key).unwrap();
+    if let Some(VirtualDeviceId(vdev_idx)) = rdev.binding.take() {
+      let vdev = &mut self.virtual_devices[vdev_idx];
+      assert_eq!(Some(key), vdev.binding);
       info!(
         "Unbinding virtual device {} from {} ({:?})",
         vdev_idx, rdev.name, rdev.id
       );
+      let device = flight::device_code(rdev.id);
+      flight::record(flight::EventKind::Unbound, vdev_idx as u32, device, 0);
+      set_binding_metrics(vdev_idx, device, false);
       vdev.binding = None;
-      rdev.binding = None;
-      vdev.inputs = DeviceInputs::default();
+      vdev.events.set(None);
+      rdev.notifier.set_handle(std::ptr::null_mut());
+      vdev.notifier = None;
+      vdev.set_inputs(DeviceInputs::default(), XInputGamepad::default(), 0);
+      vdev.signal();
+      self.unbound_virtual += 1;
     }
   }
 
-  fn add_device(&mut self, id: input::DeviceId, name: String, buffer: triple_buffer::Output<DeviceInputs>) {
+  fn add_device(&mut self, id: input::DeviceId, name: String, subscriber: input::DeviceSubscriber) {
     info!("Device arrived: {} ({:?})", name, id);
-    self.real_devices.push(RealDeviceState {
+    flight::record(flight::EventKind::DeviceArrived, 0, flight::device_code(id), 0);
+    let key = self.real_devices.insert(RealDeviceState {
       id,
       name,
-      buffer,
+      buffer: subscriber.buffer,
+      events: Arc::new(DeviceEvents {
+        ring: subscriber.events,
+        notifier: Arc::clone(&subscriber.notifier),
+      }),
+      notifier: subscriber.notifier,
+      decoder: subscriber.decoder,
       binding: None,
     });
+    self.real_device_keys.insert(id, key);
+    self.unbound.push(key);
     self.bind_devices();
   }
 
   fn remove_device(&mut self, id: input::DeviceId) {
-    let real_device_idx = find_real_device(&self.real_devices, id).unwrap();
-    self.unbind_device(real_device_idx);
+    let key = self.real_device_keys.remove(&id).unwrap();
+    if self.real_devices.get(key).unwrap().binding.is_none() {
+      self.unbound.retain(|&unbound| unbound != key);
+    }
+    self.unbind_device(key);
 
-    let device_name = &self.real_devices[real_device_idx].name;
-    info!("Device removed: {} ({:?})", device_name, id);
+    let rdev = self.real_devices.remove(key).unwrap();
+    info!("Device removed: {} ({:?})", rdev.name, id);
+    flight::record(flight::EventKind::DeviceRemoved, 0, flight::device_code(id), 0);
 
-    self.real_devices.remove(real_device_idx);
     self.bind_devices();
   }
 
@@ -196,33 +447,187 @@ impl State {
     let State {
       ref mut virtual_devices,
       ref mut real_devices,
+      ..
     } = *self;
 
-    for mut vdev in virtual_devices.iter_mut() {
-      if let Some(rdev_id) = vdev.binding {
-        let real_device_idx = find_real_device(&real_devices, rdev_id).unwrap();
-        let rdev = &mut real_devices[real_device_idx];
-        vdev.inputs = *rdev.buffer.read();
+    for vdev in virtual_devices.iter_mut() {
+      let rdev = match vdev.binding.and_then(|key| real_devices.get_mut(key)) {
+        Some(rdev) => rdev,
+        None => continue,
+      };
+
+      if let Some(decoder) = &mut rdev.decoder {
+        decoder.poll();
+      }
+
+      let published = rdev.buffer.read();
+      vdev.set_inputs(published.inputs, published.xinput, published.received);
+
+      // The game is picking up the latest state, so let the input thread notify it again.
+      rdev.notifier.rearm();
+    }
+  }
+}
+
+impl State {
+  /// Check that bindings agree with each other, and that devices are bound whenever they can be.
+  fn check_bindings(&self) -> Result<(), String> {
+    let mut bound = 0;
+    for (vdev_idx, vdev) in self.virtual_devices.iter().enumerate() {
+      if let Some(key) = vdev.binding {
+        let rdev = self
+          .real_devices
+          .get(key)
+          .ok_or_else(|| format!("virtual device {} is bound to a removed device", vdev_idx))?;
+        match rdev.binding {
+          Some(VirtualDeviceId(idx)) if idx == vdev_idx => bound += 1,
+          _ => return Err(format!("{:?} isn't bound back to virtual device {}", rdev.id, vdev_idx)),
+        }
       }
     }
+
+    if self.unbound_virtual != self.virtual_devices.len() - bound {
+      return Err(format!(
+        "{} virtual devices are unbound, but {} were counted",
+        self.virtual_devices.len() - bound,
+        self.unbound_virtual
+      ));
+    }
+
+    let real_count = self.real_device_keys.len();
+    if bound != real_count.min(self.virtual_devices.len()) {
+      return Err(format!("{} of {} real devices are bound", bound, real_count));
+    }
+    Ok(())
+  }
+}
+
+/// Add and remove devices at random `iterations` times, with `device_count` virtual devices and up
+/// to twice as many real ones, checking the bindings after every change.
+pub fn stress_hotplug(device_count: usize, iterations: usize) -> Result<Duration, String> {
+  let mut state = State::new(device_count);
+  let mut connected = vec![false; device_count * 2];
+
+  // xorshift, so that runs are reproducible.
+  let mut rng = 0x2545_f491_4f6c_dd1du64;
+  let start = Instant::now();
+  for _ in 0..iterations {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    let idx = (rng % connected.len() as u64) as usize;
+    let id = input::DeviceId::XInput(input::XInputDeviceId(idx));
+    if connected[idx] {
+      state.remove_device(id);
+    } else {
+      state.add_device(id, format!("stress device {}", idx), input::unconnected_subscriber());
+    }
+    connected[idx] = !connected[idx];
+
+    state.update();
+    state.check_bindings()?;
+  }
+  Ok(start.elapsed())
+}
+
+/// Measure the per-call cost of disabled log statements. Must be called before `init`.
+pub fn benchmark_logging(iterations: u32) -> LogBenchmark {
+  logger::benchmark(iterations)
+}
+
+/// Measure how long logging a line holds up the caller, with and without asynchronous logging.
+pub fn benchmark_async_logging(iterations: u32) -> std::io::Result<AsyncLogBenchmark> {
+  logger::benchmark_async(iterations)
+}
+
+/// Per-report cost of decoding reports through a report plan and through the native parsers, in
+/// nanoseconds.
+pub fn benchmark_decode(iterations: u32) -> Vec<(&'static str, f64)> {
+  input::benchmark_decode(iterations)
+}
+
+/// Compare reading raw input a message at a time against draining it with GetRawInputBuffer.
+pub fn benchmark_raw_input(batch_size: usize, iterations: usize) -> std::io::Result<RawInputBenchmark> {
+  input::benchmark_raw_input(batch_size, iterations)
+}
+
+/// Time `iterations` updates with `device_count` virtual devices, each bound to a real device
+/// that never sends anything.
+pub fn benchmark_update(device_count: usize, iterations: usize) -> Duration {
+  let mut state = State::new(device_count);
+  for i in 0..device_count {
+    let id = input::DeviceId::XInput(input::XInputDeviceId(i));
+    state.add_device(id, format!("benchmark device {}", i), input::unconnected_subscriber());
+  }
+
+  let start = Instant::now();
+  for _ in 0..iterations {
+    state.update();
+  }
+  start.elapsed()
+}
+
+/// Snapshot of a virtual device, along with when the report that it came from arrived.
+#[derive(Clone, Copy, Default)]
+struct Stamped<T> {
+  value: T,
+  received: u64,
+}
+
+impl<T> Stamped<T> {
+  fn new(value: T, received: u64) -> Stamped<T> {
+    Stamped { value, received }
+  }
+
+  fn received(&self) -> u64 {
+    self.received
   }
 }
 
 pub struct Context {
   input: input::Context,
+
+  /// Bindings between real and virtual devices. Only taken by update and other slow paths.
   state: RwLock<State>,
+
+  /// Latest inputs of each virtual device, published by update and read without locking.
+  snapshots: Vec<SeqLock<Stamped<DeviceInputs>>>,
+
+  /// Same as `snapshots`, pre-rendered for XInputGetState.
+  xinput_snapshots: Vec<SeqLock<Stamped<XInputState>>>,
+
+  /// Buffered events of each virtual device's binding, for GetDeviceData to read without locking.
+  events: Vec<Arc<EventSlot>>,
+
+  /// How old snapshots are when the game reads them.
+  latency: latency::Latency,
+
+  /// Input generation that the snapshots are up to date with.
+  generation: AtomicUsize,
+
   device_count: usize,
   xinput_enabled: bool,
 }
 
 impl Context {
-  fn new(device_count: usize, xinput_enabled: bool) -> Context {
-    let ctx = input::Context::new();
-    ctx.register_device_type(input::RawInputDeviceType::Joystick);
-    ctx.register_device_type(input::RawInputDeviceType::GamePad);
+  fn new(device_count: usize, xinput_enabled: bool, options: input::Options) -> Context {
+    let ctx = input::Context::new(options);
+    let generation = ctx.generation().wrapping_sub(1);
+    let state = State::new(device_count);
+    let events = state.virtual_devices.iter().map(|vdev| Arc::clone(&vdev.events)).collect();
     Context {
       input: ctx,
-      state: RwLock::new(State::new(device_count)),
+      state: RwLock::new(state),
+      snapshots: (0..device_count)
+        .map(|_| SeqLock::new(Stamped::default()))
+        .collect(),
+      xinput_snapshots: (0..device_count)
+        .map(|_| SeqLock::new(Stamped::default()))
+        .collect(),
+      events,
+      latency: latency::Latency::new(device_count),
+      generation: AtomicUsize::new(generation),
       device_count,
       xinput_enabled,
     }
@@ -232,6 +637,11 @@ impl Context {
     &CONTEXT
   }
 
+  fn register_device_types(&self) {
+    self.input.register_device_type(input::RawInputDeviceType::Joystick);
+    self.input.register_device_type(input::RawInputDeviceType::GamePad);
+  }
+
   pub fn device_count(&self) -> usize {
     self.device_count
   }
@@ -242,20 +652,84 @@ impl Context {
 
   pub fn device_state(&self, idx: usize) -> DeviceInputs {
     trace!("Context::device_state({})", idx);
-    let state = self.state.read().unwrap();
-    state.virtual_devices[idx].inputs
+    flight::record(flight::EventKind::Poll, idx as u32, 0, 0);
+    if let Some(metrics) = metrics::virtual_device(idx) {
+      metrics.polls.fetch_add(1, Ordering::Relaxed);
+    }
+    let snapshot = self.snapshots[idx].read();
+    self.latency.record_read(idx, snapshot.received());
+    snapshot.value
+  }
+
+  pub fn xinput_state(&self, idx: usize) -> XInputState {
+    flight::record(flight::EventKind::XInputPoll, idx as u32, 0, 0);
+    if let Some(metrics) = metrics::virtual_device(idx) {
+      metrics.xinput_polls.fetch_add(1, Ordering::Relaxed);
+    }
+    let snapshot = self.xinput_snapshots[idx].read();
+    self.latency.record_read(idx, snapshot.received());
+    snapshot.value
+  }
+
+  pub fn latency_stats(&self, idx: usize) -> Option<LatencyStats> {
+    self.latency.stats(idx)
+  }
+
+  fn log_latency(&self, elapsed: u64) {
+    let report_counts: Vec<Option<u64>> = {
+      let state = self.state.read();
+      state
+        .virtual_devices
+        .iter()
+        .map(|vdev| vdev.notifier.as_ref().map(|notifier| notifier.report_count()))
+        .collect()
+    };
+    self.latency.log(elapsed, &report_counts);
+  }
+
+  /// Register an event handle to be signalled when a virtual device's state changes, or null to
+  /// unregister it.
+  pub fn set_event_notification(&self, idx: usize, handle: HANDLE) {
+    let mut state = self.state.write();
+    let vdev = &mut state.virtual_devices[idx];
+    vdev.event = handle as usize;
+    if let Some(notifier) = &vdev.notifier {
+      notifier.set_handle(handle);
+    }
   }
 
   pub fn update(&self) {
     trace!("Context::update()");
-    let mut state = self.state.write().unwrap();
+    trace_span!("Context::update");
+
+    let now = clock::now();
+    if let Some(elapsed) = self.latency.log_due(now) {
+      self.log_latency(elapsed);
+    }
+
+    // Games call this once per device per frame (or more), but it only has work to do when the
+    // input thread has published something since the last update.
+    let generation = self.input.generation();
+    if generation == self.generation.load(Ordering::Acquire) {
+      return;
+    }
+
+    // Our caller is about to read the snapshots, so they have to be at least as fresh as the
+    // generation we saw, even if someone else holds the lock. Whoever held it may have already
+    // done the work for us, though.
+    let mut state = self.state.write();
+    let generation = self.input.generation();
+    if generation == self.generation.load(Ordering::Acquire) {
+      return;
+    }
+    let update_start = clock::now();
 
     // Check for new devices.
     let events = self.input.get_events();
     for event in events {
       match event {
-        input::RawInputEvent::DeviceArrived(description, buffer) => {
-          state.add_device(description.device_id, description.device_name, buffer);
+        input::RawInputEvent::DeviceArrived(description, subscriber) => {
+          state.add_device(description.device_id, description.device_name, subscriber);
         }
 
         input::RawInputEvent::DeviceRemoved(id) => {
@@ -265,10 +739,68 @@ impl Context {
     }
 
     state.update();
+
+    // We're the only writer, since we're holding the state lock.
+    for (idx, vdev) in state.virtual_devices.iter().enumerate() {
+      self.snapshots[idx].write(Stamped::new(vdev.inputs, vdev.received));
+      self.xinput_snapshots[idx].write(Stamped::new(vdev.xinput, vdev.received));
+    }
+
+    // Anything published after we read the generation will bump it again, so it's safe to
+    // record the value from before we started.
+    self.generation.store(generation, Ordering::Release);
+    metrics::block().update.record_since(update_start);
+  }
+
+  /// Run `f` on the buffered events of the real device bound to a virtual device, if any, without
+  /// taking any locks.
+  fn with_device_events<R, F>(&self, idx: usize, f: F) -> Option<R>
+  where
+    F: FnOnce(&input::RingConsumer<InputEvent>) -> R,
+  {
+    self.events[idx].with(|events| {
+      events.notifier.rearm();
+      f(&events.ring)
+    })
+  }
+
+  /// Number of buffered events that are available for a virtual device.
+  pub fn device_event_count(&self, idx: usize) -> usize {
+    self.with_device_events(idx, |events| events.len()).unwrap_or(0)
+  }
+
+  /// Copy buffered events for a virtual device, starting `offset` events past the oldest, without
+  /// consuming them.
+  pub fn peek_device_events(&self, idx: usize, offset: usize, out: &mut [InputEvent]) -> usize {
+    self
+      .with_device_events(idx, |events| events.peek(offset, out))
+      .unwrap_or(0)
+  }
+
+  /// Discard up to `count` of the oldest buffered events for a virtual device.
+  pub fn consume_device_events(&self, idx: usize, count: usize) -> usize {
+    self
+      .with_device_events(idx, |events| events.consume(count))
+      .unwrap_or(0)
+  }
+
+  /// Check whether buffered events for a virtual device were dropped since the last call.
+  pub fn take_device_events_overflow(&self, idx: usize) -> bool {
+    self
+      .with_device_events(idx, |events| events.take_overflow())
+      .unwrap_or(false)
+  }
+
+  /// Check whether buffered events for a virtual device were dropped, without resetting the flag.
+  pub fn device_events_overflowed(&self, idx: usize) -> bool {
+    self
+      .with_device_events(idx, |events| events.overflowed())
+      .unwrap_or(false)
   }
 }
 
 pub(crate) fn mangle_inputs(inputs: &mut DeviceInputs) {
+  trace_span!("mangle_inputs");
   if CONFIG.dpad_override {
     if inputs.get_hat(HatType::DPad) != Hat::Neutral {
       inputs.axis_left_stick_x.set_value(0.5);
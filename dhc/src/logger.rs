@@ -1,8 +1,20 @@
 use serde::{Deserialize, Deserializer, Serialize, Serializer};
+use winapi::shared::minwindef::FILETIME;
 use winapi::um::consoleapi::AllocConsole;
+use winapi::um::fileapi::FileTimeToLocalFileTime;
+use winapi::um::minwinbase::SYSTEMTIME;
+use winapi::um::sysinfoapi::GetSystemTimeAsFileTime;
+use winapi::um::timezoneapi::FileTimeToSystemTime;
 
+use crate::async_log::{AsyncDrain, AsyncFlusher};
 use crate::config::Config;
 
+use std::cell::Cell;
+use std::fs::File;
+use std::io;
+use std::sync::atomic::{AtomicI32, Ordering};
+use std::time::{Duration, Instant};
+
 use parking_lot::Mutex;
 
 use slog::o;
@@ -77,34 +89,267 @@ impl<'de> Deserialize<'de> for LogLevel {
   }
 }
 
+/// Level below which nothing is logged, as seen by the C++ side: one past Fatal until the logger is
+/// initialized.
+static MIN_LEVEL: AtomicI32 = AtomicI32::new(LogLevel::Fatal as i32 + 1);
+
+/// Copies of MIN_LEVEL living in the DLLs that use dhc, so that their disabled log statements
+/// don't have to call in here to find out that they're disabled.
+static LEVEL_CACHES: Mutex<Vec<LevelCache>> = parking_lot::const_mutex(Vec::new());
+
+/// Pointer to a copy of the minimum log level, which stays valid until it's unregistered.
+#[derive(PartialEq)]
+pub(crate) struct LevelCache(pub *const AtomicI32);
+
+unsafe impl Send for LevelCache {}
+
+/// Register a copy of the minimum log level to keep up to date, until `unregister_level_cache`.
+pub(crate) unsafe fn register_level_cache(cache: LevelCache) {
+  let mut caches = LEVEL_CACHES.lock();
+  (*cache.0).store(MIN_LEVEL.load(Ordering::Relaxed), Ordering::Relaxed);
+  caches.push(cache);
+}
+
+pub(crate) fn unregister_level_cache(cache: LevelCache) {
+  LEVEL_CACHES.lock().retain(|registered| *registered != cache);
+}
+
+fn set_min_level(level: LogLevel) {
+  let caches = LEVEL_CACHES.lock();
+  MIN_LEVEL.store(level as i32, Ordering::Relaxed);
+  for cache in caches.iter() {
+    unsafe { (*cache.0).store(level as i32, Ordering::Relaxed) };
+  }
+}
+
 lazy_static! {
   static ref LOGGER: Mutex<Option<slog_scope::GlobalLoggerGuard>> = Mutex::new(None);
 }
 
+/// Way to write out records that are still queued, when logging asynchronously.
+static ASYNC_FLUSHER: Mutex<Option<AsyncFlusher>> = parking_lot::const_mutex(None);
+
+/// Number of records that can be waiting to be written when logging asynchronously.
+const ASYNC_LOG_CAPACITY: usize = 4096;
+
+/// How long `flush` waits for the log writer to finish the batch it's in the middle of.
+const FLUSH_TIMEOUT: Duration = Duration::from_millis(100);
+
+/// Write out anything that's been logged but not written yet, before the process goes away.
+pub fn flush() {
+  // Clone the handle, so that a flush that gives up doesn't keep the lock held.
+  let flusher = ASYNC_FLUSHER.lock().clone();
+  if let Some(flusher) = flusher {
+    flusher.flush(FLUSH_TIMEOUT);
+  }
+}
+
+thread_local! {
+  /// Time to stamp the record being formatted with, if it isn't now.
+  static TIMESTAMP: Cell<Option<u64>> = Cell::new(None);
+}
+
+/// Current time, as a FILETIME.
+pub(crate) fn current_timestamp() -> u64 {
+  let mut time: FILETIME = unsafe { std::mem::zeroed() };
+  unsafe { GetSystemTimeAsFileTime(&mut time) };
+  (u64::from(time.dwHighDateTime) << 32) | u64::from(time.dwLowDateTime)
+}
+
+/// Format records logged inside `f` as if they were logged at `timestamp`.
+pub(crate) fn with_timestamp<T>(timestamp: u64, f: impl FnOnce() -> T) -> T {
+  TIMESTAMP.with(|cell| cell.set(Some(timestamp)));
+  let result = f();
+  TIMESTAMP.with(|cell| cell.set(None));
+  result
+}
+
+/// Write a timestamp in the same format as slog-term's default, in local time.
+fn write_timestamp(io: &mut dyn io::Write) -> io::Result<()> {
+  const MONTHS: [&str; 12] = [
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+  ];
+
+  let timestamp = TIMESTAMP.with(|cell| cell.get()).unwrap_or_else(current_timestamp);
+  let utc = FILETIME {
+    dwLowDateTime: timestamp as u32,
+    dwHighDateTime: (timestamp >> 32) as u32,
+  };
+  let mut local: FILETIME = unsafe { std::mem::zeroed() };
+  let mut time: SYSTEMTIME = unsafe { std::mem::zeroed() };
+  if unsafe { FileTimeToLocalFileTime(&utc, &mut local) } == 0
+    || unsafe { FileTimeToSystemTime(&local, &mut time) } == 0
+  {
+    return Err(io::Error::last_os_error());
+  }
+
+  write!(
+    io,
+    "{} {:02} {:02}:{:02}:{:02}.{:03}",
+    MONTHS[(time.wMonth as usize).saturating_sub(1) % 12],
+    time.wDay,
+    time.wHour,
+    time.wMinute,
+    time.wSecond,
+    time.wMilliseconds
+  )
+}
+
+fn console_drain() -> slog_term::CompactFormat<slog_term::TermDecorator> {
+  let decorator = slog_term::TermDecorator::new().build();
+  slog_term::CompactFormat::new(decorator)
+    .use_custom_timestamp(write_timestamp)
+    .build()
+}
+
+fn file_drain(file: File) -> slog_term::FullFormat<slog_term::PlainDecorator<File>> {
+  let decorator = slog_term::PlainDecorator::new(file);
+  slog_term::FullFormat::new(decorator)
+    .use_custom_timestamp(write_timestamp)
+    .build()
+}
+
 pub fn init(config: &Config) {
   if config.console {
     unsafe { AllocConsole() };
   }
 
-  let console_drain = slog_term::term_compact();
   let file = std::fs::OpenOptions::new()
     .create(true)
     .write(true)
     .truncate(true)
     .open("dhc.log")
     .unwrap();
-  let file_decorator = slog_term::PlainDecorator::new(file);
-  let file_drain = slog_term::FullFormat::new(file_decorator).build();
 
-  let drain = std::sync::Mutex::new(slog::Duplicate::new(console_drain, file_drain));
+  let drain = std::sync::Mutex::new(slog::Duplicate::new(console_drain(), file_drain(file)));
   let level = config.log_level.to_slog();
-  let filtered = slog::LevelFilter(drain, level);
+  let logger = if config.async_logging {
+    let drain = AsyncDrain::new(drain.fuse(), ASYNC_LOG_CAPACITY);
+    *ASYNC_FLUSHER.lock() = Some(drain.flusher());
+    slog::Logger::root(slog::LevelFilter(drain, level).fuse(), o!()).into_erased()
+  } else {
+    slog::Logger::root(slog::LevelFilter(drain, level).fuse(), o!()).into_erased()
+  };
 
-  let guard = slog_scope::set_global_logger(slog::Logger::root(filtered.fuse(), o!()).into_erased());
+  let guard = slog_scope::set_global_logger(logger);
   slog_stdlog::init().expect("failed to initialize slog-stdlog");
 
   let mut lock = LOGGER.lock();
   *lock = Some(guard);
 
+  set_min_level(config.log_level);
   log_panics::init();
+
+  // Dump the flight recorder after the panic has been logged. FATAL messages from the DLLs end up
+  // here too, since dhc_log panics with them. Panics abort, so this is the last chance to write out
+  // whatever is still in the async log queue.
+  let log_panic = std::panic::take_hook();
+  std::panic::set_hook(Box::new(move |info| {
+    log_panic(info);
+    crate::flight::dump_default();
+    flush();
+  }));
+}
+
+/// Per-call cost of log statements that end up doing nothing, in nanoseconds.
+pub struct LogBenchmark {
+  pub baseline: f64,
+  pub disabled_debug: f64,
+  pub ffi_check: f64,
+}
+
+/// Measure what disabled log statements cost on the Rust side, and what it costs the DLLs to ask
+/// dhc whether a level is enabled. The DLLs' own LOG sites are timed by DhcBenchmarkLogging in
+/// dinput8_benchmark.dll. This has to run before logging is initialized, so that everything is disabled.
+pub fn benchmark(iterations: u32) -> LogBenchmark {
+  fn time(iterations: u32, mut f: impl FnMut(u32)) -> f64 {
+    let start = Instant::now();
+    for i in 0..iterations {
+      f(i);
+    }
+    start.elapsed().as_nanos() as f64 / iterations as f64
+  }
+
+  // Keep the loops from being optimized away.
+  let sink = AtomicI32::new(0);
+  let baseline = time(iterations, |i| sink.store(i as i32, Ordering::Relaxed));
+  let disabled_debug = time(iterations, |i| {
+    sink.store(i as i32, Ordering::Relaxed);
+    debug!("disabled: {}", i);
+  });
+  let ffi_check = time(iterations, |i| {
+    sink.store(i as i32, Ordering::Relaxed);
+    if crate::ffi::dhc_log_is_enabled(LogLevel::Debug) {
+      sink.store(-1, Ordering::Relaxed);
+    }
+  });
+
+  LogBenchmark {
+    baseline,
+    disabled_debug,
+    ffi_check,
+  }
+}
+
+/// Cost of enabled log statements to the thread that logs them.
+pub struct AsyncLogBenchmark {
+  pub sync_mean: Duration,
+  pub sync_max: Duration,
+  pub async_mean: Duration,
+  pub async_max: Duration,
+  pub async_dropped: u64,
+}
+
+/// Log `iterations` debug lines like the ones that HidParser::new logs, to a file in the temporary
+/// directory, first synchronously and then through an AsyncDrain, timing each call.
+pub fn benchmark_async(iterations: u32) -> io::Result<AsyncLogBenchmark> {
+  fn time(logger: &slog::Logger, iterations: u32) -> (Duration, Duration) {
+    static LOCATION: slog::RecordLocation = slog::RecordLocation {
+      file: file!(),
+      line: line!(),
+      column: column!(),
+      function: "",
+      module: module_path!(),
+    };
+    let rstatic = slog::RecordStatic {
+      location: &LOCATION,
+      tag: "",
+      level: slog::Level::Debug,
+    };
+
+    let mut total = Duration::default();
+    let mut max = Duration::default();
+    for i in 0..iterations {
+      let start = Instant::now();
+      logger.log(&slog::Record::new(
+        &rstatic,
+        &format_args!("  UsagePage = {:#x}, ReportID = {}", i & 0xff, i),
+        slog::BorrowedKV(&()),
+      ));
+      let elapsed = start.elapsed();
+      total += elapsed;
+      max = max.max(elapsed);
+    }
+    (total / iterations.max(1), max)
+  }
+
+  let path = std::env::temp_dir().join("dhc_bench.log");
+  let sync_drain = std::sync::Mutex::new(file_drain(File::create(&path)?));
+  let (sync_mean, sync_max) = time(&slog::Logger::root(sync_drain.fuse(), o!()), iterations);
+
+  let sync_drain = std::sync::Mutex::new(file_drain(File::create(&path)?));
+  let async_drain = std::sync::Arc::new(AsyncDrain::new(sync_drain.fuse(), ASYNC_LOG_CAPACITY));
+  let (async_mean, async_max) = time(
+    &slog::Logger::root(std::sync::Arc::clone(&async_drain), o!()),
+    iterations,
+  );
+  let async_dropped = async_drain.stats().dropped;
+
+  Ok(AsyncLogBenchmark {
+    sync_mean,
+    sync_max,
+    async_mean,
+    async_max,
+    async_dropped,
+  })
 }
@@ -0,0 +1,276 @@
+//! Live metrics in shared memory, for watching a running game from the outside.
+//!
+//! Each process that loads dhc creates a named file mapping, `Local\dhc_metrics_<pid>`, holding a
+//! MetricsBlock. Everything in it is an atomic that's only ever updated with relaxed operations,
+//! so recording a metric costs about as much as an increment, and readers like `dhc top` never
+//! hold anything up. Readers check `magic` and `version` before trusting the rest of the layout,
+//! which must only ever be extended by bumping the version.
+
+use std::ffi::OsStr;
+use std::os::windows::ffi::OsStrExt;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use winapi::um::handleapi::{CloseHandle, INVALID_HANDLE_VALUE};
+use winapi::um::memoryapi::{CreateFileMappingW, MapViewOfFile, OpenFileMappingW, FILE_MAP_ALL_ACCESS};
+use winapi::um::processthreadsapi::GetCurrentProcessId;
+use winapi::um::winnt::PAGE_READWRITE;
+
+use crate::clock;
+
+pub const MAGIC: u32 = u32::from_le_bytes(*b"DHCM");
+pub const VERSION: u32 = 1;
+
+/// Number of real devices that have room for metrics. Devices beyond this aren't tracked.
+pub const REAL_DEVICE_CAPACITY: usize = 64;
+
+/// Number of virtual devices that have room for metrics.
+pub const VIRTUAL_DEVICE_CAPACITY: usize = crate::config::MAX_DEVICE_COUNT;
+
+/// Counters for one real device.
+#[repr(C)]
+pub struct RealDeviceMetrics {
+  /// Flight recorder device code of the device in this slot, or 0 if the slot is free.
+  pub device: AtomicU64,
+
+  pub reports: AtomicU64,
+  pub bytes: AtomicU64,
+  pub parse_errors: AtomicU64,
+
+  /// Reports that were dropped because they didn't change anything.
+  pub duplicates: AtomicU64,
+
+  /// One more than the index of the virtual device that this is bound to, or 0.
+  pub bound_to: AtomicU32,
+  _reserved: AtomicU32,
+}
+
+/// Counters for one virtual device.
+#[repr(C)]
+pub struct VirtualDeviceMetrics {
+  /// Reads through DirectInput.
+  pub polls: AtomicU64,
+
+  /// Reads through XInput.
+  pub xinput_polls: AtomicU64,
+
+  /// Device code of the bound real device, or 0.
+  pub bound_device: AtomicU64,
+}
+
+/// Count, total and worst case of something that's timed in clock ticks.
+#[repr(C)]
+pub struct Timing {
+  pub count: AtomicU64,
+  pub total_ticks: AtomicU64,
+  pub max_ticks: AtomicU64,
+}
+
+impl Timing {
+  /// Record something that started at `start`, and return the current time.
+  pub fn record_since(&self, start: u64) -> u64 {
+    let now = clock::now();
+    let ticks = now.saturating_sub(start);
+    self.count.fetch_add(1, Ordering::Relaxed);
+    self.total_ticks.fetch_add(ticks, Ordering::Relaxed);
+    self.max_ticks.fetch_max(ticks, Ordering::Relaxed);
+    now
+  }
+}
+
+#[repr(C)]
+pub struct MetricsBlock {
+  pub magic: AtomicU32,
+  pub version: AtomicU32,
+
+  /// Size of the whole block, in bytes.
+  pub size: AtomicU32,
+  pub process_id: AtomicU32,
+
+  /// Clock ticks per second, for turning timings into time.
+  pub clock_frequency: AtomicU64,
+
+  pub real_device_capacity: AtomicU32,
+  pub virtual_device_capacity: AtomicU32,
+
+  /// Messages handled by the input thread.
+  pub input_loop: Timing,
+
+  /// Calls to Context::update that had something to do.
+  pub update: Timing,
+
+  pub real_devices: [RealDeviceMetrics; REAL_DEVICE_CAPACITY],
+  pub virtual_devices: [VirtualDeviceMetrics; VIRTUAL_DEVICE_CAPACITY],
+}
+
+lazy_static! {
+  static ref BLOCK: &'static MetricsBlock = create();
+}
+
+fn mapping_name(process_id: u32) -> Vec<u16> {
+  OsStr::new(&format!("Local\\dhc_metrics_{}", process_id))
+    .encode_wide()
+    .chain(Some(0))
+    .collect()
+}
+
+/// Map the shared block for this process, falling back to memory that nobody else can see if
+/// that doesn't work out, so that recording metrics never has to check.
+fn create() -> &'static MetricsBlock {
+  let size = std::mem::size_of::<MetricsBlock>();
+  let process_id = unsafe { GetCurrentProcessId() };
+  let name = mapping_name(process_id);
+
+  // The mapping is never closed: it lives for as long as the process does.
+  let mapping = unsafe {
+    CreateFileMappingW(
+      INVALID_HANDLE_VALUE,
+      std::ptr::null_mut(),
+      PAGE_READWRITE,
+      0,
+      size as u32,
+      name.as_ptr(),
+    )
+  };
+  let view = if mapping.is_null() {
+    std::ptr::null_mut()
+  } else {
+    unsafe { MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) }
+  };
+
+  // Fresh mappings are zeroed, which is a valid (empty) block.
+  let block: &'static MetricsBlock = if view.is_null() {
+    warn!("failed to create shared metrics: {}", std::io::Error::last_os_error());
+    let layout = std::alloc::Layout::new::<MetricsBlock>();
+    let memory = unsafe { std::alloc::alloc_zeroed(layout) };
+    if memory.is_null() {
+      std::alloc::handle_alloc_error(layout);
+    }
+    unsafe { &*(memory as *const MetricsBlock) }
+  } else {
+    unsafe { &*(view as *const MetricsBlock) }
+  };
+
+  block.size.store(size as u32, Ordering::Relaxed);
+  block.process_id.store(process_id, Ordering::Relaxed);
+  block.clock_frequency.store(clock::frequency(), Ordering::Relaxed);
+  block
+    .real_device_capacity
+    .store(REAL_DEVICE_CAPACITY as u32, Ordering::Relaxed);
+  block
+    .virtual_device_capacity
+    .store(VIRTUAL_DEVICE_CAPACITY as u32, Ordering::Relaxed);
+  block.version.store(VERSION, Ordering::Relaxed);
+  block.magic.store(MAGIC, Ordering::Release);
+  block
+}
+
+pub fn block() -> &'static MetricsBlock {
+  *BLOCK
+}
+
+pub fn virtual_device(idx: usize) -> Option<&'static VirtualDeviceMetrics> {
+  block().virtual_devices.get(idx)
+}
+
+/// Find the slot of a real device that's already been claimed.
+pub fn find_real_device(device: u64) -> Option<&'static RealDeviceMetrics> {
+  block()
+    .real_devices
+    .iter()
+    .find(|slot| slot.device.load(Ordering::Relaxed) == device)
+}
+
+/// Claim of a real device's slot, which gets released when this is dropped.
+pub struct RealDeviceSlot {
+  metrics: Option<&'static RealDeviceMetrics>,
+}
+
+impl RealDeviceSlot {
+  /// Claim a slot for a device, if there's one free.
+  pub fn claim(device: u64) -> RealDeviceSlot {
+    for slot in block().real_devices.iter() {
+      if slot
+        .device
+        .compare_exchange(0, device, Ordering::Relaxed, Ordering::Relaxed)
+        .is_ok()
+      {
+        slot.reports.store(0, Ordering::Relaxed);
+        slot.bytes.store(0, Ordering::Relaxed);
+        slot.parse_errors.store(0, Ordering::Relaxed);
+        slot.duplicates.store(0, Ordering::Relaxed);
+        slot.bound_to.store(0, Ordering::Relaxed);
+        return RealDeviceSlot { metrics: Some(slot) };
+      }
+    }
+    RealDeviceSlot { metrics: None }
+  }
+
+  pub fn record_reports(&self, count: usize, bytes: usize) {
+    if let Some(metrics) = self.metrics {
+      metrics.reports.fetch_add(count as u64, Ordering::Relaxed);
+      metrics.bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+  }
+
+  pub fn record_duplicate(&self) {
+    if let Some(metrics) = self.metrics {
+      metrics.duplicates.fetch_add(1, Ordering::Relaxed);
+    }
+  }
+
+  pub fn record_parse_error(&self) {
+    if let Some(metrics) = self.metrics {
+      metrics.parse_errors.fetch_add(1, Ordering::Relaxed);
+    }
+  }
+}
+
+impl Drop for RealDeviceSlot {
+  fn drop(&mut self) {
+    if let Some(metrics) = self.metrics {
+      metrics.device.store(0, Ordering::Relaxed);
+    }
+  }
+}
+
+/// Read-only view of another process's metrics.
+pub struct MetricsView {
+  block: &'static MetricsBlock,
+}
+
+impl MetricsView {
+  /// Attach to the metrics of process `process_id`.
+  pub fn open(process_id: u32) -> std::io::Result<MetricsView> {
+    let name = mapping_name(process_id);
+    // The view has to be writable even though it's only read, because 64-bit atomic loads can be
+    // a locked compare-exchange on 32-bit x86, which faults on read-only pages.
+    let mapping = unsafe { OpenFileMappingW(FILE_MAP_ALL_ACCESS, 0, name.as_ptr()) };
+    if mapping.is_null() {
+      return Err(std::io::Error::last_os_error());
+    }
+
+    let view = unsafe { MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) };
+    let error = std::io::Error::last_os_error();
+    unsafe { CloseHandle(mapping) };
+    if view.is_null() {
+      return Err(error);
+    }
+
+    let block = unsafe { &*(view as *const MetricsBlock) };
+    let invalid = |msg: &str| std::io::Error::new(std::io::ErrorKind::InvalidData, msg.to_string());
+    if block.magic.load(Ordering::Acquire) != MAGIC {
+      return Err(invalid("not a dhc metrics block"));
+    }
+    if block.version.load(Ordering::Relaxed) != VERSION {
+      return Err(invalid("unsupported dhc metrics version"));
+    }
+    if block.size.load(Ordering::Relaxed) as usize != std::mem::size_of::<MetricsBlock>() {
+      return Err(invalid("unexpected dhc metrics size"));
+    }
+    Ok(MetricsView { block })
+  }
+
+  pub fn block(&self) -> &MetricsBlock {
+    self.block
+  }
+}
@@ -0,0 +1,60 @@
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{fence, AtomicUsize, Ordering};
+
+/// Single-writer, multi-reader sequence lock for small Copy values.
+///
+/// Readers never block and never contend with each other: they copy the value out and retry if a
+/// write happened concurrently. The copies are made as `MaybeUninit<T>`, so padding bytes are
+/// carried along without ever being read as integers, and `T` can have any layout. A copy that
+/// raced with a write is thrown away without being looked at, and is only turned into a `T` once
+/// the sequence number shows that it's whole.
+pub struct SeqLock<T> {
+  seq: AtomicUsize,
+  value: UnsafeCell<MaybeUninit<T>>,
+}
+
+// Readers only ever copy the value out, and writes are serialized by the caller.
+unsafe impl<T: Copy + Send> Sync for SeqLock<T> {}
+
+impl<T: Copy> SeqLock<T> {
+  pub fn new(value: T) -> SeqLock<T> {
+    SeqLock {
+      seq: AtomicUsize::new(0),
+      value: UnsafeCell::new(MaybeUninit::new(value)),
+    }
+  }
+
+  pub fn read(&self) -> T {
+    loop {
+      let begin = self.seq.load(Ordering::Acquire);
+      if begin & 1 != 0 {
+        std::hint::spin_loop();
+        continue;
+      }
+
+      // Volatile, so that the copy can't be elided or moved past the sequence checks.
+      let value = unsafe { std::ptr::read_volatile(self.value.get()) };
+
+      fence(Ordering::Acquire);
+      let end = self.seq.load(Ordering::Relaxed);
+      if begin == end {
+        return unsafe { value.assume_init() };
+      }
+    }
+  }
+
+  /// Publish a new value. Writes must be serialized externally.
+  pub fn write(&self, value: T) {
+    let seq = self.seq.load(Ordering::Relaxed);
+    self.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+    fence(Ordering::Release);
+
+    unsafe { std::ptr::write_volatile(self.value.get(), MaybeUninit::new(value)) };
+
+    self.seq.store(seq.wrapping_add(2), Ordering::Release);
+  }
+}
+
+#[cfg(test)]
+mod benchmark;
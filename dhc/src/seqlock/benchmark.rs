@@ -0,0 +1,97 @@
+//! Reader latency of a SeqLock against a RwLock, with one thread writing at 1 kHz.
+//!
+//! Run with `cargo test --release -p dhc seqlock::benchmark -- --ignored --nocapture`.
+
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use parking_lot::RwLock;
+
+use super::SeqLock;
+use crate::DeviceInputs;
+
+/// Mean time per read with some number of threads reading while another thread writes at 1 kHz, in
+/// nanoseconds.
+struct ContentionBenchmark {
+  seqlock: f64,
+  rwlock: f64,
+}
+
+/// Run `readers` threads calling `read` for `duration` while `write` is called once a millisecond,
+/// and return the mean time per read.
+fn time_reads<R, W>(readers: usize, duration: Duration, read: R, mut write: W) -> f64
+where
+  R: Fn() -> DeviceInputs + Send + Sync + 'static,
+  W: FnMut(DeviceInputs),
+{
+  let read = Arc::new(read);
+  let done = Arc::new(AtomicBool::new(false));
+  let total_nanos = Arc::new(AtomicU64::new(0));
+  let total_reads = Arc::new(AtomicU64::new(0));
+
+  let threads: Vec<_> = (0..readers)
+    .map(|_| {
+      let read = Arc::clone(&read);
+      let done = Arc::clone(&done);
+      let total_nanos = Arc::clone(&total_nanos);
+      let total_reads = Arc::clone(&total_reads);
+      std::thread::spawn(move || {
+        let mut reads = 0u64;
+        let start = Instant::now();
+        while !done.load(Ordering::Relaxed) {
+          for _ in 0..1000 {
+            std::hint::black_box(read());
+          }
+          reads += 1000;
+        }
+        total_nanos.fetch_add(start.elapsed().as_nanos() as u64, Ordering::Relaxed);
+        total_reads.fetch_add(reads, Ordering::Relaxed);
+      })
+    })
+    .collect();
+
+  // Spin instead of sleeping, since Sleep's granularity is far coarser than a millisecond.
+  let start = Instant::now();
+  let mut next_write = start;
+  let mut inputs = DeviceInputs::default();
+  while start.elapsed() < duration {
+    if Instant::now() >= next_write {
+      inputs.button_south.set_value(!inputs.button_south.get());
+      write(inputs);
+      next_write += Duration::from_millis(1);
+    }
+    std::hint::spin_loop();
+  }
+
+  done.store(true, Ordering::Relaxed);
+  for thread in threads {
+    thread.join().expect("reader thread panicked");
+  }
+  total_nanos.load(Ordering::Relaxed) as f64 / total_reads.load(Ordering::Relaxed).max(1) as f64
+}
+
+/// Compare reader latency of a SeqLock against a RwLock, with `readers` reader threads.
+fn benchmark(readers: usize, duration: Duration) -> ContentionBenchmark {
+  let seqlock = Arc::new(SeqLock::new(DeviceInputs::default()));
+  let reader = Arc::clone(&seqlock);
+  let seqlock = time_reads(readers, duration, move || reader.read(), |value| seqlock.write(value));
+
+  let rwlock = Arc::new(RwLock::new(DeviceInputs::default()));
+  let reader = Arc::clone(&rwlock);
+  let rwlock = time_reads(readers, duration, move || *reader.read(), |value| *rwlock.write() = value);
+
+  ContentionBenchmark { seqlock, rwlock }
+}
+
+#[test]
+#[ignore]
+fn contention() {
+  for &readers in &[1, 2, 4, 8] {
+    let result = benchmark(readers, Duration::from_secs(1));
+    println!(
+      "{:>2} readers: seqlock {:>8.1} ns per read, rwlock {:>8.1} ns per read",
+      readers, result.seqlock, result.rwlock
+    );
+  }
+}
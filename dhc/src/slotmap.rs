@@ -0,0 +1,75 @@
+/// Handle to a value in a SlotMap.
+///
+/// Slots are reused after their value is removed, but every reuse bumps the slot's generation, so
+/// a stale handle never refers to whatever took its place.
+#[derive(Copy, Clone, Debug, Eq, PartialEq, Hash)]
+pub struct SlotKey {
+  index: u32,
+  generation: u32,
+}
+
+struct Slot<T> {
+  /// Odd while the slot is occupied.
+  generation: u32,
+  value: Option<T>,
+}
+
+/// Vec-backed map with O(1) insertion, removal and lookup, which hands out its own keys.
+pub struct SlotMap<T> {
+  slots: Vec<Slot<T>>,
+  free: Vec<u32>,
+}
+
+impl<T> SlotMap<T> {
+  pub fn new() -> SlotMap<T> {
+    SlotMap {
+      slots: Vec::new(),
+      free: Vec::new(),
+    }
+  }
+
+  pub fn insert(&mut self, value: T) -> SlotKey {
+    if let Some(index) = self.free.pop() {
+      let slot = &mut self.slots[index as usize];
+      slot.generation = slot.generation.wrapping_add(1);
+      slot.value = Some(value);
+      SlotKey {
+        index,
+        generation: slot.generation,
+      }
+    } else {
+      let index = self.slots.len() as u32;
+      self.slots.push(Slot {
+        generation: 1,
+        value: Some(value),
+      });
+      SlotKey { index, generation: 1 }
+    }
+  }
+
+  pub fn remove(&mut self, key: SlotKey) -> Option<T> {
+    let slot = self.slots.get_mut(key.index as usize)?;
+    if slot.generation != key.generation {
+      return None;
+    }
+
+    let value = slot.value.take()?;
+    slot.generation = slot.generation.wrapping_add(1);
+    self.free.push(key.index);
+    Some(value)
+  }
+
+  pub fn get(&self, key: SlotKey) -> Option<&T> {
+    match self.slots.get(key.index as usize) {
+      Some(slot) if slot.generation == key.generation => slot.value.as_ref(),
+      _ => None,
+    }
+  }
+
+  pub fn get_mut(&mut self, key: SlotKey) -> Option<&mut T> {
+    match self.slots.get_mut(key.index as usize) {
+      Some(slot) if slot.generation == key.generation => slot.value.as_mut(),
+      _ => None,
+    }
+  }
+}
@@ -0,0 +1,253 @@
+//! Opt-in span tracing, exported as Chrome trace JSON.
+//!
+//! When dhc is built with the `tracing` feature, `trace_span!("name")` times the rest of the scope
+//! that it's in, and the DLLs' DHC_TRACE_SPAN does the same on their side when they're built with
+//! DHC_TRACING. Spans go into a buffer owned by the thread that recorded them, so recording one
+//! never contends with other threads, and everything is written to dhc_trace.json when
+//! dhc_trace_export is called, ready for chrome://tracing or ui.perfetto.dev. The DLLs call it when
+//! the game releases DirectInput, never from DllMain. Each thread keeps its most recent
+//! `trace_spans_per_thread` spans, from dhc.toml. Without the feature, none of this is compiled in.
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::ffi::CStr;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
+
+use parking_lot::Mutex;
+
+use winapi::um::processthreadsapi::{GetCurrentProcessId, GetCurrentThreadId};
+
+use crate::clock;
+
+/// How long exporting waits for a buffer that's in use. Threads that were killed while they were
+/// recording a span (which happens at process exit) never let go of their buffer.
+const LOCK_TIMEOUT: Duration = Duration::from_millis(100);
+
+#[derive(Copy, Clone)]
+struct Record {
+  name: &'static str,
+  start: u64,
+  end: u64,
+}
+
+struct Ring {
+  /// Grows as spans are recorded, up to `capacity`, so threads that record few spans stay small.
+  records: Vec<Record>,
+  capacity: usize,
+
+  /// Where the next record goes, once the ring is full.
+  next: usize,
+  overwritten: u64,
+}
+
+impl Ring {
+  fn new(capacity: usize) -> Ring {
+    Ring {
+      records: Vec::new(),
+      capacity: capacity.max(1),
+      next: 0,
+      overwritten: 0,
+    }
+  }
+
+  fn push(&mut self, record: Record) {
+    if self.records.len() < self.capacity {
+      self.records.push(record);
+    } else {
+      self.records[self.next] = record;
+      self.next = (self.next + 1) % self.capacity;
+      self.overwritten += 1;
+    }
+  }
+}
+
+struct ThreadBuffer {
+  thread_id: u32,
+  thread_name: String,
+  ring: Mutex<Ring>,
+}
+
+lazy_static! {
+  /// Buffers of every thread that has recorded a span, which outlive their threads so that their
+  /// spans still get exported.
+  static ref BUFFERS: Mutex<Vec<Arc<ThreadBuffer>>> = Mutex::new(Vec::new());
+}
+
+thread_local! {
+  static BUFFER: Arc<ThreadBuffer> = {
+    let thread_id = unsafe { GetCurrentThreadId() };
+    let buffer = Arc::new(ThreadBuffer {
+      thread_id,
+      thread_name: match std::thread::current().name() {
+        Some(name) => name.to_string(),
+        None => format!("thread {}", thread_id),
+      },
+      ring: Mutex::new(Ring::new(crate::CONFIG.trace_spans_per_thread)),
+    });
+    BUFFERS.lock().push(Arc::clone(&buffer));
+    buffer
+  };
+}
+
+thread_local! {
+  /// Copies of span names that came from the DLLs, by the address that they were passed in at.
+  static FOREIGN_NAMES: RefCell<HashMap<usize, &'static str>> = RefCell::new(HashMap::new());
+}
+
+/// Record a span that ran from `start` to `end`, in clock ticks.
+pub fn record(name: &'static str, start: u64, end: u64) {
+  // The buffer is gone if this thread is being torn down, in which case the span is lost.
+  let _ = BUFFER.try_with(|buffer| buffer.ring.lock().push(Record { name, start, end }));
+}
+
+/// Record a span whose name belongs to someone else, and might be gone by the time it's exported.
+///
+/// Each name is copied the first time that a thread sees it, and the copy is never freed, so this
+/// is only meant for a fixed set of names, like the string literals in the DLLs.
+pub fn record_foreign(name: &CStr, start: u64, end: u64) {
+  let _ = FOREIGN_NAMES.try_with(|names| {
+    let name_str = match name.to_str() {
+      Ok(name_str) => name_str,
+      Err(_) => return,
+    };
+
+    let mut names = names.borrow_mut();
+    let key = name.as_ptr() as usize;
+    let interned = match names.get(&key) {
+      // Another string might live at the same address if a DLL was unloaded and reloaded.
+      Some(&interned) if interned == name_str => interned,
+      _ => {
+        let interned: &'static str = Box::leak(name_str.to_string().into_boxed_str());
+        names.insert(key, interned);
+        interned
+      }
+    };
+    record(interned, start, end);
+  });
+}
+
+/// Span that ends when it's dropped. Use `trace_span!` instead of this, so that it compiles out.
+pub struct Span {
+  name: &'static str,
+  start: u64,
+}
+
+impl Span {
+  pub fn new(name: &'static str) -> Span {
+    Span {
+      name,
+      start: clock::now(),
+    }
+  }
+}
+
+impl Drop for Span {
+  fn drop(&mut self) {
+    record(self.name, self.start, clock::now());
+  }
+}
+
+fn write_string(out: &mut impl Write, s: &str) -> io::Result<()> {
+  write!(out, "\"")?;
+  for c in s.chars() {
+    match c {
+      '"' => write!(out, "\\\"")?,
+      '\\' => write!(out, "\\\\")?,
+      c if (c as u32) < 0x20 => write!(out, "\\u{:04x}", c as u32)?,
+      c => write!(out, "{}", c)?,
+    }
+  }
+  write!(out, "\"")
+}
+
+/// Write every thread's spans to `path`, returning the number of spans written.
+pub fn export(path: &Path) -> io::Result<usize> {
+  let buffers = match BUFFERS.try_lock_for(LOCK_TIMEOUT) {
+    Some(buffers) => buffers.clone(),
+    None => return Err(io::Error::new(io::ErrorKind::WouldBlock, "span buffers are locked")),
+  };
+
+  let mut threads = Vec::new();
+  for buffer in &buffers {
+    match buffer.ring.try_lock_for(LOCK_TIMEOUT) {
+      Some(ring) => {
+        if ring.overwritten != 0 {
+          warn!(
+            "{} spans from {} were overwritten before they could be exported",
+            ring.overwritten, buffer.thread_name
+          );
+        }
+        threads.push((buffer, ring.records.clone()));
+      }
+      None => warn!("skipping spans from {}, whose buffer is locked", buffer.thread_name),
+    }
+  }
+
+  // Timestamps are relative to the first span, to keep them readable.
+  let origin = threads
+    .iter()
+    .flat_map(|(_, records)| records.iter().map(|record| record.start))
+    .min()
+    .unwrap_or(0);
+  let micros = |ticks: u64| clock::to_nanos(ticks) as f64 / 1000.0;
+
+  let process_id = unsafe { GetCurrentProcessId() };
+  let mut out = BufWriter::new(File::create(path)?);
+  let mut count = 0;
+  write!(out, "{{\"displayTimeUnit\":\"ns\",\"traceEvents\":[")?;
+  write!(
+    out,
+    "\n{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"dhc\"}}}}",
+    process_id
+  )?;
+  for (buffer, records) in &threads {
+    write!(
+      out,
+      ",\n{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":",
+      process_id, buffer.thread_id
+    )?;
+    write_string(&mut out, &buffer.thread_name)?;
+    write!(out, "}}}}")?;
+
+    for record in records {
+      write!(out, ",\n{{\"name\":")?;
+      write_string(&mut out, record.name)?;
+      write!(
+        out,
+        ",\"cat\":\"dhc\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3},\"dur\":{:.3}}}",
+        process_id,
+        buffer.thread_id,
+        micros(record.start.saturating_sub(origin)),
+        micros(record.end.saturating_sub(record.start))
+      )?;
+      count += 1;
+    }
+  }
+  write!(out, "\n]}}\n")?;
+  out.flush()?;
+  Ok(count)
+}
+
+/// Where spans get exported to unless asked otherwise.
+pub fn default_path() -> PathBuf {
+  crate::config_path("dhc_trace.json")
+}
+
+/// Export to the default path, logging what happened.
+pub fn export_default() -> bool {
+  let path = default_path();
+  match export(&path) {
+    Ok(count) => {
+      info!("exported {} spans to {}", count, path.display());
+      true
+    }
+    Err(err) => {
+      warn!("failed to export spans to {}: {}", path.display(), err);
+      false
+    }
+  }
+}
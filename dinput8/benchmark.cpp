@@ -0,0 +1,231 @@
+#include <windows.h>
+
+#define DIRECTINPUT_VERSION 0x0800
+#include <dinput.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include "dhc/dhc.h"
+#include "dhc/logging.h"
+#include "dhc_dinput.h"
+
+// Microbenchmarks for the dinput8 side of dhc, built into dinput8_benchmark.dll (never into dinput8.dll)
+// and exported so that `dhc bench-*` can run them.
+
+namespace dhc {
+namespace {
+
+// GetDeviceState's per-object path from before DeviceStateProgram, kept around to compare against.
+void LegacyApply(const DeviceFormat& format, char* output_buffer, size_t output_buffer_length,
+                 DeviceInputs inputs) {
+  const EmulatedDeviceObject* object = format.object.get();
+  size_t offset = format.offset;
+  std::visit(
+      [&](auto&& arg) {
+        using T = std::decay_t<decltype(arg)>;
+        if constexpr (std::is_same_v<T, std::monostate>) {
+          if (object->type & DIDFT_BUTTON) {
+            output_buffer[offset] = 0;
+            CHECK_GE(output_buffer_length, offset + 1);
+          } else if (object->type & DIDFT_AXIS) {
+            CHECK_EQ(0ULL, offset % 4);
+            CHECK_GE(output_buffer_length, offset + 4);
+            *reinterpret_cast<DWORD*>(&output_buffer[offset]) =
+                (object->range_min + object->range_max) / 2;
+          } else {
+            LOG(FATAL) << "unhandled type " << object->type;
+          }
+        } else if constexpr (std::is_same_v<T, AxisType>) {
+          CHECK(object->type & DIDFT_AXIS);
+          CHECK_EQ(0ULL, offset % 4);
+          CHECK_GE(output_buffer_length, offset + 4);
+          auto value = dhc_get_axis(&inputs, arg);
+          double distance = std::abs(value - 0.5);
+          if (distance * 2 >= object->saturation) {
+            value = value > 0.5 ? 1.0 : 0.0;
+          } else if (distance * 2 <= object->deadzone) {
+            value = 0.5;
+          }
+
+          DWORD lerped = static_cast<DWORD>(static_cast<LONG>(lerp(value, object->range_min, object->range_max)));
+          LOG(VERBOSE) << "lerping " << object->name << " value " << value << " onto ["
+                       << object->range_min << ", " << object->range_max
+                       << "] = " << static_cast<long>(lerped);
+          *reinterpret_cast<DWORD*>(&output_buffer[offset]) = lerped;
+        } else if constexpr (std::is_same_v<T, ButtonType>) {
+          CHECK(object->type & DIDFT_BUTTON);
+          CHECK_GE(output_buffer_length, offset + 1);
+          auto value = dhc_get_button(&inputs, arg);
+          output_buffer[offset] = value ? -128 : 0;
+        } else if constexpr (std::is_same_v<T, HatType>) {
+          CHECK(object->type & DIDFT_POV);
+          CHECK_EQ(0ULL, offset % 4);
+          CHECK_GE(output_buffer_length, offset + 4);
+          auto hat = dhc_get_hat(&inputs, arg);
+          DWORD value = 0;
+          switch (hat) {
+            case Hat::Neutral:
+              value = static_cast<DWORD>(-1);
+              break;
+            case Hat::North:
+              value = 0;
+              break;
+            case Hat::NorthEast:
+              value = 4500;
+              break;
+            case Hat::East:
+              value = 9000;
+              break;
+            case Hat::SouthEast:
+              value = 13500;
+              break;
+            case Hat::South:
+              value = 18000;
+              break;
+            case Hat::SouthWest:
+              value = 22500;
+              break;
+            case Hat::West:
+              value = 27000;
+              break;
+            case Hat::NorthWest:
+              value = 31500;
+              break;
+          }
+          *reinterpret_cast<DWORD*>(&output_buffer[offset]) = value;
+        } else {
+          LOG(FATAL) << "unhandled type?";
+        }
+      },
+      object->mapped_object);
+}
+
+// Where SetDataFormat(&c_dfDIJoystick2) puts an object.
+size_t Joystick2Offset(const EmulatedDeviceObject& object, size_t* next_button) {
+  if (object.guid == GUID_XAxis) return offsetof(DIJOYSTATE2, lX);
+  if (object.guid == GUID_YAxis) return offsetof(DIJOYSTATE2, lY);
+  if (object.guid == GUID_ZAxis) return offsetof(DIJOYSTATE2, lZ);
+  if (object.guid == GUID_RxAxis) return offsetof(DIJOYSTATE2, lRx);
+  if (object.guid == GUID_RyAxis) return offsetof(DIJOYSTATE2, lRy);
+  if (object.guid == GUID_RzAxis) return offsetof(DIJOYSTATE2, lRz);
+  if (object.guid == GUID_POV) return offsetof(DIJOYSTATE2, rgdwPOV);
+  return offsetof(DIJOYSTATE2, rgbButtons) + (*next_button)++;
+}
+
+double NanosecondsPerIteration(LARGE_INTEGER start, LARGE_INTEGER end, uint32_t iterations) {
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  return static_cast<double>(end.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart / iterations;
+}
+
+}  // namespace
+}  // namespace dhc
+
+// Time GetDeviceState for a PS4 controller in the DIJOYSTATE2 format, through DeviceStateProgram
+// and through the per-object Apply path that it replaced.
+extern "C" void WINAPI DhcBenchmarkGetDeviceState(uint32_t iterations, double* program_ns, double* apply_ns) {
+  using namespace dhc;
+
+  std::vector<EmulatedDeviceObject> objects = GeneratePS4EmulatedDeviceObjects();
+  std::vector<DeviceFormat> formats;
+  size_t next_button = 0;
+  for (auto& object : objects) {
+    formats.push_back({.object = observer_ptr<EmulatedDeviceObject>(&object),
+                       .offset = Joystick2Offset(object, &next_button)});
+  }
+
+  // c_dfDIJoystick2 has four POVs, and the PS4 controller only fills one of them.
+  std::vector<DeviceFormatDefault> defaults;
+  for (size_t i = 1; i < 4; ++i) {
+    defaults.push_back({.offset = offsetof(DIJOYSTATE2, rgdwPOV) + i * sizeof(DWORD), .value = -1UL});
+  }
+
+  DeviceStateProgram program;
+  CHECK(program.Compile(formats, defaults, sizeof(DIJOYSTATE2)));
+
+  DeviceInputs inputs = {};
+  inputs.axis_left_stick_x._0 = 0.75f;
+  inputs.axis_left_stick_y._0 = 0.5f;
+  inputs.axis_right_stick_x._0 = 0.25f;
+  inputs.axis_right_stick_y._0 = 1.0f;
+  inputs.hat_dpad = Hat::East;
+  inputs.button_south._0 = true;
+
+  DIJOYSTATE2 state;
+  char* buffer = reinterpret_cast<char*>(&state);
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    memset(buffer, 0, sizeof(state));
+    program.Execute(buffer, inputs);
+    asm volatile("" : : "r"(buffer) : "memory");
+  }
+  QueryPerformanceCounter(&end);
+  *program_ns = NanosecondsPerIteration(start, end, iterations);
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    memset(buffer, 0, sizeof(state));
+    for (const auto& format : formats) {
+      LegacyApply(format, buffer, sizeof(state), inputs);
+    }
+    for (const auto& fmt_default : defaults) {
+      *reinterpret_cast<DWORD*>(buffer + fmt_default.offset) = fmt_default.value;
+    }
+    asm volatile("" : : "r"(buffer) : "memory");
+  }
+  QueryPerformanceCounter(&end);
+  *apply_ns = NanosecondsPerIteration(start, end, iterations);
+}
+
+// Time what LOG sites cost the game when their level is disabled, which is every level until dhc's
+// logger is up. Disabled LOG(DEBUG) should cost no more than the relaxed load in
+// dhc_log_level_enabled, and LOG(VERBOSE) nothing at all unless verbose logging is compiled in.
+extern "C" void WINAPI DhcBenchmarkLogging(uint32_t iterations, double* baseline_ns, double* level_check_ns,
+                                           double* log_debug_ns, double* log_verbose_ns) {
+  using namespace dhc;
+
+  // Keep the loops from being optimized away.
+  static volatile uint32_t sink;
+  LARGE_INTEGER start, end;
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    sink = i;
+  }
+  QueryPerformanceCounter(&end);
+  *baseline_ns = NanosecondsPerIteration(start, end, iterations);
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    sink = i;
+    if (dhc_log_level_enabled(DEBUG)) {
+      sink = 0;
+    }
+  }
+  QueryPerformanceCounter(&end);
+  *level_check_ns = NanosecondsPerIteration(start, end, iterations);
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    sink = i;
+    LOG(DEBUG) << "disabled: " << i;
+  }
+  QueryPerformanceCounter(&end);
+  *log_debug_ns = NanosecondsPerIteration(start, end, iterations);
+
+  QueryPerformanceCounter(&start);
+  for (uint32_t i = 0; i < iterations; ++i) {
+    sink = i;
+    LOG(VERBOSE) << "disabled: " << i;
+  }
+  QueryPerformanceCounter(&end);
+  *log_verbose_ns = NanosecondsPerIteration(start, end, iterations);
+}
@@ -147,9 +147,6 @@ std::vector<EmulatedDeviceObject> GeneratePS4EmulatedDeviceObjects();
 struct DeviceFormat {
   observer_ptr<EmulatedDeviceObject> object;
   size_t offset;
-
-  void Apply(char* output_buffer, size_t output_buffer_length,
-             DeviceInputs inputs) const;
 };
 
 // Some fields (e.g. POV hats) need to be set to non-zero values if not found.
@@ -158,4 +155,57 @@ struct DeviceFormatDefault {
   DWORD value;
 };
 
+// A single step of a compiled GetDeviceState program.
+struct DeviceStateOp {
+  enum class Kind : uint8_t {
+    // Write `value` into a DWORD.
+    Dword,
+
+    // Read an Axis from DeviceInputs and write it as a DWORD scaled onto the object's range.
+    Axis,
+
+    // Read a Button from DeviceInputs and write it as a BYTE.
+    Button,
+
+    // Read a Hat from DeviceInputs and write its POV value (from a lookup table) as a DWORD.
+    Hat,
+  };
+
+  // Offset into the application's data format.
+  uint32_t offset;
+  Kind kind;
+
+  // Offset into DeviceInputs of the value to read, for Axis, Button, and Hat.
+  uint16_t source;
+
+  // Constant value for Dword.
+  DWORD value;
+
+  // Axis parameters, precomputed from the object's properties.
+  double scale;
+  double bias;
+  double deadzone;
+  double saturation;
+};
+
+// The objects matched by SetDataFormat, compiled into a flat list of writes sorted by offset.
+// Everything that can be checked is checked by Compile, so that Execute can run without any
+// per-call validation.
+class DeviceStateProgram {
+ public:
+  bool Compile(const std::vector<DeviceFormat>& formats,
+               const std::vector<DeviceFormatDefault>& defaults, size_t data_size);
+  void Execute(char* output_buffer, const DeviceInputs& inputs) const;
+
+  // Convert a buffered input event into the application's data format.
+  // Returns false if the object isn't part of the data format.
+  bool Translate(const InputEvent& event, DIDEVICEOBJECTDATA* out) const;
+
+  size_t data_size() const { return data_size_; }
+
+ private:
+  std::vector<DeviceStateOp> ops_;
+  size_t data_size_ = 0;
+};
+
 }  // namespace dhc
@@ -4,6 +4,8 @@
 #define DIRECTINPUT_VERSION 0x0800
 #include <dinput.h>
 
+#include <algorithm>
+#include <cmath>
 #include <deque>
 #include <optional>
 #include <string>
@@ -13,6 +15,7 @@
 
 #include "dhc/dhc.h"
 #include "dhc/logging.h"
+#include "dhc/tracing.h"
 #include "dhc_dinput.h"
 
 using namespace std::string_literals;
@@ -43,15 +46,21 @@ template <typename CharType>
 class EmulatedDirectInput8 : public com_base<DI8Interface<CharType>> {
  public:
   explicit EmulatedDirectInput8(com_ptr<DI8Interface<CharType>> real) : real_(std::move(real)) {
+    // Devices are only created once the game asks for them, since there can be a lot of them.
     if (!dhc_xinput_is_enabled()) {
-      for (size_t i = 0; i < dhc_get_device_count(); ++i) {
-        devices_.emplace_back(new EmulatedDirectInputDevice8<CharType>(i));
-      }
+      devices_.resize(dhc_get_device_count());
     }
   }
 
   virtual ~EmulatedDirectInput8() = default;
 
+ protected:
+  // Games let go of DirectInput when they shut down, which is our chance to export spans while
+  // we're still being called by the game, rather than under the loader lock.
+  virtual void Released() override final { DHC_TRACE_EXPORT(); }
+
+ public:
+
   virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** obj) override final {
     if (!obj) {
       return E_INVALIDARG;
@@ -83,9 +92,13 @@ class EmulatedDirectInput8 : public com_base<DI8Interface<CharType>> {
     }
 
     std::optional<uintptr_t> dhc_idx = parse_dhc_guid(refguid);
-    if (dhc_idx) {
+    if (dhc_idx && *dhc_idx < devices_.size()) {
       LOG(INFO) << "DirectInput8::CreateDevice(" << to_string(refguid) << ") = success";
-      *device = this->devices_[*dhc_idx].clone().release();
+      auto& slot = this->devices_[*dhc_idx];
+      if (!slot) {
+        slot.reset(new EmulatedDirectInputDevice8<CharType>(*dhc_idx));
+      }
+      *device = slot.clone().release();
       return DI_OK;
     }
 
@@ -150,11 +163,8 @@ class EmulatedDirectInput8 : public com_base<DI8Interface<CharType>> {
     if (enum_sticks) {
       DI8DeviceInstance<CharType> dev = {};
       dev.dwSize = sizeof(dev);
-      for (auto& device : devices_) {
-        if (device->GetDeviceInfo(&dev) != DI_OK) {
-          LOG(FATAL) << "GetDeviceInfo returned failure";
-        }
-
+      for (size_t i = 0; i < devices_.size(); ++i) {
+        EmulatedDirectInputDevice8<CharType>::FillDeviceInstance(&dev, i);
         if (callback(&dev, callback_arg) == DIENUM_STOP) {
           return DI_OK;
         }
@@ -373,7 +383,10 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
     } else if (&guid == &DIPROP_AXISMODE) {
       UNIMPLEMENTED_DEVICE_PROPERTY(DIPROP_AXISMODE);
     } else if (&guid == &DIPROP_BUFFERSIZE) {
-      UNIMPLEMENTED_DEVICE_PROPERTY(DIPROP_BUFFERSIZE);
+      DEVICE_PROPERTY(DIPROP_BUFFERSIZE);
+      if (prop_header->dwSize != sizeof(DIPROPDWORD)) return DIERR_INVALIDPARAM;
+      reinterpret_cast<DIPROPDWORD*>(prop_header)->dwData = buffer_size_;
+      return DI_OK;
     } else if (&guid == &DIPROP_FFGAIN) {
       UNIMPLEMENTED_DEVICE_PROPERTY(DIPROP_FFGAIN);
     } else if (&guid == &DIPROP_INSTANCENAME) {
@@ -446,7 +459,15 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
       LOG(WARNING) << "DIPROP_AXISMODE unimplemented";
       return DI_OK;
     } else if (&guid == &DIPROP_BUFFERSIZE) {
-      UNIMPLEMENTED_DEVICE_PROPERTY(DIPROP_BUFFERSIZE);
+      DEVICE_PROPERTY(DIPROP_BUFFERSIZE);
+      if (prop_header->dwSize != sizeof(DIPROPDWORD)) return DIERR_INVALIDPARAM;
+      buffer_size_ = reinterpret_cast<const DIPROPDWORD*>(prop_header)->dwData;
+      LOG(DEBUG) << "Setting buffer size to " << buffer_size_;
+
+      // Changing the buffer size discards anything that was already buffered.
+      dhc_consume_device_data(vdev_, dhc_get_device_data_count(vdev_));
+      dhc_take_device_data_overflow(vdev_);
+      return DI_OK;
     } else if (&guid == &DIPROP_FFGAIN) {
       UNIMPLEMENTED_DEVICE_PROPERTY(DIPROP_FFGAIN);
     } else if (&guid == &DIPROP_INSTANCENAME) {
@@ -482,7 +503,7 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
         LOG(DEBUG) << "Setting saturation for axis " << object->name << " to " << value;
         object->saturation = value / 10000.0;
       }
-      return DI_OK;
+      return CompileDeviceState() ? DI_OK : DIERR_INVALIDPARAM;
     } else if (&guid == &DIPROP_RANGE) {
       if (!(object->type & DIDFT_AXIS)) {
         LOG(DEBUG) << "attempted to set DIPROP_RANGE on non-axis";
@@ -499,7 +520,7 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
       LOG(DEBUG) << "Setting range for axis " << object->name << " to [" << range->lMin << ", "
                  << range->lMax << "]";
       std::tie(object->range_min, object->range_max) = std::tie(range->lMin, range->lMax);
-      return DI_OK;
+      return CompileDeviceState() ? DI_OK : DIERR_INVALIDPARAM;
     }
 
     UNIMPLEMENTED(FATAL);
@@ -516,26 +537,89 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
   }
 
   virtual HRESULT STDMETHODCALLTYPE GetDeviceState(DWORD size, void* buffer) override final {
-    LOG(VERBOSE) << "EmulatedDirectInput8Device::GetDeviceState(" << size << ")";
+    DHC_TRACE_SPAN("GetDeviceState");
+    if (size < state_program_.data_size()) {
+      LOG(ERROR) << "EmulatedDirectInput8Device::GetDeviceState: buffer size " << size
+                 << " is smaller than data format size " << state_program_.data_size();
+      return DIERR_INVALIDPARAM;
+    }
+
     memset(buffer, 0, size);
     DeviceInputs inputs = dhc_get_inputs(vdev_);
-    for (const auto& fmt : device_formats_) {
-      fmt.Apply(static_cast<char*>(buffer), size, inputs);
-    }
-    for (const auto& fmt_default : device_format_defaults_) {
-      *reinterpret_cast<DWORD*>(static_cast<char*>(buffer) + fmt_default.offset) =
-          fmt_default.value;
-    }
+    state_program_.Execute(static_cast<char*>(buffer), inputs);
     return DI_OK;
   }
 
-  virtual HRESULT STDMETHODCALLTYPE GetDeviceData(DWORD, DIDEVICEOBJECTDATA*, DWORD*,
-                                                  DWORD) override final {
-    UNIMPLEMENTED(FATAL);
-    return DIERR_NOTINITIALIZED;
+  virtual HRESULT STDMETHODCALLTYPE GetDeviceData(DWORD object_data_size, DIDEVICEOBJECTDATA* object_data,
+                                                  DWORD* inout, DWORD flags) override final {
+    if (object_data_size != sizeof(DIDEVICEOBJECTDATA) && object_data_size != sizeof(DIDEVICEOBJECTDATA_DX3)) {
+      LOG(ERROR) << "EmulatedDirectInput8Device::GetDeviceData: received invalid object size "
+                 << object_data_size;
+      return DIERR_INVALIDPARAM;
+    }
+
+    if (!inout) {
+      return DIERR_INVALIDPARAM;
+    }
+
+    if (buffer_size_ == 0) {
+      return DIERR_NOTBUFFERED;
+    }
+
+    // Peeking leaves the overflow flag set, so that the next real read still reports it.
+    bool peek = flags & DIGDD_PEEK;
+    bool overflowed = peek ? dhc_peek_device_data_overflow(vdev_) : dhc_take_device_data_overflow(vdev_);
+    HRESULT result = overflowed ? DI_BUFFEROVERFLOW : DI_OK;
+
+    // The ring holds more than DIPROP_BUFFERSIZE events, so the application's buffer has
+    // overflowed as soon as more than that many are pending, well before the ring itself drops
+    // anything. Events beyond what would have fit are dropped, oldest first.
+    size_t consumed = 0;
+    size_t pending = dhc_get_device_data_count(vdev_);
+    if (pending > buffer_size_) {
+      consumed = pending - buffer_size_;
+      result = DI_BUFFEROVERFLOW;
+    }
+
+    // Events for objects that aren't in the data format get consumed without being returned.
+    DWORD requested = *inout;
+    DWORD written = 0;
+    char* output = reinterpret_cast<char*>(object_data);
+    InputEvent events[32];
+    while (written < requested) {
+      size_t count = dhc_peek_device_data(vdev_, consumed, events, sizeof(events) / sizeof(events[0]));
+      if (count == 0) {
+        break;
+      }
+
+      size_t i = 0;
+      for (; i < count && written < requested; ++i) {
+        DIDEVICEOBJECTDATA data;
+        if (!state_program_.Translate(events[i], &data)) {
+          continue;
+        }
+        if (output) {
+          memcpy(output + written * object_data_size, &data, object_data_size);
+        }
+        ++written;
+      }
+
+      consumed += i;
+      if (i < count) {
+        break;
+      }
+    }
+
+    if (!peek) {
+      dhc_consume_device_data(vdev_, consumed);
+    }
+
+    *inout = written;
+    return result;
   }
 
   virtual HRESULT STDMETHODCALLTYPE SetDataFormat(const DIDATAFORMAT* data_format) override final {
+    DHC_TRACE_SPAN("SetDataFormat");
     LOG(VERBOSE) << "EmulatedDirectInput8Device::SetDataFormat";
 
     if (sizeof(DIDATAFORMAT) != data_format->dwSize) {
@@ -605,13 +689,20 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
         }
       }
     }
+
+    data_size_ = data_format->dwDataSize;
+    if (!CompileDeviceState()) {
+      return DIERR_INVALIDPARAM;
+    }
+
     LOG(VERBOSE) << "SetDataFormat done";
     return DI_OK;
   }
 
-  virtual HRESULT STDMETHODCALLTYPE SetEventNotification(HANDLE) override final {
-    UNIMPLEMENTED(FATAL);
-    return DIERR_NOTINITIALIZED;
+  virtual HRESULT STDMETHODCALLTYPE SetEventNotification(HANDLE event) override final {
+    LOG(DEBUG) << "EmulatedDirectInput8Device::SetEventNotification(" << event << ")";
+    dhc_set_event_notification(vdev_, event);
+    return DI_OK;
   }
 
   virtual HRESULT STDMETHODCALLTYPE SetCooperativeLevel(HWND, DWORD flags) override final {
@@ -655,14 +746,20 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
       return DIERR_INVALIDPARAM;
     }
 
-    memset(device_instance, 0, device_instance->dwSize);
+    FillDeviceInstance(device_instance, this->vdev_);
+    return DI_OK;
+  }
+
+  // Describe a device without having to create it.
+  static void FillDeviceInstance(DI8DeviceInstance<CharType>* device_instance, uintptr_t vdev) {
+    GUID guid = create_dhc_guid(vdev);
+    memset(device_instance, 0, sizeof(*device_instance));
     device_instance->dwSize = sizeof(*device_instance);
     device_instance->dwDevType = DI8DEVTYPE_GAMEPAD | (DI8DEVTYPEGAMEPAD_STANDARD << 8);
-    device_instance->guidInstance = this->guid_;
-    device_instance->guidProduct = this->guid_;
-    tsnprintf(device_instance->tszInstanceName, MAX_PATH, "DHC P%ld", static_cast<long>(this->vdev_ + 1));
-    tsnprintf(device_instance->tszProductName, MAX_PATH, "DHC P%ld", static_cast<long>(this->vdev_ + 1));
-    return DI_OK;
+    device_instance->guidInstance = guid;
+    device_instance->guidProduct = guid;
+    tsnprintf(device_instance->tszInstanceName, MAX_PATH, "DHC P%ld", static_cast<long>(vdev + 1));
+    tsnprintf(device_instance->tszProductName, MAX_PATH, "DHC P%ld", static_cast<long>(vdev + 1));
   }
 
   virtual HRESULT STDMETHODCALLTYPE RunControlPanel(HWND, DWORD) override final {
@@ -716,6 +813,7 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
   }
 
   virtual HRESULT STDMETHODCALLTYPE Poll() override final {
+    DHC_TRACE_SPAN("Poll");
     LOG(VERBOSE) << "EmulatedDirectInput8Device::Poll()";
     dhc_update();
     return DI_OK;
@@ -759,12 +857,22 @@ class EmulatedDirectInputDevice8 : public com_base<DI8DeviceInterface<CharType>>
   }
 
  private:
+  // Rebuild the GetDeviceState program after the data format or an object property changes.
+  bool CompileDeviceState() {
+    return state_program_.Compile(device_formats_, device_format_defaults_, data_size_);
+  }
+
   uintptr_t vdev_;
   GUID guid_;
   std::vector<DIOBJECTDATAFORMAT> object_data_format_;
   std::vector<EmulatedDeviceObject> objects_;
   std::vector<DeviceFormat> device_formats_;
   std::vector<DeviceFormatDefault> device_format_defaults_;
+  size_t data_size_ = 0;
+  DeviceStateProgram state_program_;
+
+  // DIPROP_BUFFERSIZE, or 0 if buffered input is disabled.
+  DWORD buffer_size_ = 0;
 };
 
 using EmulatedDirectInput8W = EmulatedDirectInput8<wchar_t>;
@@ -780,107 +888,283 @@ IDirectInput8A* GetEmulatedDirectInput8A() {
   return instance;
 }
 
-void DeviceFormat::Apply(char* output_buffer, size_t output_buffer_length,
-                         DeviceInputs inputs) const {
-  std::visit(
-      [&](auto&& arg) {
-        using T = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_same_v<T, std::monostate>) {
-          if (object->type & DIDFT_BUTTON) {
-            output_buffer[offset] = 0;
-            CHECK_GE(output_buffer_length, offset + 1);
-          } else if (object->type & DIDFT_AXIS) {
-            CHECK_EQ(0ULL, offset % 4);
-            CHECK_GE(output_buffer_length, offset + 4);
-            *reinterpret_cast<DWORD*>(&output_buffer[offset]) =
-                (object->range_min + object->range_max) / 2;
+// POV values for each Hat, indexed by its discriminant.
+static constexpr DWORD kPovValues[] = {
+    static_cast<DWORD>(-1),  // Neutral
+    0,                       // North
+    4500,                    // NorthEast
+    9000,                    // East
+    13500,                   // SouthEast
+    18000,                   // South
+    22500,                   // SouthWest
+    27000,                   // West
+    31500,                   // NorthWest
+};
+static_assert(sizeof(kPovValues) / sizeof(kPovValues[0]) == static_cast<size_t>(Hat::NorthWest) + 1);
+
+static uint16_t GetAxisSource(AxisType axis) {
+  switch (axis) {
+    case AxisType::LeftStickX:
+      return offsetof(DeviceInputs, axis_left_stick_x);
+    case AxisType::LeftStickY:
+      return offsetof(DeviceInputs, axis_left_stick_y);
+    case AxisType::RightStickX:
+      return offsetof(DeviceInputs, axis_right_stick_x);
+    case AxisType::RightStickY:
+      return offsetof(DeviceInputs, axis_right_stick_y);
+    case AxisType::LeftTrigger:
+      return offsetof(DeviceInputs, axis_left_trigger);
+    case AxisType::RightTrigger:
+      return offsetof(DeviceInputs, axis_right_trigger);
+  }
+  __builtin_unreachable();
+}
+
+static uint16_t GetButtonSource(ButtonType button) {
+  switch (button) {
+    case ButtonType::Start:
+      return offsetof(DeviceInputs, button_start);
+    case ButtonType::Select:
+      return offsetof(DeviceInputs, button_select);
+    case ButtonType::Home:
+      return offsetof(DeviceInputs, button_home);
+    case ButtonType::North:
+      return offsetof(DeviceInputs, button_north);
+    case ButtonType::East:
+      return offsetof(DeviceInputs, button_east);
+    case ButtonType::South:
+      return offsetof(DeviceInputs, button_south);
+    case ButtonType::West:
+      return offsetof(DeviceInputs, button_west);
+    case ButtonType::L1:
+      return offsetof(DeviceInputs, button_l1);
+    case ButtonType::L2:
+      return offsetof(DeviceInputs, button_l2);
+    case ButtonType::L3:
+      return offsetof(DeviceInputs, button_l3);
+    case ButtonType::R1:
+      return offsetof(DeviceInputs, button_r1);
+    case ButtonType::R2:
+      return offsetof(DeviceInputs, button_r2);
+    case ButtonType::R3:
+      return offsetof(DeviceInputs, button_r3);
+    case ButtonType::Trackpad:
+      return offsetof(DeviceInputs, button_trackpad);
+  }
+  __builtin_unreachable();
+}
+
+static uint16_t GetHatSource(HatType hat) {
+  switch (hat) {
+    case HatType::DPad:
+      return offsetof(DeviceInputs, hat_dpad);
+  }
+  __builtin_unreachable();
+}
+
+bool DeviceStateProgram::Compile(const std::vector<DeviceFormat>& formats,
+                                 const std::vector<DeviceFormatDefault>& defaults, size_t data_size) {
+  std::vector<DeviceStateOp> ops;
+
+  auto push_op = [&](size_t offset, DeviceStateOp::Kind kind) -> DeviceStateOp* {
+    size_t width = 4;
+    if (kind == DeviceStateOp::Kind::Button) {
+      width = 1;
+    } else if (offset % 4 != 0) {
+      LOG(ERROR) << "DeviceStateProgram: misaligned DWORD at offset " << offset;
+      return nullptr;
+    }
+
+    if (offset + width > data_size) {
+      LOG(ERROR) << "DeviceStateProgram: offset " << offset << " overflows data size " << data_size;
+      return nullptr;
+    }
+
+    DeviceStateOp op = {};
+    op.offset = static_cast<uint32_t>(offset);
+    op.kind = kind;
+    ops.push_back(op);
+    return &ops.back();
+  };
+
+  for (const auto& format : formats) {
+    const EmulatedDeviceObject* object = format.object.get();
+    bool valid = std::visit(
+        [&](auto&& arg) {
+          using T = std::decay_t<decltype(arg)>;
+          if constexpr (std::is_same_v<T, std::monostate>) {
+            if (object->type & DIDFT_BUTTON) {
+              // Unmapped buttons are left zeroed by GetDeviceState.
+              return true;
+            } else if (object->type & DIDFT_AXIS) {
+              DeviceStateOp* op = push_op(format.offset, DeviceStateOp::Kind::Dword);
+              if (!op) return false;
+              op->value = (object->range_min + object->range_max) / 2;
+              return true;
+            }
+            LOG(ERROR) << "DeviceStateProgram: unhandled type " << object->type;
+            return false;
+          } else if constexpr (std::is_same_v<T, AxisType>) {
+            if (!(object->type & DIDFT_AXIS)) return false;
+            DeviceStateOp* op = push_op(format.offset, DeviceStateOp::Kind::Axis);
+            if (!op) return false;
+            op->source = GetAxisSource(arg);
+            op->scale = object->range_max - object->range_min;
+            op->bias = object->range_min;
+            op->deadzone = object->deadzone;
+            op->saturation = object->saturation;
+            return true;
+          } else if constexpr (std::is_same_v<T, ButtonType>) {
+            if (!(object->type & DIDFT_BUTTON)) return false;
+            DeviceStateOp* op = push_op(format.offset, DeviceStateOp::Kind::Button);
+            if (!op) return false;
+            op->source = GetButtonSource(arg);
+            return true;
           } else {
-            LOG(FATAL) << "unhandled type " << object->type;
-          }
-        } else if constexpr (std::is_same_v<T, AxisType>) {
-          CHECK(object->type & DIDFT_AXIS);
-          CHECK_EQ(0ULL, offset % 4);
-          CHECK_GE(output_buffer_length, offset + 4);
-          auto value = dhc_get_axis(&inputs, arg);
-          double distance = abs(value - 0.5);
-          if (distance * 2 >= object->saturation) {
-            value = value > 0.5 ? 1.0 : 0.0;
-          } else if (distance * 2 <= object->deadzone) {
-            value = 0.5;
+            static_assert(std::is_same_v<T, HatType>);
+            if (!(object->type & DIDFT_POV)) return false;
+            DeviceStateOp* op = push_op(format.offset, DeviceStateOp::Kind::Hat);
+            if (!op) return false;
+            op->source = GetHatSource(arg);
+            return true;
           }
+        },
+        object->mapped_object);
 
-          DWORD lerped = static_cast<DWORD>(lerp(value, object->range_min, object->range_max));
-          LOG(VERBOSE) << "lerping " << object->name << " value " << value << " onto ["
-                       << object->range_min << ", " << object->range_max
-                       << "] = " << static_cast<long>(lerped);
-          *reinterpret_cast<DWORD*>(&output_buffer[offset]) = lerped;
-        } else if constexpr (std::is_same_v<T, ButtonType>) {
-          CHECK(object->type & DIDFT_BUTTON);
-          CHECK_GE(output_buffer_length, offset + 1);
-          auto value = dhc_get_button(&inputs, arg);
-          output_buffer[offset] = value ? -128 : 0;
-        } else if constexpr (std::is_same_v<T, HatType>) {
-          CHECK(object->type & DIDFT_POV);
-          CHECK_EQ(0ULL, offset % 4);
-          CHECK_GE(output_buffer_length, offset + 4);
-          auto hat = dhc_get_hat(&inputs, arg);
-          DWORD value = 0;
-          switch (hat) {
-          case Hat::Neutral:
-            value = -1;
-            break;
-
-          case Hat::North:
-            value = 0;
-            break;
-
-          case Hat::NorthEast:
-            value = 4500;
-            break;
-
-          case Hat::East:
-            value = 9000;
-            break;
-
-          case Hat::SouthEast:
-            value = 13500;
-            break;
-
-          case Hat::South:
-            value = 18000;
-            break;
-
-          case Hat::SouthWest:
-            value = 22500;
-            break;
-
-          case Hat::West:
-            value = 27000;
-            break;
-
-          case Hat::NorthWest:
-            value = 31500;
-            break;
-          }
-          *reinterpret_cast<DWORD *>(&output_buffer[offset]) = value;
-        } else {
-          LOG(FATAL) << "unhandled type?";
-        }
-      },
-      object->mapped_object);
+    if (!valid) {
+      LOG(ERROR) << "DeviceStateProgram: failed to compile " << object->name << " at offset "
+                 << format.offset;
+      return false;
+    }
+  }
+
+  for (const auto& fmt_default : defaults) {
+    DeviceStateOp* op = push_op(fmt_default.offset, DeviceStateOp::Kind::Dword);
+    if (!op) {
+      return false;
+    }
+    op->value = fmt_default.value;
+  }
+
+  std::stable_sort(ops.begin(), ops.end(),
+                   [](const DeviceStateOp& lhs, const DeviceStateOp& rhs) { return lhs.offset < rhs.offset; });
+
+  LOG(DEBUG) << "DeviceStateProgram: compiled " << ops.size() << " ops for data size " << data_size;
+  ops_ = std::move(ops);
+  data_size_ = data_size;
+  return true;
+}
+
+static DWORD MapAxis(const DeviceStateOp& op, float axis) {
+  double value = axis;
+  double distance = std::abs(value - 0.5) * 2;
+  if (distance >= op.saturation) {
+    value = value > 0.5 ? 1.0 : 0.0;
+  } else if (distance <= op.deadzone) {
+    value = 0.5;
+  }
+  // Ranges can be negative, and converting a negative double straight to DWORD is undefined.
+  return static_cast<DWORD>(static_cast<LONG>(op.bias + value * op.scale));
+}
+
+void DeviceStateProgram::Execute(char* output_buffer, const DeviceInputs& inputs) const {
+  const char* input_buffer = reinterpret_cast<const char*>(&inputs);
+  for (const DeviceStateOp& op : ops_) {
+    char* dst = output_buffer + op.offset;
+    const char* src = input_buffer + op.source;
+    switch (op.kind) {
+      case DeviceStateOp::Kind::Dword:
+        memcpy(dst, &op.value, sizeof(DWORD));
+        break;
+
+      case DeviceStateOp::Kind::Axis: {
+        float axis;
+        memcpy(&axis, src, sizeof(axis));
+        DWORD scaled = MapAxis(op, axis);
+        memcpy(dst, &scaled, sizeof(DWORD));
+        break;
+      }
+
+      case DeviceStateOp::Kind::Button:
+        *dst = *reinterpret_cast<const bool*>(src) ? -128 : 0;
+        break;
+
+      case DeviceStateOp::Kind::Hat: {
+        Hat hat;
+        memcpy(&hat, src, sizeof(hat));
+        memcpy(dst, &kPovValues[static_cast<size_t>(hat)], sizeof(DWORD));
+        break;
+      }
+    }
+  }
+}
+
+bool DeviceStateProgram::Translate(const InputEvent& event, DIDEVICEOBJECTDATA* out) const {
+  DeviceStateOp::Kind kind;
+  uint16_t source;
+  switch (event.object_type) {
+    case InputObjectType::Axis:
+      kind = DeviceStateOp::Kind::Axis;
+      source = GetAxisSource(static_cast<AxisType>(event.object_index));
+      break;
+    case InputObjectType::Button:
+      kind = DeviceStateOp::Kind::Button;
+      source = GetButtonSource(static_cast<ButtonType>(event.object_index));
+      break;
+    case InputObjectType::Hat:
+      kind = DeviceStateOp::Kind::Hat;
+      source = GetHatSource(static_cast<HatType>(event.object_index));
+      break;
+    default:
+      return false;
+  }
+
+  for (const DeviceStateOp& op : ops_) {
+    if (op.kind != kind || op.source != source) {
+      continue;
+    }
+
+    out->dwOfs = op.offset;
+    switch (kind) {
+      case DeviceStateOp::Kind::Axis:
+        out->dwData = MapAxis(op, event.axis._0);
+        break;
+      case DeviceStateOp::Kind::Button:
+        out->dwData = event.button._0 ? 0x80 : 0;
+        break;
+      case DeviceStateOp::Kind::Hat:
+        out->dwData = kPovValues[static_cast<size_t>(event.hat)];
+        break;
+      default:
+        __builtin_unreachable();
+    }
+    out->dwTimeStamp = event.timestamp;
+    out->dwSequence = event.sequence;
+    out->uAppData = 0;
+    return true;
+  }
+  return false;
 }
 
 }  // namespace dhc
 
-BOOL WINAPI DllMain(HMODULE module, DWORD reason, void *) {
+BOOL WINAPI DllMain(HMODULE module, DWORD reason, void *reserved) {
   switch (reason) {
   case DLL_PROCESS_ATTACH:
     DisableThreadLibraryCalls(module);
     break;
 
+  case DLL_PROCESS_DETACH:
+    dhc_log_flush();
+
+    // dhc outlives us when we're unloaded with FreeLibrary, and mustn't keep a pointer into us.
+    if (!reserved) {
+      dhc_log_unregister();
+    }
+    break;
+
   case DLL_THREAD_ATTACH:
   case DLL_THREAD_DETACH:
-  case DLL_PROCESS_DETACH:
     break;
   }
   return TRUE;
@@ -890,7 +1174,7 @@ extern "C" HRESULT WINAPI DirectInput8Create(HINSTANCE hinst, DWORD version,
                                              REFIID desired_interface,
                                              void **out_interface,
                                              IUnknown *unknown) {
-  dhc_init();
+  dhc_init_dll();
 
   bool unicode = desired_interface == IID_IDirectInput8W;
   if (!unicode) {
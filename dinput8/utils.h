@@ -78,11 +78,16 @@ struct com_base : public T {
   virtual ULONG STDMETHODCALLTYPE Release() override final {
     ULONG rc = --ref_count_;
     if (rc == 0) {
+      Released();
       delete this;
     }
     return rc;
   }
 
+ protected:
+  // Called when the last reference goes away, from the caller's Release, before destruction.
+  virtual void Released() {}
+
  private:
   std::atomic<ULONG> ref_count_;
 };
@@ -5,40 +5,57 @@
 
 #include <cguid.h>
 
+#include <array>
+
 #include "dhc/dhc.h"
 #include "dhc/logging.h"
+#include "dhc/tracing.h"
 
 extern "C" {
 
-BOOL WINAPI DllMain(HMODULE module, DWORD reason, void*) {
+BOOL WINAPI DllMain(HMODULE module, DWORD reason, void* reserved) {
   switch (reason) {
     case DLL_PROCESS_ATTACH:
       DisableThreadLibraryCalls(module);
       break;
 
+    case DLL_PROCESS_DETACH:
+      dhc_log_flush();
+
+      // dhc outlives us when we're unloaded with FreeLibrary, and mustn't keep a pointer into us.
+      if (!reserved) {
+        dhc_log_unregister();
+      }
+      break;
+
     case DLL_THREAD_ATTACH:
     case DLL_THREAD_DETACH:
-    case DLL_PROCESS_DETACH:
       break;
   }
   return TRUE;
 }
 
-static uintptr_t device_count() {
-  static uintptr_t cached = []() {
-    dhc_init();
-    return dhc_get_device_count();
+// Virtual device behind each XInput user index, or -1 if there isn't one.
+static intptr_t xinput_slot(DWORD user_index) {
+  static std::array<intptr_t, XUSER_MAX_COUNT> slots = []() {
+    dhc_init_dll();
+    std::array<intptr_t, XUSER_MAX_COUNT> result;
+    for (size_t i = 0; i < result.size(); ++i) {
+      uintptr_t device_index;
+      result[i] = dhc_get_xinput_slot(i, &device_index) ? static_cast<intptr_t>(device_index) : -1;
+    }
+    return result;
   }();
-  return cached;
+  return user_index < slots.size() ? slots[user_index] : -1;
 }
 
-#define CHECK_DEVICE_INDEX(idx)          \
-  do {                                   \
-    if (!dhc_xinput_is_enabled()) {      \
-      return ERROR_DEVICE_NOT_CONNECTED; \
-    } else if (idx >= device_count()) {  \
-      return ERROR_DEVICE_NOT_CONNECTED; \
-    }                                    \
+#define CHECK_DEVICE_INDEX(idx)           \
+  do {                                    \
+    if (!dhc_xinput_is_enabled()) {       \
+      return ERROR_DEVICE_NOT_CONNECTED;  \
+    } else if (xinput_slot(idx) < 0) {    \
+      return ERROR_DEVICE_NOT_CONNECTED;  \
+    }                                     \
   } while (0)
 
 #define LOG_ONCE(msg)                                \
@@ -48,86 +65,20 @@ static uintptr_t device_count() {
   }()
 
 DWORD WINAPI XInputGetState(DWORD user_index, XINPUT_STATE* state) {
-  dhc_init();
+  DHC_TRACE_SPAN("XInputGetState");
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
 
-  // This is a horrible, thread-unsafe hack, but it should be good enough.
-  static DWORD packet_number;
-  state->dwPacketNumber = packet_number++;
-
+  // The input thread has already rendered the state and its packet number.
+  static_assert(sizeof(XInputState) == sizeof(XINPUT_STATE));
   dhc_update();
-  DeviceInputs inputs = dhc_get_inputs(user_index);
-  WORD buttons = 0;
-  switch (inputs.hat_dpad) {
-    case Hat::Neutral:
-      break;
-    case Hat::North:
-      buttons |= XINPUT_GAMEPAD_DPAD_UP;
-      break;
-    case Hat::NorthEast:
-      buttons |= XINPUT_GAMEPAD_DPAD_UP | XINPUT_GAMEPAD_DPAD_RIGHT;
-      break;
-    case Hat::East:
-      buttons |= XINPUT_GAMEPAD_DPAD_RIGHT;
-      break;
-    case Hat::SouthEast:
-      buttons |= XINPUT_GAMEPAD_DPAD_DOWN | XINPUT_GAMEPAD_DPAD_RIGHT;
-      break;
-    case Hat::South:
-      buttons |= XINPUT_GAMEPAD_DPAD_DOWN;
-      break;
-    case Hat::SouthWest:
-      buttons |= XINPUT_GAMEPAD_DPAD_DOWN | XINPUT_GAMEPAD_DPAD_LEFT;
-      break;
-    case Hat::West:
-      buttons |= XINPUT_GAMEPAD_DPAD_LEFT;
-      break;
-    case Hat::NorthWest:
-      buttons |= XINPUT_GAMEPAD_DPAD_UP | XINPUT_GAMEPAD_DPAD_LEFT;
-      break;
-  }
-
-#define ASSIGN_BUTTON(value, field) \
-  do {                              \
-    if (inputs.field._0) {          \
-      buttons |= value;             \
-    }                               \
-  } while (0)
-
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_START, button_start);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_BACK, button_select);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_LEFT_THUMB, button_l3);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_RIGHT_THUMB, button_r3);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_LEFT_SHOULDER, button_l1);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_RIGHT_SHOULDER, button_r1);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_A, button_south);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_B, button_east);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_X, button_west);
-  ASSIGN_BUTTON(XINPUT_GAMEPAD_Y, button_north);
-
-  state->Gamepad.wButtons = buttons;
-  state->Gamepad.bLeftTrigger = inputs.axis_left_trigger._0 * 255;
-  state->Gamepad.bRightTrigger = inputs.axis_right_trigger._0 * 255;
-
-  auto clamp = [](double x) {
-    if (x > 32767) {
-      return 32767;
-    } else if (x < -32768) {
-      return -32768;
-    } else {
-      return static_cast<int>(x);
-    }
-  };
-
-  state->Gamepad.sThumbLX = clamp(65536.0 * inputs.axis_left_stick_x._0 - 32768.0);
-  state->Gamepad.sThumbLY = clamp(32768.0 - 65536.0 * inputs.axis_left_stick_y._0);
-  state->Gamepad.sThumbRX = clamp(65536.0 * inputs.axis_right_stick_x._0 - 32768.0);
-  state->Gamepad.sThumbRY = clamp(32768.0 - 65536.0 * inputs.axis_right_stick_y._0);
+  XInputState xinput_state = dhc_get_xinput_state(xinput_slot(user_index));
+  memcpy(state, &xinput_state, sizeof(*state));
   return ERROR_SUCCESS;
 }
 
 DWORD WINAPI XInputSetState(DWORD user_index, XINPUT_VIBRATION* vibration) {
-  dhc_init();
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
   LOG_ONCE("XInputSetState unimplemented");
   return ERROR_SUCCESS;
@@ -135,7 +86,7 @@ DWORD WINAPI XInputSetState(DWORD user_index, XINPUT_VIBRATION* vibration) {
 
 DWORD WINAPI XInputGetCapabilities(DWORD user_index, DWORD flags,
                                    XINPUT_CAPABILITIES* capabilities) {
-  dhc_init();
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
 
   capabilities->Type = XINPUT_DEVTYPE_GAMEPAD;
@@ -154,7 +105,7 @@ DWORD WINAPI XInputGetCapabilities(DWORD user_index, DWORD flags,
 }
 
 void WINAPI XInputEnable(BOOL enable) {
-  dhc_init();
+  dhc_init_dll();
   if (!enable) {
     LOG_ONCE("XInputEnable unimplemented");
   }
@@ -162,7 +113,7 @@ void WINAPI XInputEnable(BOOL enable) {
 
 DWORD WINAPI XInputGetDSoundAudioDeviceGuids(DWORD user_index, GUID* render_guid,
                                              GUID* capture_guid) {
-  dhc_init();
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
   *render_guid = GUID_NULL;
   *capture_guid = GUID_NULL;
@@ -171,7 +122,7 @@ DWORD WINAPI XInputGetDSoundAudioDeviceGuids(DWORD user_index, GUID* render_guid
 
 DWORD WINAPI XInputGetBatteryInformation(DWORD user_index, BYTE dev_type,
                                          XINPUT_BATTERY_INFORMATION* battery_information) {
-  dhc_init();
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
   battery_information->BatteryType = BATTERY_TYPE_WIRED;
   battery_information->BatteryLevel = BATTERY_LEVEL_FULL;
@@ -179,7 +130,7 @@ DWORD WINAPI XInputGetBatteryInformation(DWORD user_index, BYTE dev_type,
 }
 
 DWORD WINAPI XInputGetKeystroke(DWORD user_index, DWORD reserved, XINPUT_KEYSTROKE* keystroke) {
-  dhc_init();
+  dhc_init_dll();
   CHECK_DEVICE_INDEX(user_index);
   LOG_ONCE("XInputGetKeystroke is unimplemented");
   return ERROR_EMPTY;